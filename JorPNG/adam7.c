@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "adam7.h"
+
+const Adam7Pass adam7_passes[ADAM7_PASSES] = {
+  { 0, 0, 8, 8 },
+  { 4, 0, 8, 8 },
+  { 0, 4, 4, 8 },
+  { 2, 0, 4, 4 },
+  { 0, 2, 2, 4 },
+  { 1, 0, 2, 2 },
+  { 0, 1, 1, 2 }
+};
+
+// Number of columns of the image in the pass, 0 for an empty pass
+uint32_t adam7_pass_width(int pass, uint32_t width) {
+  const Adam7Pass* p = &adam7_passes[pass];
+  return width > p->x0 ? (width - p->x0 + p->dx - 1) / p->dx : 0;
+}
+
+uint32_t adam7_pass_height(int pass, uint32_t height) {
+  const Adam7Pass* p = &adam7_passes[pass];
+  return height > p->y0 ? (height - p->y0 + p->dy - 1) / p->dy : 0;
+}
+
+// Size of the inflated data of an interlaced image. Empty passes have no
+// scanlines and so no filter type bytes either.
+size_t adam7_filtered_bytes(const png_IHDR* ihdr) {
+  size_t bytes = 0;
+  for (int pass = 0; pass < ADAM7_PASSES; pass++) {
+    uint32_t width = adam7_pass_width(pass, ihdr->width);
+    uint32_t height = adam7_pass_height(pass, ihdr->height);
+    if (width > 0 && height > 0) {
+      bytes += (png_row_bytes(ihdr, width) + 1) * height;
+    }
+  }
+  return bytes;
+}
+
+// Store count pixels of bpp bytes every step bytes. Called with a constant
+// bpp (see scatter_row), so each pixel size gets a loop of fixed size moves.
+static inline void scatter_pixels(uint8_t* dst, const uint8_t* src, uint32_t count, size_t step, size_t bpp) {
+  for (uint32_t i = 0; i < count; i++) {
+    memcpy(dst, src, bpp);
+    dst += step;
+    src += bpp;
+  }
+}
+
+// Pixels smaller than a byte, packed MSB first
+static void scatter_bits(uint8_t* dst, const uint8_t* src, uint32_t count, uint32_t x0, uint32_t dx, unsigned bits) {
+  unsigned mask = (1u << bits) - 1;
+  for (uint32_t i = 0; i < count; i++) {
+    size_t src_bit = (size_t)i * bits;
+    size_t dst_bit = (size_t)(x0 + i * dx) * bits;
+    unsigned value = (src[src_bit >> 3] >> (8 - bits - (src_bit & 7))) & mask;
+    unsigned shift = 8 - bits - (dst_bit & 7);
+    uint8_t* byte = &dst[dst_bit >> 3];
+    *byte = (uint8_t)((*byte & ~(mask << shift)) | (value << shift));
+  }
+}
+
+void adam7_scatter_row(uint8_t* image, const png_IHDR* ihdr, int pass, uint32_t y, const uint8_t* pixels) {
+  const Adam7Pass* p = &adam7_passes[pass];
+  uint32_t count = adam7_pass_width(pass, ihdr->width);
+  uint8_t* dst = image + (size_t)(p->y0 + y * p->dy) * png_row_bytes(ihdr, ihdr->width);
+  unsigned bits = ihdr->bit_depth * color_channels[ihdr->color_type];
+
+  if (p->dx == 1) {
+    // Pass 7 holds whole rows, which no other pass touches. Unused bits at
+    // the end of a sub-byte row are cleared rather than taken from the file.
+    size_t length = png_row_bytes(ihdr, count);
+    memcpy(dst, pixels, length);
+    if ((count * bits) % 8) {
+      dst[length - 1] &= (uint8_t)(0xFF00 >> (count * bits % 8));
+    }
+    return;
+  }
+
+  if (bits < 8) {
+    scatter_bits(dst, pixels, count, p->x0, p->dx, bits);
+    return;
+  }
+
+  size_t bpp = bits / 8;
+
+  dst += p->x0 * bpp;
+  size_t step = p->dx * bpp;
+  switch (bpp) {
+  case 1: scatter_pixels(dst, pixels, count, step, 1); break;
+  case 2: scatter_pixels(dst, pixels, count, step, 2); break;
+  case 3: scatter_pixels(dst, pixels, count, step, 3); break;
+  case 4: scatter_pixels(dst, pixels, count, step, 4); break;
+  case 6: scatter_pixels(dst, pixels, count, step, 6); break;
+  case 8: scatter_pixels(dst, pixels, count, step, 8); break;
+  default: scatter_pixels(dst, pixels, count, step, bpp); break;
+  }
+}
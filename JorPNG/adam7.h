@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chunk.h"
+
+// https://www.w3.org/TR/png/#8Interlace
+
+#define ADAM7_PASSES 7
+
+// Pixels of a pass start at (x0, y0) and repeat every dx columns and dy rows
+typedef struct adam7_pass_struct {
+  uint8_t x0;
+  uint8_t y0;
+  uint8_t dx;
+  uint8_t dy;
+} Adam7Pass;
+
+// Passes 1 to 7 at index 0 to 6
+extern const Adam7Pass adam7_passes[ADAM7_PASSES];
+
+uint32_t adam7_pass_width(int pass, uint32_t width);
+uint32_t adam7_pass_height(int pass, uint32_t height);
+size_t adam7_filtered_bytes(const png_IHDR* ihdr);
+
+// Copy an unfiltered scanline of a pass to its pixels in the full image
+void adam7_scatter_row(uint8_t* image, const png_IHDR* ihdr, int pass, uint32_t y, const uint8_t* pixels);
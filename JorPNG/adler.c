@@ -1,9 +1,140 @@
 #include "adler.h"
+#include "cpu.h"
+
+#if CPU_X86
+#include <immintrin.h>
+#endif
 
 /* https://www.ietf.org/rfc/rfc1950.txt */
 
 #define BASE 65521 /* largest prime smaller than 65536 */
 
+/* NMAX is the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1,
+   so the sums can run this many bytes before they have to be reduced */
+#define NMAX 5552
+
+// Sums of up to NMAX bytes, reduced once at the end
+static void adler32_scalar(uint32_t* s1_io, uint32_t* s2_io, const uint8_t* buf, size_t len) {
+  uint32_t s1 = *s1_io;
+  uint32_t s2 = *s2_io;
+
+  while (len > 0) {
+    size_t n = len < NMAX ? len : NMAX;
+    len -= n;
+    while (n >= 8) {
+      s1 += buf[0]; s2 += s1;
+      s1 += buf[1]; s2 += s1;
+      s1 += buf[2]; s2 += s1;
+      s1 += buf[3]; s2 += s1;
+      s1 += buf[4]; s2 += s1;
+      s1 += buf[5]; s2 += s1;
+      s1 += buf[6]; s2 += s1;
+      s1 += buf[7]; s2 += s1;
+      buf += 8;
+      n -= 8;
+    }
+    while (n--) {
+      s1 += *buf++;
+      s2 += s1;
+    }
+    s1 %= BASE;
+    s2 %= BASE;
+  }
+
+  *s1_io = s1;
+  *s2_io = s2;
+}
+
+#if CPU_X86
+// Add up the 32 bit lanes of v
+TARGET("sse2")
+static inline uint32_t sum_epi32(__m128i v) {
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+// 32 byte blocks. Per block s1 grows by the byte sum (psadbw) and s2 by
+// 32 times the s1 before the block plus the bytes weighted 32..1 (pmaddubsw).
+// The s1 terms are collected in ps and multiplied once per reduction.
+TARGET("ssse3")
+static size_t adler32_ssse3(uint32_t* s1_io, uint32_t* s2_io, const uint8_t* buf, size_t len) {
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  uint32_t s1 = *s1_io;
+  uint32_t s2 = *s2_io;
+  size_t blocks = len / 32;
+
+  while (blocks > 0) {
+    size_t n = blocks < NMAX / 32 ? blocks : NMAX / 32;
+    blocks -= n;
+
+    __m128i v_ps = _mm_cvtsi32_si128((int)(s1 * n));
+    __m128i v_s2 = _mm_cvtsi32_si128((int)s2);
+    __m128i v_s1 = _mm_setzero_si128();
+    do {
+      __m128i bytes1 = _mm_loadu_si128((const __m128i*)buf);
+      __m128i bytes2 = _mm_loadu_si128((const __m128i*)(buf + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      buf += 32;
+    } while (--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    s1 = (s1 + sum_epi32(v_s1)) % BASE;
+    s2 = sum_epi32(v_s2) % BASE;
+  }
+
+  *s1_io = s1;
+  *s2_io = s2;
+  return len / 32 * 32;
+}
+
+// Same as adler32_ssse3, one 32 byte block per 256 bit register
+TARGET("avx2")
+static size_t adler32_avx2(uint32_t* s1_io, uint32_t* s2_io, const uint8_t* buf, size_t len) {
+  const __m256i tap = _mm256_setr_epi8(
+    32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+    16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  uint32_t s1 = *s1_io;
+  uint32_t s2 = *s2_io;
+  size_t blocks = len / 32;
+
+  while (blocks > 0) {
+    size_t n = blocks < NMAX / 32 ? blocks : NMAX / 32;
+    blocks -= n;
+
+    __m256i v_ps = _mm256_setr_epi32((int)(s1 * n), 0, 0, 0, 0, 0, 0, 0);
+    __m256i v_s2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0);
+    __m256i v_s1 = _mm256_setzero_si256();
+    do {
+      __m256i bytes = _mm256_loadu_si256((const __m256i*)buf);
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      buf += 32;
+    } while (--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+    __m128i sum_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    __m128i sum_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    s1 = (s1 + sum_epi32(sum_s1)) % BASE;
+    s2 = sum_epi32(sum_s2) % BASE;
+  }
+
+  *s1_io = s1;
+  *s2_io = s2;
+  return len / 32 * 32;
+}
+#endif
+
 /*
    Update a running Adler-32 checksum with the bytes buf[0..len-1]
  and return the updated checksum. The Adler-32 checksum should be
@@ -18,17 +149,44 @@
    }
    if (adler != original_adler) error();
 */
-uint32_t update_adler32(uint32_t adler, uint8_t* buf, size_t len) {
+uint32_t update_adler32(uint32_t adler, const uint8_t* buf, size_t len) {
   uint32_t s1 = adler & 0xffff;
   uint32_t s2 = (adler >> 16) & 0xffff;
 
-  for (size_t n = 0; n < len; n++) {
-    s1 = (s1 + buf[n]) % BASE;
-    s2 = (s2 + s1) % BASE;
+#if CPU_X86
+  if (len >= 64) {
+    const CpuFeatures* cpu = get_cpu_features();
+    size_t done = 0;
+    if (cpu->avx2) {
+      done = adler32_avx2(&s1, &s2, buf, len);
+    }
+    else if (cpu->ssse3) {
+      done = adler32_ssse3(&s1, &s2, buf, len);
+    }
+    buf += done;
+    len -= done;
   }
+#endif
+
+  adler32_scalar(&s1, &s2, buf, len);
   return (s2 << 16) + s1;
 }
 
-uint32_t adler32(uint8_t* buf, size_t len) {
+uint32_t adler32(const uint8_t* buf, size_t len) {
   return update_adler32(1UL, buf, len);
 }
+
+// Adler-32 of two pieces joined together, from the checksums of each piece
+// and the length of the second
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+  uint32_t rem = (uint32_t)(len2 % BASE);
+  uint32_t sum1 = adler1 & 0xffff;
+  uint32_t sum2 = (rem * sum1) % BASE;
+  sum1 += (adler2 & 0xffff) + BASE - 1;
+  sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + BASE - rem;
+  if (sum1 >= BASE) sum1 -= BASE;
+  if (sum1 >= BASE) sum1 -= BASE;
+  if (sum2 >= 2 * BASE) sum2 -= 2 * BASE;
+  if (sum2 >= BASE) sum2 -= BASE;
+  return sum1 | (sum2 << 16);
+}
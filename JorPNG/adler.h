@@ -1,5 +1,10 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
-uint32_t adler32(uint8_t* buf, size_t len);
+uint32_t update_adler32(uint32_t adler, const uint8_t* buf, size_t len);
+uint32_t adler32(const uint8_t* buf, size_t len);
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2);
+
+void test_adler();
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Header size rounded up so the data after it stays aligned
+#define ARENA_HEADER ((sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+static void* heap_allocate(void* context, size_t size) {
+  (void)context;
+  return malloc(size);
+}
+
+static void heap_release(void* context, void* pointer) {
+  (void)context;
+  free(pointer);
+}
+
+void init_arena(Arena* arena, const PngAllocator* allocator) {
+  arena->blocks = NULL;
+  if (allocator) {
+    arena->allocator = *allocator;
+  }
+  else {
+    arena->allocator.allocate = heap_allocate;
+    arena->allocator.release = heap_release;
+    arena->allocator.context = NULL;
+  }
+}
+
+// Blocks are over-allocated so their data can be aligned whatever the
+// alignment of the allocator
+static ArenaBlock* new_block(Arena* arena, size_t size) {
+  void* memory = arena->allocator.allocate(arena->allocator.context, ARENA_HEADER + size + ARENA_ALIGNMENT);
+  if (!memory) {
+    fprintf(stderr, "Failed to allocate arena block!\n");
+    return NULL;
+  }
+  ArenaBlock* block = (ArenaBlock*)memory;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+static uint8_t* block_data(ArenaBlock* block) {
+  uintptr_t data = (uintptr_t)block + ARENA_HEADER;
+  return (uint8_t*)((data + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1));
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+  if (!arena) {
+    return malloc(size);
+  }
+  if (size > SIZE_MAX - ARENA_HEADER - 2 * ARENA_ALIGNMENT) {
+    return NULL;
+  }
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  ArenaBlock* block = arena->blocks;
+  if (block && size > ARENA_BLOCK_SIZE && block->size - block->used < size) {
+    // A large allocation gets a block of its own behind the current one, so
+    // the rest of the current block stays in use for the small ones
+    ArenaBlock* dedicated = new_block(arena, size);
+    if (!dedicated) {
+      return NULL;
+    }
+    dedicated->used = size;
+    dedicated->next = block->next;
+    block->next = dedicated;
+    return block_data(dedicated);
+  }
+  if (!block || block->size - block->used < size) {
+    block = new_block(arena, size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    if (!block) {
+      return NULL;
+    }
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+  void* pointer = block_data(block) + block->used;
+  block->used += size;
+  return pointer;
+}
+
+void* arena_calloc(Arena* arena, size_t count, size_t size) {
+  if (!arena) {
+    return calloc(count, size);
+  }
+  if (size != 0 && count > SIZE_MAX / size) {
+    return NULL;
+  }
+  void* pointer = arena_alloc(arena, count * size);
+  if (pointer) {
+    memset(pointer, 0, count * size);
+  }
+  return pointer;
+}
+
+// Memory of an arena is only given back by reset_arena and free_arena
+void arena_free(Arena* arena, void* pointer) {
+  if (!arena) {
+    free(pointer);
+  }
+}
+
+// Release all allocations. When they took several blocks, the blocks are
+// replaced by one that holds them all, so the same allocations fit next time.
+void reset_arena(Arena* arena) {
+  ArenaBlock* block = arena->blocks;
+  if (!block) {
+    return;
+  }
+  if (!block->next) {
+    block->used = 0;
+    return;
+  }
+  size_t total = 0;
+  for (; block; block = block->next) {
+    total += block->size;
+  }
+  free_arena(arena);
+  arena->blocks = new_block(arena, total);
+  if (arena->blocks) {
+    arena->blocks->next = NULL;
+  }
+}
+
+void free_arena(Arena* arena) {
+  ArenaBlock* block = arena->blocks;
+  while (block) {
+    ArenaBlock* next = block->next;
+    arena->allocator.release(arena->allocator.context, block);
+    block = next;
+  }
+  arena->blocks = NULL;
+}
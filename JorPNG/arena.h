@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Caller supplied memory functions, for embedding the decoder in programs
+// with their own heap. Both are called with context.
+typedef struct png_allocator_struct {
+  void* (*allocate)(void* context, size_t size);
+  void (*release)(void* context, void* pointer);
+  void* context;
+} PngAllocator;
+
+// Memory is taken from the allocator in blocks of at least this size
+#define ARENA_BLOCK_SIZE (1 << 16)
+
+// Allocations are aligned for the widest SIMD loads
+#define ARENA_ALIGNMENT 32
+
+typedef struct arena_block_struct {
+  struct arena_block_struct* next;
+  size_t size; // Usable bytes after the header
+  size_t used;
+} ArenaBlock;
+
+// Bump allocator for the scratch memory of a decode. Allocations are never
+// freed one by one. reset_arena releases them all at once and keeps the
+// memory, joined into a single block, so a decoder that is reset for every
+// image stops calling the allocator once the first images have been decoded.
+typedef struct arena_struct {
+  ArenaBlock* blocks; // Block allocations come from, then the full ones
+  PngAllocator allocator;
+} Arena;
+
+// allocator NULL uses malloc and free
+void init_arena(Arena* arena, const PngAllocator* allocator);
+void reset_arena(Arena* arena);
+void free_arena(Arena* arena);
+
+// With arena NULL these fall back to the C heap, so code can take an
+// optional arena and allocate the same way either way
+void* arena_alloc(Arena* arena, size_t size);
+void* arena_calloc(Arena* arena, size_t count, size_t size);
+void arena_free(Arena* arena, void* pointer);
+
+// Allocator counting its calls to malloc and free, for tests of memory reuse
+typedef struct counting_allocator_struct {
+  size_t allocations;
+  size_t releases;
+} CountingAllocator;
+
+PngAllocator counting_allocator(CountingAllocator* counts);
+
+void test_arena();
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+static void* counting_allocate(void* context, size_t size) {
+  ((CountingAllocator*)context)->allocations++;
+  return malloc(size);
+}
+
+static void counting_release(void* context, void* pointer) {
+  ((CountingAllocator*)context)->releases++;
+  free(pointer);
+}
+
+PngAllocator counting_allocator(CountingAllocator* counts) {
+  PngAllocator allocator = { counting_allocate, counting_release, counts };
+  return allocator;
+}
+
+// Allocations are aligned and do not overlap, a large one gets its own block
+// behind the current one, and once reset joined the blocks the same
+// allocations come without calling the allocator
+void test_arena() {
+  CountingAllocator counts = { 0, 0 };
+  PngAllocator allocator = counting_allocator(&counts);
+  Arena arena;
+  init_arena(&arena, &allocator);
+  static const size_t sizes[] = { 1, 100, 5000, 3 * ARENA_BLOCK_SIZE, 7, ARENA_BLOCK_SIZE, 40000, 2 * ARENA_BLOCK_SIZE + 1, 33 };
+  const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+  uint8_t* pointers[sizeof(sizes) / sizeof(sizes[0])];
+  int matches = 1;
+  size_t first_allocations = 0;
+  for (int round = 0; round < 3; round++) {
+    for (size_t i = 0; i < count; i++) {
+      ArenaBlock* head = arena.blocks;
+      pointers[i] = (uint8_t*)arena_alloc(&arena, sizes[i]);
+      if (!pointers[i] || (uintptr_t)pointers[i] % ARENA_ALIGNMENT != 0) {
+        printf("Arena: allocation of %llu bytes failed or misaligned\n", (unsigned long long)sizes[i]);
+        free_arena(&arena);
+        return;
+      }
+      memset(pointers[i], (int)i, sizes[i]);
+      // A large allocation leaves the head block where it is
+      if (head && sizes[i] > ARENA_BLOCK_SIZE) matches &= arena.blocks == head;
+    }
+    for (size_t i = 0; i < count; i++) {
+      for (size_t j = 0; j < sizes[i]; j++) {
+        if (pointers[i][j] != (uint8_t)i) matches = 0;
+      }
+    }
+    if (round == 0) {
+      // The small allocation after a large one continues the current block
+      matches &= pointers[4] == pointers[2] + ((5000 + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1));
+      first_allocations = counts.allocations;
+    }
+    reset_arena(&arena);
+    if (round > 0) matches &= arena.blocks && !arena.blocks->next;
+  }
+  // The first reset joined the blocks, after that nothing was allocated
+  matches &= counts.allocations == first_allocations + 1;
+  matches &= arena_calloc(&arena, SIZE_MAX / 2, 4) == NULL && arena_alloc(&arena, SIZE_MAX - 8) == NULL;
+  free_arena(&arena);
+  matches &= counts.allocations == counts.releases && !arena.blocks;
+  printf("Arena: %llu allocator calls for 3 rounds of %llu allocations, matches: %s\n",
+    (unsigned long long)counts.allocations, (unsigned long long)count, matches ? "True" : "False");
+}
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "batch.h"
+
+typedef struct job_order_struct {
+  size_t size_hint;
+  size_t job;
+} JobOrder;
+
+// Largest first, ties in input order
+static int compare_job_order(const void* a, const void* b) {
+  const JobOrder* x = (const JobOrder*)a;
+  const JobOrder* y = (const JobOrder*)b;
+  if (x->size_hint != y->size_hint) {
+    return x->size_hint > y->size_hint ? -1 : 1;
+  }
+  return x->job < y->job ? -1 : (x->job > y->job);
+}
+
+static void run_job(void* context, size_t task, int worker) {
+  PngBatch* batch = (PngBatch*)context;
+  PngJob* job = &batch->jobs[task];
+  PngContext* png = &batch->contexts[worker];
+  if (job->filename) {
+    job->result = png_decode_file(png, job->filename, &job->image);
+  }
+  else {
+    job->result = png_decode_memory(png, job->data, job->length, &job->image);
+  }
+  if (job->callback) {
+    job->callback(job->context, job);
+  }
+}
+
+int start_png_batch(PngBatch* batch, PngJob* jobs, size_t count, int threads) {
+  batch->jobs = jobs;
+  batch->count = count;
+  batch->workers = threads > 0 ? threads : cpu_count();
+  if ((size_t)batch->workers > count) {
+    batch->workers = count > 0 ? (int)count : 1;
+  }
+  batch->order = (size_t*)malloc((count > 0 ? count : 1) * sizeof(size_t));
+  batch->contexts = (PngContext*)malloc(batch->workers * sizeof(PngContext));
+  JobOrder* order = (JobOrder*)malloc((count > 0 ? count : 1) * sizeof(JobOrder));
+  if (!batch->order || !batch->contexts || !order) {
+    fprintf(stderr, "Failed to allocate the batch!\n");
+    free(batch->order);
+    free(batch->contexts);
+    free(order);
+    batch->order = NULL;
+    batch->contexts = NULL;
+    return -1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    jobs[i].result = -1;
+    order[i].size_hint = jobs[i].size_hint;
+    order[i].job = i;
+  }
+  qsort(order, count, sizeof(JobOrder), compare_job_order);
+  for (size_t i = 0; i < count; i++) {
+    batch->order[i] = order[i].job;
+  }
+  free(order);
+
+  for (int w = 0; w < batch->workers; w++) {
+    init_png_context(&batch->contexts[w], NULL);
+  }
+  if (start_thread_pool(&batch->pool, batch->workers, batch->order, count, run_job, batch) < 0) {
+    free(batch->order);
+    free(batch->contexts);
+    batch->order = NULL;
+    batch->contexts = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+size_t wait_png_batch(PngBatch* batch) {
+  if (!batch->contexts) {
+    return batch->count;
+  }
+  wait_thread_pool(&batch->pool);
+  for (int w = 0; w < batch->workers; w++) {
+    free_png_context(&batch->contexts[w]);
+  }
+  free(batch->contexts);
+  free(batch->order);
+  batch->contexts = NULL;
+  batch->order = NULL;
+
+  size_t failed = 0;
+  for (size_t i = 0; i < batch->count; i++) {
+    failed += batch->jobs[i].result != 0;
+  }
+  return failed;
+}
+
+size_t png_decode_batch(PngJob* jobs, size_t count, int threads) {
+  PngBatch batch;
+  if (start_png_batch(&batch, jobs, count, threads) < 0) {
+    return count;
+  }
+  return wait_png_batch(&batch);
+}
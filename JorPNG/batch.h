@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "decode.h"
+#include "pool.h"
+
+// Decoding many images at once on a work-stealing thread pool. Each worker
+// keeps a PngContext, so buffers are reused from one image to the next.
+
+struct png_job_struct;
+
+// Called on the worker thread as soon as a job is done, successful or not
+typedef void (*png_job_callback)(void* context, struct png_job_struct* job);
+
+typedef struct png_job_struct {
+  const char* filename;      // Input file, or NULL to decode data
+  const uint8_t* data;       // Input PNG in memory
+  size_t length;
+  size_t size_hint;          // Expected cost, such as the file size. Larger jobs start first, 0 if unknown.
+  PngImage image;            // Output, see PngImage for caller supplied buffers
+  int result;                // 0 when decoded, -1 on failure
+  png_job_callback callback; // May be NULL
+  void* context;
+} PngJob;
+
+typedef struct png_batch_struct {
+  PngJob* jobs;
+  size_t count;
+  size_t* order;          // Jobs by size_hint, largest first
+  PngContext* contexts;   // One per worker
+  int workers;
+  ThreadPool pool;
+} PngBatch;
+
+// Start decoding the jobs on threads threads, or one per processor for 0.
+// Returns right away, wait_png_batch waits for all jobs.
+int start_png_batch(PngBatch* batch, PngJob* jobs, size_t count, int threads);
+// Returns the number of jobs that failed
+size_t wait_png_batch(PngBatch* batch);
+size_t png_decode_batch(PngJob* jobs, size_t count, int threads);
@@ -1,63 +1,126 @@
 #include "bitstream.h"
 
 void init_bitstream(BitStream* stream, uint8_t* buffer, size_t length) {
+  init_bitstream_padded(stream, buffer, length, 0);
+}
+
+// Initialize a stream whose buffer has padding readable bytes past length.
+// Refills then never need the byte-by-byte tail path before the real end.
+void init_bitstream_padded(BitStream* stream, uint8_t* buffer, size_t length, size_t padding) {
   stream->buffer = buffer;
   stream->length = length;
-  stream->bit_position = 0;
+  stream->padding = padding;
   stream->byte_position = 0;
+  stream->bit_buffer = 0;
+  stream->bit_count = 0;
+  stream->overrun = 0;
 }
 
 int check_stream_oob(BitStream* stream) {
-  int oob = stream->byte_position >= stream->length;
+  // Consumed past the end when fewer bits are buffered than zeros were fed past it
+  int oob = stream->overrun ||
+    (stream->byte_position > stream->length && stream->bit_count < (stream->byte_position - stream->length) * 8);
   if (oob) {
     fprintf(stderr, "Error: Reading past bistream end!\n");
   }
   return oob;
 }
 
-// Move to the next bit
-void advance_bit(BitStream* stream) {
-  stream->bit_position++;
-  if (stream->bit_position >= 8) {
-    stream->bit_position = 0; // Reset bit position
-    stream->byte_position++;  // Move to the next byte
+// Number of bits not yet consumed
+size_t bits_left(BitStream* stream) {
+  if (stream->byte_position <= stream->length) {
+    return (stream->length - stream->byte_position) * 8 + stream->bit_count;
   }
+  // Zero bytes fed past the end sit at the top of the bit buffer
+  size_t phantom = (stream->byte_position - stream->length) * 8;
+  return stream->bit_count > phantom ? stream->bit_count - phantom : 0;
 }
 
-// Read a single bit in LSB-first order from the bit stream
-uint8_t read_bit_lsb(BitStream* stream) {
-  if (check_stream_oob(stream)) {
-    return -1;
+// Move the unread rest of the buffer into the bit buffer, so that the buffer
+// can be released before the next one is attached. At most 56 bits may be left.
+void detach_bitstream(BitStream* stream) {
+  size_t left = bits_left(stream);
+  while (stream->byte_position < stream->length && stream->bit_count <= 56) {
+    stream->bit_buffer |= (uint64_t)stream->buffer[stream->byte_position++] << stream->bit_count;
+    stream->bit_count += 8;
   }
-  // Get the current byte
-  uint8_t current_byte = stream->buffer[stream->byte_position];
-  // Extract the bit at the current bit position (LSB first)
-  uint8_t bit = (current_byte >> stream->bit_position) & 1;
-  printf("Reading bit %llu/%llu: %u (LSB)\n", stream->byte_position * 8 + stream->bit_position, stream->length * 8, bit);
-  advance_bit(stream);
-  return bit;
+  // Drop zeros fed past the end and look-ahead bits of bytes not counted
+  if (left < stream->bit_count) {
+    stream->bit_count = (uint32_t)left;
+  }
+  if (stream->bit_count < 64) {
+    stream->bit_buffer &= (1ULL << stream->bit_count) - 1;
+  }
+  stream->buffer = NULL;
+  stream->byte_position = 0;
+  stream->length = 0;
+  stream->padding = 0;
 }
 
-// Read a specified number of bits (LSB-first) from the bit stream
-uint32_t read_bits_lsb(size_t num_bits, BitStream* stream) {
-  uint32_t result = 0;
+// Continue reading from the next buffer of a stream split across several buffers.
+// The bits left over from the previous buffer are read first.
+void attach_bitstream(BitStream* stream, uint8_t* buffer, size_t length, size_t padding) {
+  detach_bitstream(stream);
+  stream->buffer = buffer;
+  stream->length = length;
+  stream->padding = padding;
+}
+
+// Top up the bit buffer to at least 56 bits
+void refill_bits(BitStream* stream) {
+  if (stream->byte_position + 8 <= stream->length + stream->padding) {
+    // Load a whole word and keep as many of its bytes as fit. The bytes of the
+    // word that do not fit are shifted out or loaded again by the next refill.
+    uint64_t word;
+    memcpy(&word, stream->buffer + stream->byte_position, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    stream->bit_buffer |= word << stream->bit_count;
+    stream->byte_position += (63 - stream->bit_count) >> 3;
+    stream->bit_count |= 56;
+    return;
+  }
+
+  // Near the end of the stream load byte by byte, feeding zeros past the end
+  while (stream->bit_count <= 56) {
+    uint64_t byte = 0;
+    if (stream->byte_position < stream->length) {
+      byte = stream->buffer[stream->byte_position];
+    }
+    else if (stream->byte_position >= stream->length + sizeof(uint64_t)) {
+      // The whole bit buffer is past the end, so bits beyond it were consumed
+      stream->overrun = 1;
+    }
+    stream->bit_buffer |= byte << stream->bit_count;
+    stream->bit_count += 8;
+    stream->byte_position++;
+  }
+}
+
+#if TRACE_LEVEL >= TRACE_BIT
+// Trace each of the next bits (LSB-first) as it is consumed
+void trace_bits_lsb(size_t num_bits, BitStream* stream) {
+  size_t position = stream->byte_position * 8 - stream->bit_count;
   for (size_t i = 0; i < num_bits; i++) {
-    result |= (read_bit_lsb(stream) << i);   // LSB first
+    trace_bit("Reading bit %llu/%llu: %u (LSB)\n", position + i, stream->length * 8, (unsigned)(stream->bit_buffer >> i) & 1);
   }
-  return result;
 }
+#endif
 
 // Read a single bit in MSB-first order from the bit stream
 uint8_t read_bit_msb(BitStream* stream) {
-  if (check_stream_oob(stream)) {
+  if (bits_left(stream) == 0) {
+    fprintf(stderr, "Error: Reading past bistream end!\n");
     return -1;
   }
-  // Get the current byte
-  uint8_t current_byte = stream->buffer[stream->byte_position];
+  // Get the current byte and bit index of the read position
+  size_t position = stream->byte_position * 8 - stream->bit_count;
+  uint8_t current_byte = stream->buffer[position >> 3];
   // Calculate the current bit index (MSB first)
-  uint8_t bit = (current_byte >> (7 - stream->bit_position)) & 1;
-  printf("Read bit %llu/%llu: %u (MSB)\n", stream->byte_position * 8 + stream->bit_position, stream->length * 8, bit);
-  advance_bit(stream);
+  uint8_t bit = (current_byte >> (7 - (position & 7))) & 1;
+  trace_bit("Read bit %llu/%llu: %u (MSB)\n", position, stream->length * 8, bit);
+  consume_bits(1, stream);
   return bit;
 }
 
@@ -90,37 +153,102 @@ uint32_t read_huffman_code(size_t code_length, BitStream* stream) {
   return reverse_bits(code, code_length);
 }
 
+// Read count whole bytes as a big-endian value, starting at the next byte boundary
 uint32_t read_bytes(size_t count, BitStream* stream) {
-  printf("Reading byte %llu/%llu\n", stream->byte_position, stream->length);
+  trace_bit("Reading byte %llu/%llu\n", (stream->byte_position * 8 - stream->bit_count) / 8, stream->length);
+  skip_to_next_byte(stream);
+  uint32_t value = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    value = (value << 8) | read_bits_lsb(8, stream);
+  }
   if (check_stream_oob(stream)) {
     return -1;
   }
-  uint32_t value = 0;
-  skip_to_next_byte(stream);
-  for (uint32_t i = 0; i < count; ++i) {
-    value |= (stream->buffer[stream->byte_position + (count - 1) - i] << (i * 8));
+  return value;
+}
+
+// Hand out up to count bytes in place from the buffer and skip them. Returns the
+// number of bytes available. Bytes already in the bit buffer must be read with
+// read_bits_lsb first, so the stream has to be byte aligned with bit_count 0.
+size_t read_aligned_bytes(size_t count, BitStream* stream, uint8_t** bytes) {
+  size_t available = stream->byte_position < stream->length ? stream->length - stream->byte_position : 0;
+  if (count > available) {
+    count = available;
   }
+  *bytes = stream->buffer + stream->byte_position;
   stream->byte_position += count;
-  return value;
+  stream->bit_buffer = 0; // Look-ahead bits of the skipped bytes
+  return count;
 }
 
 void skip_to_next_byte(BitStream* stream) {
-  if (stream->bit_position > 0) {
-    stream->bit_position = 0;
-    stream->byte_position++;
-  }
+  // The buffer holds whole bytes, so the partial byte is the low bit_count % 8 bits
+  consume_bits(stream->bit_count & 7, stream);
 }
 
 void put_byte(uint8_t byte, BitStream* stream) {
-  printf("Writing byte %llu/%llu\n", stream->byte_position, stream->length);
+  trace_bit("Writing byte %llu/%llu\n", stream->byte_position, stream->length);
   if (stream->byte_position >= stream->length) {
-    printf("Error: Writing past bistream end!\n");
+    fprintf(stderr, "Error: Writing past bistream end!\n");
     return;
   }
   stream->buffer[stream->byte_position] = byte;
   stream->byte_position++;
 }
 
+void init_bit_writer(BitWriter* writer, uint8_t* buffer, size_t capacity) {
+  writer->buffer = buffer;
+  writer->capacity = capacity;
+  writer->byte_position = 0;
+  writer->bit_buffer = 0;
+  writer->bit_count = 0;
+  writer->overflow = 0;
+}
+
+// Store the whole bytes of the bit buffer
+void store_bits(BitWriter* writer) {
+  if (writer->byte_position + 8 <= writer->capacity) {
+    // Store the whole word, the bytes past the complete ones are stored again later
+    uint64_t word = writer->bit_buffer;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(writer->buffer + writer->byte_position, &word, sizeof(word));
+    writer->byte_position += writer->bit_count >> 3;
+    writer->bit_buffer >>= writer->bit_count & ~7u;
+    writer->bit_count &= 7;
+    return;
+  }
+
+  // Near the end of the buffer store byte by byte
+  while (writer->bit_count >= 8) {
+    if (writer->byte_position < writer->capacity) {
+      writer->buffer[writer->byte_position++] = (uint8_t)writer->bit_buffer;
+    }
+    else {
+      writer->overflow = 1;
+    }
+    writer->bit_buffer >>= 8;
+    writer->bit_count -= 8;
+  }
+}
+
+// Pad with zero bits to the next byte boundary and store everything
+void align_bit_writer(BitWriter* writer) {
+  writer->bit_count = (writer->bit_count + 7) & ~7u;
+  store_bits(writer);
+}
+
+void write_aligned_bytes(const uint8_t* bytes, size_t count, BitWriter* writer) {
+  align_bit_writer(writer);
+  if (count > writer->capacity - writer->byte_position) {
+    writer->overflow = 1;
+    return;
+  }
+  memcpy(writer->buffer + writer->byte_position, bytes, count);
+  writer->byte_position += count;
+}
+
 void print_bitstream(BitStream* stream, size_t newline_every_n_bytes) {
   printf("BitStream content (%llu bytes):\n", stream->length);
   for (size_t i = 0; i < stream->length; i++) {
@@ -2,24 +2,100 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "adler.h"
+#include "trace.h"
+
+// Spare bytes a padded buffer must have readable past its length so the
+// bit buffer can always be refilled with a single word load
+#define BITSTREAM_PADDING 8
 
 typedef struct bitstream_struct {
   uint8_t* buffer;
-  uint8_t bit_position;
-  size_t byte_position;
+  size_t byte_position; // Next byte to load (input) or store (output)
   size_t length;
+  size_t padding;       // Readable bytes past length, see BITSTREAM_PADDING
+  uint64_t bit_buffer;  // Bits loaded ahead of the read position, LSB first
+  uint32_t bit_count;   // Number of valid bits in bit_buffer
+  int overrun;          // Set once reads went past the end of the stream
 } BitStream;
 
+// Bits written LSB first, the encoder's counterpart of BitStream
+typedef struct bit_writer_struct {
+  uint8_t* buffer;
+  size_t byte_position; // Next byte to store
+  size_t capacity;
+  uint64_t bit_buffer;  // Bits not yet stored, LSB first
+  uint32_t bit_count;   // Number of valid bits in bit_buffer
+  int overflow;         // Set once writes went past the capacity
+} BitWriter;
+
 void init_bitstream(BitStream* stream, uint8_t* buffer, size_t length);
+void init_bitstream_padded(BitStream* stream, uint8_t* buffer, size_t length, size_t padding);
+void attach_bitstream(BitStream* stream, uint8_t* buffer, size_t length, size_t padding);
+void detach_bitstream(BitStream* stream);
+
+void refill_bits(BitStream* stream);
+#if TRACE_LEVEL >= TRACE_BIT
+void trace_bits_lsb(size_t num_bits, BitStream* stream);
+#endif
+
+// Look at the next bits (LSB-first) without advancing the stream, up to 32 bits.
+// Bits past the stream end read as zero so a short final code can still be looked up.
+static inline uint32_t peek_bits_lsb(size_t num_bits, BitStream* stream) {
+  if (stream->bit_count < num_bits) {
+    refill_bits(stream);
+  }
+  return (uint32_t)(stream->bit_buffer & ((1ULL << num_bits) - 1));
+}
+
+// Advance the stream past bits already examined with peek_bits_lsb
+static inline void consume_bits(size_t num_bits, BitStream* stream) {
+  if (stream->bit_count < num_bits) {
+    refill_bits(stream);
+  }
+#if TRACE_LEVEL >= TRACE_BIT
+  trace_bits_lsb(num_bits, stream);
+#endif
+  stream->bit_buffer >>= num_bits;
+  stream->bit_count -= (uint32_t)num_bits;
+}
+
+// Read a specified number of bits (LSB-first) from the bit stream, up to 32 bits
+static inline uint32_t read_bits_lsb(size_t num_bits, BitStream* stream) {
+  uint32_t value = peek_bits_lsb(num_bits, stream);
+#if TRACE_LEVEL >= TRACE_BIT
+  trace_bits_lsb(num_bits, stream);
+#endif
+  stream->bit_buffer >>= num_bits;
+  stream->bit_count -= (uint32_t)num_bits;
+  return value;
+}
 
-uint32_t read_bits_lsb(size_t num_bits, BitStream* stream);
 uint32_t read_bits_msb(size_t num_bits, BitStream* stream);
 uint32_t read_huffman_code(size_t code_length, BitStream* stream);
+uint32_t reverse_bits(uint32_t code, size_t num_bits);
 uint32_t read_bytes(size_t count, BitStream * stream);
+size_t read_aligned_bytes(size_t count, BitStream* stream, uint8_t** bytes);
+size_t bits_left(BitStream* stream);
+int check_stream_oob(BitStream* stream);
 
 void skip_to_next_byte(BitStream * stream);
 
 void put_byte(uint8_t byte, BitStream* stream);
+
+void init_bit_writer(BitWriter* writer, uint8_t* buffer, size_t capacity);
+void store_bits(BitWriter* writer);
+void align_bit_writer(BitWriter* writer);
+void write_aligned_bytes(const uint8_t* bytes, size_t count, BitWriter* writer);
+
+// Append the low num_bits of value, up to 32 bits. Higher bits of value must be zero.
+static inline void write_bits_lsb(uint32_t value, size_t num_bits, BitWriter* writer) {
+  writer->bit_buffer |= (uint64_t)value << writer->bit_count;
+  writer->bit_count += (uint32_t)num_bits;
+  if (writer->bit_count >= 32) {
+    store_bits(writer);
+  }
+}
 void print_bitstream(BitStream* stream, size_t newline_evert_n_bytes);
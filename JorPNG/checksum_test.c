@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc.h"
+#include "adler.h"
+#include "cpu.h"
+
+#define CHECKSUM_TEST_LENGTH (1 << 22)
+
+// Lengths around the 16 and 64 byte blocks of the kernels, and misaligned starts
+static const size_t checksum_lengths[] = { 0, 1, 15, 16, 17, 63, 64, 65, 127, 128, 1000, 4095, 65536, 100003 };
+static const size_t checksum_offsets[] = { 0, 1, 3, 7, 13 };
+
+static uint8_t* make_checksum_input(void) {
+  uint8_t* data = (uint8_t*)malloc(CHECKSUM_TEST_LENGTH);
+  if (!data) return NULL;
+  uint32_t random = 7;
+  for (size_t i = 0; i < CHECKSUM_TEST_LENGTH; i++) {
+    random = random * 1103515245 + 12345;
+    data[i] = (uint8_t)(random >> 24);
+  }
+  return data;
+}
+
+static double megabytes_per_second(size_t length, clock_t start) {
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  return length / 1e6 / (seconds > 0 ? seconds : 1e-9);
+}
+
+// One bit at a time, straight from the polynomial
+static uint32_t bitwise_crc(const uint8_t* buf, size_t len) {
+  uint32_t c = 0xffffffffUL;
+  for (size_t i = 0; i < len; i++) {
+    c ^= buf[i];
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? POLYNOMIAL ^ (c >> 1) : c >> 1;
+    }
+  }
+  return c ^ 0xffffffffUL;
+}
+
+// The PCLMUL folding must give the slice-by-16 results, and both the bitwise CRC
+void test_crc() {
+  uint8_t* data = make_checksum_input();
+  if (!data) return;
+  static const CpuFeatures scalar = { 0 };
+  int matches = 1;
+  for (size_t o = 0; o < sizeof(checksum_offsets) / sizeof(checksum_offsets[0]); o++) {
+    for (size_t l = 0; l < sizeof(checksum_lengths) / sizeof(checksum_lengths[0]); l++) {
+      uint8_t* buf = data + checksum_offsets[o];
+      size_t len = checksum_lengths[l];
+      uint32_t expected = bitwise_crc(buf, len);
+      uint32_t simd = crc(buf, len);
+      restrict_cpu_features(&scalar);
+      uint32_t sliced = crc(buf, len);
+      restrict_cpu_features(NULL);
+      if (simd != expected || sliced != expected) {
+        printf("CRC of %llu bytes at offset %llu: %08X, slice-by-16 %08X, bitwise %08X\n",
+          (unsigned long long)len, (unsigned long long)checksum_offsets[o], simd, sliced, expected);
+        matches = 0;
+      }
+    }
+  }
+  uint32_t first = crc(data, 1000);
+  uint32_t second = crc(data + 1000, CHECKSUM_TEST_LENGTH - 1000);
+  matches &= crc32_combine(first, second, CHECKSUM_TEST_LENGTH - 1000) == crc(data, CHECKSUM_TEST_LENGTH);
+
+  clock_t start = clock();
+  uint32_t simd = crc(data, CHECKSUM_TEST_LENGTH);
+  double simd_speed = megabytes_per_second(CHECKSUM_TEST_LENGTH, start);
+  restrict_cpu_features(&scalar);
+  start = clock();
+  uint32_t sliced = crc(data, CHECKSUM_TEST_LENGTH);
+  double sliced_speed = megabytes_per_second(CHECKSUM_TEST_LENGTH, start);
+  restrict_cpu_features(NULL);
+  matches &= simd == sliced;
+  printf("CRC-32: %.0f MB/s, slice-by-16 %.0f MB/s, matches: %s\n", simd_speed, sliced_speed, matches ? "True" : "False");
+  free(data);
+}
+
+// Straight from RFC 1950, a modulo per byte
+static uint32_t bytewise_adler32(const uint8_t* buf, size_t len) {
+  uint32_t s1 = 1, s2 = 0;
+  for (size_t i = 0; i < len; i++) {
+    s1 = (s1 + buf[i]) % 65521;
+    s2 = (s2 + s1) % 65521;
+  }
+  return (s2 << 16) + s1;
+}
+
+// AVX2, SSSE3 and scalar Adler-32 must all give the bytewise result. All 0xFF
+// bytes test the deferred modulo at its largest sums.
+void test_adler() {
+  uint8_t* data = make_checksum_input();
+  if (!data) return;
+  static const CpuFeatures ssse3 = { 1, 1, 1, 1, 0 };
+  static const CpuFeatures scalar = { 0 };
+  static const CpuFeatures* kernels[3] = { NULL, &ssse3, &scalar };
+  static const char* names[3] = { "widest", "SSSE3", "scalar" };
+  double speeds[3] = { 0 };
+  int matches = 1;
+  for (int fill = 0; fill < 2; fill++) {
+    if (fill) memset(data, 0xFF, CHECKSUM_TEST_LENGTH);
+    for (size_t o = 0; o < sizeof(checksum_offsets) / sizeof(checksum_offsets[0]); o++) {
+      for (size_t l = 0; l < sizeof(checksum_lengths) / sizeof(checksum_lengths[0]); l++) {
+        uint8_t* buf = data + checksum_offsets[o];
+        size_t len = checksum_lengths[l];
+        uint32_t expected = bytewise_adler32(buf, len);
+        for (int k = 0; k < 3; k++) {
+          restrict_cpu_features(kernels[k]);
+          uint32_t adler = adler32(buf, len);
+          if (adler != expected) {
+            printf("Adler-32 %s of %llu bytes at offset %llu: %08X, bytewise %08X\n", names[k],
+              (unsigned long long)len, (unsigned long long)checksum_offsets[o], adler, expected);
+            matches = 0;
+          }
+        }
+      }
+    }
+    uint32_t expected = bytewise_adler32(data, CHECKSUM_TEST_LENGTH);
+    for (int k = 0; k < 3; k++) {
+      restrict_cpu_features(kernels[k]);
+      clock_t start = clock();
+      matches &= adler32(data, CHECKSUM_TEST_LENGTH) == expected;
+      speeds[k] = megabytes_per_second(CHECKSUM_TEST_LENGTH, start);
+    }
+    restrict_cpu_features(NULL);
+    uint32_t first = adler32(data, 1000);
+    uint32_t second = adler32(data + 1000, CHECKSUM_TEST_LENGTH - 1000);
+    matches &= adler32_combine(first, second, CHECKSUM_TEST_LENGTH - 1000) == expected;
+  }
+  printf("Adler-32: %.0f MB/s, SSSE3 %.0f MB/s, scalar %.0f MB/s, matches: %s\n", speeds[0], speeds[1], speeds[2], matches ? "True" : "False");
+  free(data);
+}
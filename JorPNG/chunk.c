@@ -32,6 +32,51 @@ uint8_t filter_methods[][19] = { "Adaptive filtering" };
 uint8_t interlace_methods[][16] = { "No interlace" ,"Adam7 interlace" };
 uint8_t rendering_intents[][22] = { "Perceptual", "Relative colorimetric", "Saturation", "Absolute colorimetric" };
 
+const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+
+// Reject headers that are not valid PNG, before their fields are used to
+// index tables or size buffers
+int check_IHDR(const png_IHDR* ihdr) {
+  if (ihdr->width == 0 || ihdr->height == 0 || ihdr->width > 0x7FFFFFFF || ihdr->height > 0x7FFFFFFF) {
+    fprintf(stderr, "Invalid image size %ux%u\n", ihdr->width, ihdr->height);
+    return -1;
+  }
+  int depth = ihdr->bit_depth;
+  int valid_depth;
+  switch (ihdr->color_type) {
+  case 0: valid_depth = depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16; break;
+  case 3: valid_depth = depth == 1 || depth == 2 || depth == 4 || depth == 8; break;
+  case 2:
+  case 4:
+  case 6: valid_depth = depth == 8 || depth == 16; break;
+  default:
+    fprintf(stderr, "Invalid color type %u\n", ihdr->color_type);
+    return -1;
+  }
+  if (!valid_depth) {
+    fprintf(stderr, "Invalid bit depth %u for color type %u\n", ihdr->bit_depth, ihdr->color_type);
+    return -1;
+  }
+  if (ihdr->compression_method != 0 || ihdr->filter_method != 0 || ihdr->interlace_method > 1) {
+    fprintf(stderr, "Unknown compression, filter or interlace method\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Distance in bytes to the corresponding byte of the previous pixel, used by
+// the filters. Pixels smaller than a byte count as one byte.
+size_t png_bytes_per_pixel(const png_IHDR* ihdr) {
+  size_t bits = (size_t)ihdr->bit_depth * color_channels[ihdr->color_type];
+  return bits < 8 ? 1 : bits / 8;
+}
+
+// Bytes in a scanline of width pixels, without the filter type byte
+size_t png_row_bytes(const png_IHDR* ihdr, uint32_t width) {
+  size_t bits = (size_t)ihdr->bit_depth * color_channels[ihdr->color_type];
+  return ((size_t)width * bits + 7) / 8;
+}
+
 void print_IHDR(png_IHDR* ihdr) {
   fprintf(stdout, "\
 Width: %u pixels\n\
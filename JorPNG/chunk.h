@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stddef.h>
 
 // http://www.libpng.org/pub/png/spec/1.2/PNG-Chunks.html
 // http://www.libpng.org/pub/png/book/chapter11.html
@@ -38,6 +39,9 @@
 #define eXIf typeFromName('e','X','I','f') // Exchangeable Image File (Exif) Profile
 // Time stamp information
 #define tIME typeFromName('t','I','M','E') // Image last-modification time
+// Restart points for parallel decoding
+#define iDOT typeFromName('i','D','O','T') // Apple IDAT split points (undocumented)
+#define joRP typeFromName('j','o','R','P') // JorPNG restart points (private, see restart.h)
 //Animation information
 #define acTL typeFromName('a','c','T','L') // Animation Control Chunk
 #define fcTL typeFromName('f','c','T','L') // Frame Control Chunk
@@ -55,6 +59,7 @@ typedef struct png_chunk_struct {
   uint32_t chunk_type;
   uint8_t* data;
   uint32_t crc;
+  size_t padding; // Readable bytes past the data, see BITSTREAM_PADDING
 } png_chunk;
 
 // IHDR structure
@@ -123,6 +128,20 @@ bLOb  <-- 32 bit chunk type code represented in text form
 
 print_chunk_data(uint8_t* data, uint32_t length);
 
+// PNG file signature (8 bytes)
+// http://www.libpng.org/pub/png/spec/1.2/PNG-Rationale.html#R.PNG-file-signature
+extern const uint8_t png_signature[8];
+
+// Big-endian 32 bit value, as all PNG integers are stored
+static inline uint32_t read_be32(const uint8_t* data) {
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+int check_IHDR(const png_IHDR* ihdr);
+
+size_t png_bytes_per_pixel(const png_IHDR* ihdr);
+size_t png_row_bytes(const png_IHDR* ihdr, uint32_t width);
+
 void print_IHDR(png_IHDR* ihdr);
 void print_gAMA(png_gAMA* gama);
 void print_sRGB(png_sRGB* srgb);
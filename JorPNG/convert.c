@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "cpu.h"
+
+#if CPU_X86
+#include <immintrin.h>
+#endif
+
+// Byte offsets of red and blue in an output pixel
+#define RED(converter) ((converter)->format == PNG_FORMAT_BGRA8 ? 2 : 0)
+#define BLUE(converter) ((converter)->format == PNG_FORMAT_BGRA8 ? 0 : 2)
+
+static inline void store_rgba(const PngConverter* converter, uint8_t* out, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha) {
+  out[RED(converter)] = red;
+  out[1] = green;
+  out[BLUE(converter)] = blue;
+  out[3] = alpha;
+}
+
+// Sample x of a row with bit_depth bits per sample, at full precision
+static inline uint16_t read_sample(const uint8_t* row, size_t x, int bit_depth) {
+  switch (bit_depth) {
+  case 16:
+    return (uint16_t)(row[2 * x] << 8 | row[2 * x + 1]);
+  case 8:
+    return row[x];
+  default: {
+    size_t bit = x * bit_depth;
+    return (row[bit >> 3] >> (8 - bit_depth - (bit & 7))) & ((1 << bit_depth) - 1);
+  }
+  }
+}
+
+// Scale a sample to 8 bits: low depths are replicated, 16 bits keep the high byte
+static inline uint8_t sample_to_8(uint16_t sample, int bit_depth) {
+  switch (bit_depth) {
+  case 1: return (uint8_t)(sample * 0xFF);
+  case 2: return (uint8_t)(sample * 0x55);
+  case 4: return (uint8_t)(sample * 0x11);
+  case 16: return (uint8_t)(sample >> 8);
+  default: return (uint8_t)sample;
+  }
+}
+
+// Any color type and bit depth, one sample at a time, from pixel first on
+static void convert_any_from(const PngConverter* converter, const uint8_t* pixels, uint32_t first, uint8_t* out, uint32_t width) {
+  int depth = converter->ihdr.bit_depth;
+  int channels = color_channels[converter->ihdr.color_type];
+  for (uint32_t x = first; x < first + width; x++, out += 4) {
+    size_t s = (size_t)x * channels;
+    switch (converter->ihdr.color_type) {
+    case 0: {
+      uint16_t gray = read_sample(pixels, s, depth);
+      uint8_t value = sample_to_8(gray, depth);
+      uint8_t alpha = converter->has_key && gray == converter->key[0] ? 0 : 0xFF;
+      store_rgba(converter, out, value, value, value, alpha);
+      break;
+    }
+    case 2: {
+      uint16_t red = read_sample(pixels, s, depth);
+      uint16_t green = read_sample(pixels, s + 1, depth);
+      uint16_t blue = read_sample(pixels, s + 2, depth);
+      int keyed = converter->has_key && red == converter->key[0] && green == converter->key[1] && blue == converter->key[2];
+      store_rgba(converter, out, sample_to_8(red, depth), sample_to_8(green, depth), sample_to_8(blue, depth), keyed ? 0 : 0xFF);
+      break;
+    }
+    case 3:
+      memcpy(out, converter->palette[read_sample(pixels, s, depth)], 4);
+      break;
+    case 4: {
+      uint8_t value = sample_to_8(read_sample(pixels, s, depth), depth);
+      store_rgba(converter, out, value, value, value, sample_to_8(read_sample(pixels, s + 1, depth), depth));
+      break;
+    }
+    case 6:
+      store_rgba(converter, out,
+        sample_to_8(read_sample(pixels, s, depth), depth),
+        sample_to_8(read_sample(pixels, s + 1, depth), depth),
+        sample_to_8(read_sample(pixels, s + 2, depth), depth),
+        sample_to_8(read_sample(pixels, s + 3, depth), depth));
+      break;
+    }
+  }
+}
+
+static void convert_any(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  convert_any_from(converter, pixels, 0, out, width);
+}
+
+// The converted pixels of each byte value are looked up at once, with the
+// gray levels scaled, the key applied and palette entries already expanded
+static inline void convert_packed_bytes(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width, int pixels_per_byte) {
+  const size_t size = 4 * pixels_per_byte;
+  uint32_t bytes = width / pixels_per_byte;
+  for (uint32_t i = 0; i < bytes; i++, out += size) {
+    memcpy(out, converter->packed[pixels[i]], size);
+  }
+  if (width % pixels_per_byte) {
+    memcpy(out, converter->packed[pixels[bytes]], 4 * (width % pixels_per_byte));
+  }
+}
+
+static void convert_packed(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  // Constant sizes, so each depth copies with a few wide moves
+  switch (converter->ihdr.bit_depth) {
+  case 1: convert_packed_bytes(converter, pixels, out, width, 8); break;
+  case 2: convert_packed_bytes(converter, pixels, out, width, 4); break;
+  default: convert_packed_bytes(converter, pixels, out, width, 2); break;
+  }
+}
+
+static void build_packed_table(PngConverter* converter) {
+  int depth = converter->ihdr.bit_depth;
+  for (int value = 0; value < 256; value++) {
+    uint8_t byte = (uint8_t)value;
+    for (int x = 0; x < 8 / depth; x++) {
+      uint16_t sample = read_sample(&byte, x, depth);
+      uint8_t* out = converter->packed[value] + 4 * x;
+      if (converter->ihdr.color_type == 3) {
+        memcpy(out, converter->palette[sample], 4);
+      }
+      else {
+        uint8_t gray = sample_to_8(sample, depth);
+        store_rgba(converter, out, gray, gray, gray, converter->has_key && sample == converter->key[0] ? 0 : 0xFF);
+      }
+    }
+  }
+}
+
+static void convert_palette8(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  for (uint32_t x = 0; x < width; x++) {
+    memcpy(out + 4 * x, converter->palette[pixels[x]], 4);
+  }
+}
+
+static void convert_rgba8(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  if (converter->format == PNG_FORMAT_RGBA8) {
+    memcpy(out, pixels, (size_t)width * 4);
+    return;
+  }
+  for (uint32_t x = 0; x < width; x++, pixels += 4, out += 4) {
+    store_rgba(converter, out, pixels[0], pixels[1], pixels[2], pixels[3]);
+  }
+}
+
+#if CPU_X86
+// Gray to gray, gray, gray, alpha by unpacking the bytes with themselves and
+// with the alpha. Red and blue are the same, so this serves both orders.
+TARGET("sse2")
+static void convert_gray8_sse2(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  const __m128i opaque = _mm_set1_epi8(-1);
+  const __m128i key = _mm_set1_epi8((char)converter->key[0]);
+  int keyed = converter->has_key && converter->key[0] <= 0xFF;
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i gray = _mm_loadu_si128((const __m128i*)(pixels + x));
+    __m128i alpha = keyed ? _mm_andnot_si128(_mm_cmpeq_epi8(gray, key), opaque) : opaque;
+    __m128i gray_lo = _mm_unpacklo_epi8(gray, gray);
+    __m128i gray_hi = _mm_unpackhi_epi8(gray, gray);
+    __m128i alpha_lo = _mm_unpacklo_epi8(gray, alpha);
+    __m128i alpha_hi = _mm_unpackhi_epi8(gray, alpha);
+    __m128i* dst = (__m128i*)(out + 4 * x);
+    _mm_storeu_si128(dst, _mm_unpacklo_epi16(gray_lo, alpha_lo));
+    _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(gray_lo, alpha_lo));
+    _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(gray_hi, alpha_hi));
+    _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(gray_hi, alpha_hi));
+  }
+  convert_any(converter, pixels + x, out + 4 * x, width - x);
+}
+
+// Gray and alpha pairs are 16 bit words; the gray byte doubled in each word
+// interleaved with the pairs gives gray, gray, gray, alpha
+TARGET("sse2")
+static void convert_gray_alpha8_sse2(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  const __m128i low = _mm_set1_epi16(0xFF);
+  uint32_t x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m128i pairs = _mm_loadu_si128((const __m128i*)(pixels + 2 * x));
+    __m128i gray = _mm_and_si128(pairs, low);
+    gray = _mm_or_si128(gray, _mm_slli_epi16(gray, 8));
+    __m128i* dst = (__m128i*)(out + 4 * x);
+    _mm_storeu_si128(dst, _mm_unpacklo_epi16(gray, pairs));
+    _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(gray, pairs));
+  }
+  convert_any(converter, pixels + 2 * x, out + 4 * x, width - x);
+}
+
+// Four RGB pixels per shuffle into the output order, alpha ORed in. A color
+// key compares whole pixels before the alpha is added.
+TARGET("ssse3")
+static void convert_rgb8_ssse3(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  const __m128i shuffle = converter->format == PNG_FORMAT_BGRA8
+    ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+    : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+  int keyed = converter->has_key && converter->key[0] <= 0xFF && converter->key[1] <= 0xFF && converter->key[2] <= 0xFF;
+  uint8_t key_pixel[4] = { 0 };
+  store_rgba(converter, key_pixel, (uint8_t)converter->key[0], (uint8_t)converter->key[1], (uint8_t)converter->key[2], 0);
+  const __m128i key = _mm_set1_epi32((int)(key_pixel[0] | key_pixel[1] << 8 | key_pixel[2] << 16));
+
+  // Each load reads 16 bytes of the 12 it converts, so stop two pixels early
+  uint32_t x = 0;
+  for (; x + 6 <= width; x += 4) {
+    __m128i rgb = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pixels + 3 * x)), shuffle);
+    __m128i alpha = keyed ? _mm_andnot_si128(_mm_cmpeq_epi32(rgb, key), opaque) : opaque;
+    _mm_storeu_si128((__m128i*)(out + 4 * x), _mm_or_si128(rgb, alpha));
+  }
+  convert_any(converter, pixels + 3 * x, out + 4 * x, width - x);
+}
+
+// RGBA to BGRA, swapping red and blue with one shuffle per four pixels
+TARGET("ssse3")
+static void convert_rgba8_ssse3(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  uint32_t x = 0;
+  for (; x + 4 <= width; x += 4) {
+    __m128i rgba = _mm_loadu_si128((const __m128i*)(pixels + 4 * x));
+    _mm_storeu_si128((__m128i*)(out + 4 * x), _mm_shuffle_epi8(rgba, shuffle));
+  }
+  convert_rgba8(converter, pixels + 4 * x, out + 4 * x, width - x);
+}
+
+// Eight palette entries per gather, indexed by the zero-extended bytes
+TARGET("avx2")
+static void convert_palette8_avx2(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  const int* table = (const int*)converter->palette;
+  uint32_t x = 0;
+  for (; x + 8 <= width; x += 8) {
+    __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(pixels + x)));
+    _mm256_storeu_si256((__m256i*)(out + 4 * x), _mm256_i32gather_epi32(table, index, 4));
+  }
+  convert_palette8(converter, pixels + x, out + 4 * x, width - x);
+}
+#endif
+
+// Pick the kernel for the header, the output order and the transparency
+static void select_kernel(PngConverter* converter) {
+  converter->kernel = convert_any;
+  if (converter->format == PNG_FORMAT_RAW) {
+    return;
+  }
+  if (converter->ihdr.bit_depth < 8 && (converter->ihdr.color_type == 0 || converter->ihdr.color_type == 3)) {
+    build_packed_table(converter);
+    converter->kernel = convert_packed;
+    return;
+  }
+  if (converter->ihdr.bit_depth != 8) {
+    return;
+  }
+  const CpuFeatures* cpu = get_cpu_features();
+  (void)cpu;
+  switch (converter->ihdr.color_type) {
+  case 0:
+#if CPU_X86
+    if (cpu->sse2) {
+      converter->kernel = convert_gray8_sse2;
+    }
+#endif
+    break;
+  case 2:
+#if CPU_X86
+    if (cpu->ssse3) {
+      converter->kernel = convert_rgb8_ssse3;
+    }
+#endif
+    break;
+  case 3:
+    converter->kernel = convert_palette8;
+#if CPU_X86
+    if (cpu->avx2) {
+      converter->kernel = convert_palette8_avx2;
+    }
+#endif
+    break;
+  case 4:
+#if CPU_X86
+    if (cpu->sse2) {
+      converter->kernel = convert_gray_alpha8_sse2;
+    }
+#endif
+    break;
+  case 6:
+    converter->kernel = convert_rgba8;
+#if CPU_X86
+    if (cpu->ssse3 && converter->format == PNG_FORMAT_BGRA8) {
+      converter->kernel = convert_rgba8_ssse3;
+    }
+#endif
+    break;
+  }
+}
+
+void init_png_converter(PngConverter* converter, const png_IHDR* ihdr, PngPixelFormat format) {
+  memset(converter, 0, sizeof(*converter));
+  converter->ihdr = *ihdr;
+  converter->format = format;
+  // Entries the palette leaves out are opaque black
+  for (int i = 0; i < 256; i++) {
+    converter->palette[i][3] = 0xFF;
+  }
+  select_kernel(converter);
+}
+
+int set_png_palette(PngConverter* converter, const uint8_t* data, size_t length) {
+  if (length == 0 || length % 3 || length > 3 * 256) {
+    fprintf(stderr, "Invalid PLTE chunk length %zu\n", length);
+    return -1;
+  }
+  for (size_t i = 0; i < length / 3; i++, data += 3) {
+    store_rgba(converter, converter->palette[i], data[0], data[1], data[2], converter->palette[i][3]);
+  }
+  select_kernel(converter);
+  return 0;
+}
+
+// https://www.w3.org/TR/png/#11tRNS
+int set_png_transparency(PngConverter* converter, const uint8_t* data, size_t length) {
+  switch (converter->ihdr.color_type) {
+  case 0:
+    if (length < 2) {
+      break;
+    }
+    converter->key[0] = (uint16_t)(data[0] << 8 | data[1]);
+    converter->has_key = 1;
+    select_kernel(converter);
+    return 0;
+  case 2:
+    if (length < 6) {
+      break;
+    }
+    for (int i = 0; i < 3; i++) {
+      converter->key[i] = (uint16_t)(data[2 * i] << 8 | data[2 * i + 1]);
+    }
+    converter->has_key = 1;
+    select_kernel(converter);
+    return 0;
+  case 3:
+    if (length > 256) {
+      break;
+    }
+    for (size_t i = 0; i < length; i++) {
+      converter->palette[i][3] = data[i];
+    }
+    select_kernel(converter);
+    return 0;
+  }
+  fprintf(stderr, "Invalid tRNS chunk for color type %u\n", converter->ihdr.color_type);
+  return -1;
+}
+
+size_t png_converted_row_bytes(const PngConverter* converter, uint32_t width) {
+  if (converter->format == PNG_FORMAT_RAW) {
+    return png_row_bytes(&converter->ihdr, width);
+  }
+  return (size_t)width * 4;
+}
+
+void convert_png_row(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width) {
+  if (converter->format == PNG_FORMAT_RAW) {
+    memcpy(out, pixels, png_row_bytes(&converter->ihdr, width));
+    return;
+  }
+  converter->kernel(converter, pixels, out, width);
+}
+
+// Packed samples starting shift bits into the first byte, moved to the start
+// of out. The bits past the last pixel are cleared.
+static void copy_packed_bits(const uint8_t* pixels, size_t available, int shift, uint8_t* out, size_t bits) {
+  size_t bytes = (bits + 7) / 8;
+  for (size_t i = 0; i < bytes; i++) {
+    uint8_t next = i + 1 < available ? pixels[i + 1] : 0;
+    out[i] = (uint8_t)(pixels[i] << shift | next >> (8 - shift));
+  }
+  if (bits % 8) {
+    out[bytes - 1] &= (uint8_t)(0xFF << (8 - bits % 8));
+  }
+}
+
+void convert_png_columns(const PngConverter* converter, const uint8_t* pixels, uint32_t x, uint32_t width, uint8_t* out) {
+  size_t pixel_bits = (size_t)converter->ihdr.bit_depth * color_channels[converter->ihdr.color_type];
+  size_t first_bit = x * pixel_bits;
+  const uint8_t* start = pixels + first_bit / 8;
+  if (first_bit % 8 == 0) {
+    convert_png_row(converter, start, out, width);
+    size_t bits = width * pixel_bits;
+    if (converter->format == PNG_FORMAT_RAW && bits % 8) {
+      // Clear the bits of the pixels past the region
+      out[bits / 8] &= (uint8_t)(0xFF << (8 - bits % 8));
+    }
+    return;
+  }
+
+  // Sub-byte pixels not starting on a byte boundary
+  if (converter->format == PNG_FORMAT_RAW) {
+    size_t available = png_row_bytes(&converter->ihdr, converter->ihdr.width) - first_bit / 8;
+    copy_packed_bits(start, available, (int)(first_bit % 8), out, width * pixel_bits);
+    return;
+  }
+  uint32_t lead = (uint32_t)((8 - first_bit % 8) / pixel_bits);
+  lead = lead < width ? lead : width;
+  convert_any_from(converter, pixels, x, out, lead);
+  if (width > lead) {
+    convert_png_row(converter, start + 1, out + 4 * (size_t)lead, width - lead);
+  }
+}
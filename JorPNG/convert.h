@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chunk.h"
+
+// Layouts unfiltered rows can be converted to
+typedef enum png_pixel_format_enum {
+  PNG_FORMAT_RAW,   // Samples as stored, in the color type and bit depth of the file
+  PNG_FORMAT_RGBA8, // 8 bit red, green, blue, alpha
+  PNG_FORMAT_BGRA8  // 8 bit blue, green, red, alpha
+} PngPixelFormat;
+
+struct png_converter_struct;
+typedef void (*png_convert_kernel)(const struct png_converter_struct* converter, const uint8_t* pixels, uint8_t* out, uint32_t width);
+
+// Converts rows of any color type and bit depth to 8 bit RGBA or BGRA.
+// Palettes are expanded, gray is replicated to the color channels, 16 bit
+// samples keep their high byte and images without alpha get it from tRNS,
+// either per palette entry or as a color key. The kernel is chosen from the
+// header and the chunks seen, so set the palette and transparency before
+// converting the first row.
+typedef struct png_converter_struct {
+  png_IHDR ihdr;
+  PngPixelFormat format;
+  uint8_t palette[256][4]; // Entries in the output channel order, with tRNS alpha
+  int has_key;             // tRNS color key of a gray or RGB image
+  uint16_t key[3];         // Gray, or red, green and blue samples of the key
+  uint8_t packed[256][32]; // 1, 2 and 4 bit gray and palette images: the converted pixels of each byte
+  png_convert_kernel kernel;
+} PngConverter;
+
+void init_png_converter(PngConverter* converter, const png_IHDR* ihdr, PngPixelFormat format);
+
+// PLTE and tRNS chunk data
+int set_png_palette(PngConverter* converter, const uint8_t* data, size_t length);
+int set_png_transparency(PngConverter* converter, const uint8_t* data, size_t length);
+
+// Length of a converted row of width pixels
+size_t png_converted_row_bytes(const PngConverter* converter, uint32_t width);
+
+// Convert width pixels of an unfiltered row, or copy them for PNG_FORMAT_RAW.
+// width is the image width, or that of an Adam7 pass.
+void convert_png_row(const PngConverter* converter, const uint8_t* pixels, uint8_t* out, uint32_t width);
+
+// The same for the width pixels from column x of an image row
+void convert_png_columns(const PngConverter* converter, const uint8_t* pixels, uint32_t x, uint32_t width, uint8_t* out);
+
+void test_convert();
+void test_packed_convert();
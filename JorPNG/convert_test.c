@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "convert.h"
+#include "cpu.h"
+
+#define CONVERT_TEST_WIDTH 1031
+
+// Palette, tRNS and key used by the tests
+typedef struct convert_setup_struct {
+  uint8_t palette[256 * 3];
+  uint8_t alpha[256];
+  uint8_t key[6];
+  int transparency; // tRNS present
+} ConvertSetup;
+
+static void make_convert_setup(ConvertSetup* setup, const png_IHDR* ihdr, int transparency) {
+  for (int i = 0; i < 256; i++) {
+    setup->palette[i * 3] = (uint8_t)(i * 3);
+    setup->palette[i * 3 + 1] = (uint8_t)(255 - i);
+    setup->palette[i * 3 + 2] = (uint8_t)(i ^ 0x5A);
+    setup->alpha[i] = (uint8_t)(i * 5);
+  }
+  // The key samples: 1 below 8 bits, which random rows are full of, and
+  // pixel 3 of make_convert_row above
+  for (int c = 0; c < 3; c++) {
+    setup->key[2 * c] = ihdr->bit_depth == 16 ? 0x2C : 0;
+    setup->key[2 * c + 1] = ihdr->bit_depth < 8 ? 1 : 0x2C;
+  }
+  setup->transparency = transparency;
+}
+
+static int init_test_converter(PngConverter* converter, const png_IHDR* ihdr, PngPixelFormat format, const ConvertSetup* setup) {
+  init_png_converter(converter, ihdr, format);
+  if (ihdr->color_type == 3 && set_png_palette(converter, setup->palette, sizeof(setup->palette)) < 0) return -1;
+  if (!setup->transparency) return 0;
+  switch (ihdr->color_type) {
+  case 0: return set_png_transparency(converter, setup->key, 2);
+  case 2: return set_png_transparency(converter, setup->key, 6);
+  case 3: return set_png_transparency(converter, setup->alpha, 200);
+  }
+  return 0;
+}
+
+static uint16_t reference_sample(const uint8_t* row, size_t index, int depth) {
+  if (depth == 16) return (uint16_t)(row[2 * index] << 8 | row[2 * index + 1]);
+  if (depth == 8) return row[index];
+  size_t bit = index * depth;
+  return (uint16_t)((row[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1));
+}
+
+static uint8_t reference_to_8(uint16_t sample, int depth) {
+  if (depth == 16) return (uint8_t)(sample >> 8);
+  return (uint8_t)(sample * 255 / ((1 << depth) - 1));
+}
+
+// Pixel x of a row in RGBA or BGRA, as the specification describes it
+static void reference_pixel(const png_IHDR* ihdr, PngPixelFormat format, const ConvertSetup* setup, const uint8_t* row, uint32_t x, uint8_t* out) {
+  int depth = ihdr->bit_depth;
+  int channels = color_channels[ihdr->color_type];
+  uint16_t samples[4] = { 0 };
+  for (int c = 0; c < channels; c++) {
+    samples[c] = reference_sample(row, (size_t)x * channels + c, depth);
+  }
+  uint8_t rgba[4];
+  switch (ihdr->color_type) {
+  case 0: {
+    uint16_t key = (uint16_t)(setup->key[0] << 8 | setup->key[1]);
+    rgba[0] = rgba[1] = rgba[2] = reference_to_8(samples[0], depth);
+    rgba[3] = setup->transparency && samples[0] == key ? 0 : 0xFF;
+    break;
+  }
+  case 2: {
+    int keyed = setup->transparency;
+    for (int c = 0; c < 3; c++) {
+      rgba[c] = reference_to_8(samples[c], depth);
+      keyed &= samples[c] == (uint16_t)(setup->key[2 * c] << 8 | setup->key[2 * c + 1]);
+    }
+    rgba[3] = keyed ? 0 : 0xFF;
+    break;
+  }
+  case 3:
+    memcpy(rgba, setup->palette + samples[0] * 3, 3);
+    rgba[3] = setup->transparency && samples[0] < 200 ? setup->alpha[samples[0]] : 0xFF;
+    break;
+  case 4:
+    rgba[0] = rgba[1] = rgba[2] = reference_to_8(samples[0], depth);
+    rgba[3] = reference_to_8(samples[1], depth);
+    break;
+  default:
+    for (int c = 0; c < 4; c++) {
+      rgba[c] = reference_to_8(samples[c], depth);
+    }
+  }
+  out[0] = format == PNG_FORMAT_BGRA8 ? rgba[2] : rgba[0];
+  out[1] = rgba[1];
+  out[2] = format == PNG_FORMAT_BGRA8 ? rgba[0] : rgba[2];
+  out[3] = rgba[3];
+}
+
+// Random samples, with all bytes of pixel 3 0x2C to match the key
+static void make_convert_row(const png_IHDR* ihdr, uint8_t* row, size_t length, uint32_t seed) {
+  for (size_t i = 0; i < length; i++) {
+    seed = seed * 1103515245 + 12345;
+    row[i] = (uint8_t)(seed >> 24);
+  }
+  size_t pixel_bytes = (size_t)ihdr->bit_depth * color_channels[ihdr->color_type] / 8;
+  if (ihdr->bit_depth >= 8) {
+    memset(row + 3 * pixel_bytes, 0x2C, pixel_bytes);
+  }
+}
+
+// Whether the converter gives the reference pixels for every width up to
+// CONVERT_TEST_WIDTH and for pixels from column x on
+static int converter_matches(const PngConverter* converter, const png_IHDR* ihdr, PngPixelFormat format, const ConvertSetup* setup,
+  const uint8_t* row, uint8_t* out, uint8_t* expected) {
+  static const uint32_t widths[] = { 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 64, CONVERT_TEST_WIDTH };
+  for (uint32_t x = 0; x < CONVERT_TEST_WIDTH; x++) {
+    reference_pixel(ihdr, format, setup, row, x, expected + 4 * x);
+  }
+  for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+    memset(out, 0xEE, 4 * CONVERT_TEST_WIDTH + 64);
+    convert_png_row(converter, row, out, widths[w]);
+    if (memcmp(out, expected, 4 * widths[w]) != 0) return 0;
+  }
+  for (uint32_t x = 1; x < 20; x++) {
+    convert_png_columns(converter, row, x, CONVERT_TEST_WIDTH - x, out);
+    if (memcmp(out, expected + 4 * x, 4 * (CONVERT_TEST_WIDTH - x)) != 0) return 0;
+  }
+  return 1;
+}
+
+// The SIMD kernels of 8 and 16 bit images, picked by the CPU features when
+// the converter is set up, give the reference pixels, as does the scalar code
+void test_convert() {
+  static const uint8_t formats[][2] = { { 0, 8 }, { 0, 16 }, { 2, 8 }, { 2, 16 }, { 3, 8 }, { 4, 8 }, { 4, 16 }, { 6, 8 }, { 6, 16 } };
+  static const CpuFeatures ssse3 = { 1, 1, 1, 1, 0 };
+  static const CpuFeatures sse2 = { 1, 0, 0, 0, 0 };
+  static const CpuFeatures scalar = { 0 };
+  static const CpuFeatures* kernels[4] = { NULL, &ssse3, &sse2, &scalar };
+  static const char* kernel_names[4] = { "widest", "SSSE3", "SSE2", "scalar" };
+  uint8_t* row = (uint8_t*)malloc(8 * CONVERT_TEST_WIDTH);
+  uint8_t* out = (uint8_t*)malloc(4 * CONVERT_TEST_WIDTH + 64);
+  uint8_t* expected = (uint8_t*)malloc(4 * CONVERT_TEST_WIDTH);
+  PngConverter* converter = (PngConverter*)malloc(sizeof(PngConverter));
+  int matches = row && out && expected && converter;
+  for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]) && matches; f++) {
+    png_IHDR ihdr = { CONVERT_TEST_WIDTH, 1, formats[f][1], formats[f][0], 0, 0, 0 };
+    make_convert_row(&ihdr, row, png_row_bytes(&ihdr, ihdr.width), (uint32_t)f);
+    for (int transparency = 0; transparency < 2; transparency++) {
+      ConvertSetup setup;
+      make_convert_setup(&setup, &ihdr, transparency);
+      for (PngPixelFormat format = PNG_FORMAT_RGBA8; format <= PNG_FORMAT_BGRA8; format++) {
+        for (int k = 0; k < 4; k++) {
+          restrict_cpu_features(kernels[k]);
+          if (init_test_converter(converter, &ihdr, format, &setup) < 0 ||
+              !converter_matches(converter, &ihdr, format, &setup, row, out, expected)) {
+            printf("Convert %s: color type %u, bit depth %u to %s%s differs\n", kernel_names[k], ihdr.color_type, ihdr.bit_depth,
+              format == PNG_FORMAT_BGRA8 ? "BGRA" : "RGBA", transparency ? " with tRNS" : "");
+            matches = 0;
+          }
+        }
+      }
+    }
+  }
+
+  // Speed of the RGB to BGRA kernels
+  double speeds[4] = { 0 };
+  if (matches) {
+    png_IHDR ihdr = { CONVERT_TEST_WIDTH, 1, 8, 2, 0, 0, 0 };
+    ConvertSetup setup;
+    make_convert_setup(&setup, &ihdr, 0);
+    for (int k = 0; k < 4; k++) {
+      restrict_cpu_features(kernels[k]);
+      init_test_converter(converter, &ihdr, PNG_FORMAT_BGRA8, &setup);
+      clock_t start = clock();
+      for (int i = 0; i < 2000; i++) {
+        convert_png_row(converter, row, out, CONVERT_TEST_WIDTH);
+      }
+      double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+      speeds[k] = 2000.0 * CONVERT_TEST_WIDTH * 4 / 1e6 / (seconds > 0 ? seconds : 1e-9);
+    }
+  }
+  restrict_cpu_features(NULL);
+  printf("Convert RGB8 to BGRA8: %.0f MB/s, SSSE3 %.0f MB/s, SSE2 %.0f MB/s, scalar %.0f MB/s, matches: %s\n",
+    speeds[0], speeds[1], speeds[2], speeds[3], matches ? "True" : "False");
+  free(row);
+  free(out);
+  free(expected);
+  free(converter);
+}
+
+// 1, 2 and 4 bit gray and palette rows go through the byte lookup table,
+// which must give the reference pixels at every width and starting column
+void test_packed_convert() {
+  static const uint8_t formats[][2] = { { 0, 1 }, { 0, 2 }, { 0, 4 }, { 3, 1 }, { 3, 2 }, { 3, 4 } };
+  uint8_t* row = (uint8_t*)malloc(CONVERT_TEST_WIDTH);
+  uint8_t* out = (uint8_t*)malloc(4 * CONVERT_TEST_WIDTH + 64);
+  uint8_t* expected = (uint8_t*)malloc(4 * CONVERT_TEST_WIDTH);
+  PngConverter* converter = (PngConverter*)malloc(sizeof(PngConverter));
+  int matches = row && out && expected && converter;
+  double table_speed = 0, reference_speed = 0;
+  for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]) && matches; f++) {
+    png_IHDR ihdr = { CONVERT_TEST_WIDTH, 1, formats[f][1], formats[f][0], 0, 0, 0 };
+    make_convert_row(&ihdr, row, png_row_bytes(&ihdr, ihdr.width), (uint32_t)f + 100);
+    for (int transparency = 0; transparency < 2; transparency++) {
+      ConvertSetup setup;
+      make_convert_setup(&setup, &ihdr, transparency);
+      for (PngPixelFormat format = PNG_FORMAT_RGBA8; format <= PNG_FORMAT_BGRA8; format++) {
+        if (init_test_converter(converter, &ihdr, format, &setup) < 0 ||
+            !converter_matches(converter, &ihdr, format, &setup, row, out, expected)) {
+          printf("Packed convert: color type %u, bit depth %u to %s%s differs\n", ihdr.color_type, ihdr.bit_depth,
+            format == PNG_FORMAT_BGRA8 ? "BGRA" : "RGBA", transparency ? " with tRNS" : "");
+          matches = 0;
+        }
+      }
+    }
+    // Table against sample by sample for 1 bit gray
+    if (f == 0 && matches) {
+      ConvertSetup setup;
+      make_convert_setup(&setup, &ihdr, 0);
+      init_test_converter(converter, &ihdr, PNG_FORMAT_RGBA8, &setup);
+      clock_t start = clock();
+      for (int i = 0; i < 2000; i++) {
+        convert_png_row(converter, row, out, CONVERT_TEST_WIDTH);
+      }
+      double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+      table_speed = 2000.0 * CONVERT_TEST_WIDTH * 4 / 1e6 / (seconds > 0 ? seconds : 1e-9);
+      start = clock();
+      for (int i = 0; i < 200; i++) {
+        for (uint32_t x = 0; x < CONVERT_TEST_WIDTH; x++) {
+          reference_pixel(&ihdr, PNG_FORMAT_RGBA8, &setup, row, x, out + 4 * x);
+        }
+      }
+      seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+      reference_speed = 200.0 * CONVERT_TEST_WIDTH * 4 / 1e6 / (seconds > 0 ? seconds : 1e-9);
+    }
+  }
+  printf("Packed convert 1 bit gray: %.0f MB/s, sample by sample %.0f MB/s, matches: %s\n",
+    table_speed, reference_speed, matches ? "True" : "False");
+  free(row);
+  free(out);
+  free(expected);
+  free(converter);
+}
@@ -0,0 +1,75 @@
+#include "cpu.h"
+#include "thread.h"
+
+#if CPU_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+static CpuFeatures cpu_features;
+static CpuFeatures detected_features; // cpu_features before restrict_cpu_features
+static OnceFlag cpu_features_once = ONCE_INIT;
+
+#if CPU_X86
+// registers[0..3] = EAX, EBX, ECX, EDX of the leaf
+static void cpuid(unsigned leaf, unsigned subleaf, unsigned registers[4]) {
+#ifdef _MSC_VER
+  __cpuidex((int*)registers, (int)leaf, (int)subleaf);
+#else
+  __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// Register state the OS saves on context switches (XCR0)
+static unsigned long long xgetbv(void) {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  unsigned eax, edx;
+  __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+  return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+#endif
+
+static void detect_cpu_features(void) {
+#if CPU_X86
+  unsigned registers[4];
+  cpuid(0, 0, registers);
+  unsigned max_leaf = registers[0];
+
+  cpuid(1, 0, registers);
+  cpu_features.sse2 = (registers[3] >> 26) & 1;
+  cpu_features.ssse3 = (registers[2] >> 9) & 1;
+  cpu_features.sse41 = (registers[2] >> 19) & 1;
+  cpu_features.pclmul = (registers[2] >> 1) & 1;
+
+  // AVX2 needs OSXSAVE and the XMM and YMM state enabled by the OS
+  int os_avx = ((registers[2] >> 27) & 1) && (xgetbv() & 6) == 6;
+  if (max_leaf >= 7 && os_avx) {
+    cpuid(7, 0, registers);
+    cpu_features.avx2 = (registers[1] >> 5) & 1;
+  }
+#endif
+  detected_features = cpu_features;
+}
+
+const CpuFeatures* get_cpu_features(void) {
+  run_once(&cpu_features_once, detect_cpu_features);
+  return &cpu_features;
+}
+
+void restrict_cpu_features(const CpuFeatures* allowed) {
+  run_once(&cpu_features_once, detect_cpu_features);
+  cpu_features = detected_features;
+  if (allowed) {
+    cpu_features.sse2 &= allowed->sse2;
+    cpu_features.ssse3 &= allowed->ssse3;
+    cpu_features.sse41 &= allowed->sse41;
+    cpu_features.pclmul &= allowed->pclmul;
+    cpu_features.avx2 &= allowed->avx2;
+  }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+// Runtime detection of the instruction set extensions used by the SIMD kernels
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CPU_X86 1
+#else
+#define CPU_X86 0
+#endif
+
+// Compile a single function for extensions the rest of the build does not
+// assume. MSVC allows the intrinsics in any function, so it needs nothing.
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET(features) __attribute__((target(features)))
+#else
+#define TARGET(features)
+#endif
+
+typedef struct cpu_features_struct {
+  int sse2;
+  int ssse3;
+  int sse41;
+  int pclmul;
+  int avx2; // Also requires the OS to save the YMM registers
+} CpuFeatures;
+
+// Detected once, then shared read-only
+const CpuFeatures* get_cpu_features(void);
+
+// Turn detected features off, for tests comparing the SIMD kernels with the
+// narrower ones and the scalar code. Only features set in allowed stay on,
+// NULL turns all detected features back on. Kernels are picked again at the
+// next call, or at the next converter init, so call it between decodes.
+void restrict_cpu_features(const CpuFeatures* allowed);
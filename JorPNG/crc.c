@@ -1,60 +1,234 @@
+#include <string.h>
+
 #include "crc.h"
+#include "cpu.h"
+#include "thread.h"
+
+#if CPU_X86
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
 
 // https://www.w3.org/TR/png/#D-CRCAppendix
 
-// Table of CRCs of all 8-bit messages.
-uint32_t crc_table[256];
+// Slice-by-16 tables. crc_table[0] is the table of CRCs of all 8-bit messages,
+// crc_table[k] advances a byte's CRC over k more zero bytes.
+static uint32_t crc_table[16][256];
+
+// x2n_table[n] is x^(2^n) modulo the polynomial, for crc32_combine
+static uint32_t x2n_table[32];
 
-// Flag: has the table been computed? Initially false.
-int crc_table_computed = 0;
+static OnceFlag crc_table_once = ONCE_INIT;
 
-// Make the table for a fast CRC.
-void make_crc_table(void)
-{
-  uint32_t c;
-  int n, k;
+// Multiply a and b modulo the polynomial. Bit 31 holds the x^0 term (reflected).
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = 1UL << 31;
+  uint32_t p = 0;
+  while (1) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) {
+        break;
+      }
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ POLYNOMIAL : b >> 1;
+  }
+  return p;
+}
+
+// x^(n * 2^k) modulo the polynomial
+static uint32_t x2nmodp(size_t n, unsigned k) {
+  uint32_t p = 1UL << 31; // x^0
+  while (n) {
+    if (n & 1) {
+      p = multmodp(x2n_table[k & 31], p);
+    }
+    n >>= 1;
+    k++;
+  }
+  return p;
+}
 
-  for (n = 0; n < 256; n++) {
-    c = (uint32_t)n;
-    for (k = 0; k < 8; k++) {
+// Make the tables for a fast CRC.
+static void make_crc_table(void) {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++) {
       if (c & 1)
         c = POLYNOMIAL ^ (c >> 1);
       else
         c = c >> 1;
     }
-    crc_table[n] = c;
+    crc_table[0][n] = c;
+  }
+  for (int k = 1; k < 16; k++) {
+    for (int n = 0; n < 256; n++) {
+      uint32_t c = crc_table[k - 1][n];
+      crc_table[k][n] = (c >> 8) ^ crc_table[0][c & 0xff];
+    }
+  }
+
+  uint32_t p = 1UL << 30; // x^1
+  x2n_table[0] = p;
+  for (int n = 1; n < 32; n++) {
+    x2n_table[n] = p = multmodp(p, p);
+  }
+}
+
+static inline uint32_t load_le32(const uint8_t* buf) {
+  uint32_t word;
+  memcpy(&word, buf, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap32(word);
+#endif
+  return word;
+}
+
+// Portable path: 16 bytes per step with one table lookup per byte, and no
+// dependency between the lookups of a step
+static uint32_t update_crc_slice16(uint32_t c, const uint8_t* buf, size_t len) {
+  while (len >= 16) {
+    uint32_t w0 = load_le32(buf) ^ c;
+    uint32_t w1 = load_le32(buf + 4);
+    uint32_t w2 = load_le32(buf + 8);
+    uint32_t w3 = load_le32(buf + 12);
+    c = crc_table[15][w0 & 0xff] ^ crc_table[14][(w0 >> 8) & 0xff] ^
+        crc_table[13][(w0 >> 16) & 0xff] ^ crc_table[12][w0 >> 24] ^
+        crc_table[11][w1 & 0xff] ^ crc_table[10][(w1 >> 8) & 0xff] ^
+        crc_table[9][(w1 >> 16) & 0xff] ^ crc_table[8][w1 >> 24] ^
+        crc_table[7][w2 & 0xff] ^ crc_table[6][(w2 >> 8) & 0xff] ^
+        crc_table[5][(w2 >> 16) & 0xff] ^ crc_table[4][w2 >> 24] ^
+        crc_table[3][w3 & 0xff] ^ crc_table[2][(w3 >> 8) & 0xff] ^
+        crc_table[1][(w3 >> 16) & 0xff] ^ crc_table[0][w3 >> 24];
+    buf += 16;
+    len -= 16;
+  }
+  while (len--) {
+    c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+  }
+  return c;
+}
+
+#if CPU_X86
+// Fold 64 bytes per step with carry-less multiplication, then Barrett reduce
+// to 32 bits. len must be at least 64 and a multiple of 16.
+// Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+TARGET("sse2,pclmul")
+static uint32_t update_crc_pclmul(uint32_t c, const uint8_t* buf, size_t len) {
+  // x^(4*128+32) mod P, x^(4*128-32) mod P; x^(128+32), x^(128-32); x^64; P and mu
+  static const uint64_t k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+  static const uint64_t k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+  static const uint64_t k5k0[2] = { 0x0163cd6124, 0x0000000000 };
+  static const uint64_t poly[2] = { 0x01db710641, 0x01f7011641 };
+
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+  x0 = _mm_loadu_si128((const __m128i*)k1k2);
+  buf += 64;
+  len -= 64;
+
+  // Fold four 128 bit lanes in parallel
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(buf + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(buf + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(buf + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(buf + 0x30)));
+    buf += 64;
+    len -= 64;
   }
-  crc_table_computed = 1;
+
+  // Fold the lanes into one
+  x0 = _mm_loadu_si128((const __m128i*)k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // Fold the remaining 16 byte blocks
+  while (len >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)buf)), x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  // Fold 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduce to 32 bits
+  x0 = _mm_loadu_si128((const __m128i*)poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
 }
+#endif
 
 // Update a running CRC with the bytes buf[0..len-1]
 // The CRC should be initialized to all 1's, and the transmitted
 // value is the 1's complement of the final running CRC
 // (see the crc() routine below).
-uint32_t update_crc(uint32_t crc, uint8_t* buf, int len)
-{
-  uint32_t c = crc;
-  int n;
+uint32_t update_crc(uint32_t crc, const uint8_t* buf, size_t len) {
+  run_once(&crc_table_once, make_crc_table);
 
-  if (!crc_table_computed)
-    make_crc_table();
-  for (n = 0; n < len; n++) {
-    c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+#if CPU_X86
+  const CpuFeatures* cpu = get_cpu_features();
+  if (cpu->pclmul && cpu->sse2 && len >= 64) {
+    size_t folded = len & ~(size_t)15;
+    crc = update_crc_pclmul(crc, buf, folded);
+    buf += folded;
+    len -= folded;
   }
-  return c;
+#endif
+  return update_crc_slice16(crc, buf, len);
 }
 
 // Return the CRC of the bytes buf[0..len-1].
-uint32_t crc(uint8_t* buf, int len)
-{
+uint32_t crc(uint8_t* buf, size_t len) {
   return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
 }
 
 // Calculate CRC of typed PNG chunk
-uint32_t chunk_crc(uint8_t* type, uint8_t* buf, int len)
-{
+uint32_t chunk_crc(uint8_t* type, uint8_t* buf, size_t len) {
   uint32_t c = 0xffffffffL;
   c = update_crc(c, type, 4);
   c = update_crc(c, buf, len);
   return c ^ 0xffffffffL;
 }
+
+// CRC of two pieces joined together, from the CRCs of each piece and the
+// length of the second. Lets the pieces of a large chunk be checked in parallel.
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+  run_once(&crc_table_once, make_crc_table);
+  return multmodp(x2nmodp(len2, 3), crc1) ^ crc2;
+}
@@ -1,11 +1,16 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 //                   00000000001111111111222222222233
 //                   01234567890123456789012345678901
 #define POLYNOMIAL 0b11101101101110001000001100100000UL
 //#define POLYNOMIAL 0xedb88320L
 
-uint32_t chunk_crc(uint8_t* type, uint8_t* buf, int len);
-uint32_t crc(uint8_t* buf, int len);
+uint32_t update_crc(uint32_t crc, const uint8_t* buf, size_t len);
+uint32_t chunk_crc(uint8_t* type, uint8_t* buf, size_t len);
+uint32_t crc(uint8_t* buf, size_t len);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+void test_crc();
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "input.h"
+#include "pipeline.h"
+#include "adam7.h"
+
+void init_png_context(PngContext* context, const PngAllocator* allocator) {
+  memset(context, 0, sizeof(*context));
+  init_arena(&context->arena, allocator);
+}
+
+void free_png_context(PngContext* context) {
+  free_arena(&context->arena);
+}
+
+void free_png_image(PngImage* image) {
+  if (image->allocated) {
+    free(image->pixels);
+    image->pixels = NULL;
+    image->capacity = 0;
+    image->allocated = 0;
+  }
+}
+
+// Rows are converted straight into the image, right after unfiltering
+static void store_row(void* context, uint32_t y, const uint8_t* pixels, size_t length) {
+  PngContext* png = (PngContext*)context;
+  PngImage* image = png->image;
+  (void)length;
+  if (image->crop.width) {
+    // Rows before the crop are still unfiltered, as the rows after them depend on them
+    if (y >= image->crop.y) {
+      convert_png_columns(&png->converter, pixels, image->crop.x, image->crop.width, image->pixels + (size_t)(y - image->crop.y) * image->row_bytes);
+    }
+    return;
+  }
+  if (image->scale > 1) {
+    convert_png_row(&png->converter, pixels, png->row, image->ihdr.width);
+    scale_png_row(&png->scaler, y, png->row, image->pixels + (size_t)(y / image->scale) * image->row_bytes);
+    return;
+  }
+  convert_png_row(&png->converter, pixels, image->pixels + (size_t)y * image->row_bytes, image->ihdr.width);
+}
+
+// Scaled interlaced images only decode the first passes, whose pixels lie on
+// the grid of the reduced image
+static void store_pass(void* context, int pass, uint32_t y, const uint8_t* pixels, size_t length) {
+  PngContext* png = (PngContext*)context;
+  PngImage* image = png->image;
+  const Adam7Pass* p = &adam7_passes[pass];
+  uint32_t width = adam7_pass_width(pass, image->ihdr.width);
+  (void)length;
+  convert_png_row(&png->converter, pixels, png->row, width);
+  uint8_t* out = image->pixels + (size_t)((p->y0 + y * p->dy) / image->scale) * image->row_bytes;
+  for (uint32_t x = 0; x < width; x++) {
+    memcpy(out + 4 * (size_t)((p->x0 + x * p->dx) / image->scale), png->row + 4 * (size_t)x, 4);
+  }
+}
+
+// Decoders of scaled images, which never hold the full size image
+static int start_scaled_image(PngContext* context, const png_IHDR* ihdr, PngImage* image) {
+  PngDecoder* decoder = &context->decoder;
+  context->row = (uint8_t*)arena_alloc(&context->arena, (size_t)ihdr->width * 4);
+  if (!context->row) {
+    fprintf(stderr, "Failed to allocate scaling buffer!\n");
+    return -1;
+  }
+  if (ihdr->interlace_method == 0) {
+    return init_png_scaler(&context->scaler, ihdr->width, ihdr->height, image->scale, &context->arena);
+  }
+  // Passes 1, 1-3 and 1-5 cover every 8th, 4th and 2nd pixel in both directions
+  set_png_pass_callback(decoder, store_pass);
+  set_png_last_pass(decoder, image->scale == 8 ? 0 : image->scale == 4 ? 2 : 4);
+  return 0;
+}
+
+// Size the output for the header and set up the decoder to fill it
+static int start_image(PngContext* context, const png_IHDR* ihdr, PngImage* image) {
+  if (check_IHDR(ihdr) < 0) {
+    return -1;
+  }
+  int scale = image->scale > 1 ? image->scale : 1;
+  if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+    fprintf(stderr, "Unsupported scale 1/%d\n", scale);
+    return -1;
+  }
+  if (scale > 1 && image->format == PNG_FORMAT_RAW) {
+    fprintf(stderr, "Scaled decoding needs the RGBA8 or BGRA8 format\n");
+    return -1;
+  }
+  const PngRegion* crop = &image->crop;
+  if (crop->width && (scale > 1 || crop->height == 0 ||
+      crop->x >= ihdr->width || crop->width > ihdr->width - crop->x ||
+      crop->y >= ihdr->height || crop->height > ihdr->height - crop->y)) {
+    fprintf(stderr, "Invalid crop %ux%u at %u,%u\n", crop->width, crop->height, crop->x, crop->y);
+    return -1;
+  }
+  image->ihdr = *ihdr;
+  image->checked = 1;
+  image->width = crop->width ? crop->width : png_scaled_size(ihdr->width, scale);
+  image->height = crop->width ? crop->height : png_scaled_size(ihdr->height, scale);
+  init_png_converter(&context->converter, ihdr, image->format);
+  image->row_bytes = png_converted_row_bytes(&context->converter, image->width);
+  if (image->height != 0 && image->row_bytes > SIZE_MAX / image->height) {
+    fprintf(stderr, "Image of %ux%u is too large!\n", image->width, image->height);
+    return -1;
+  }
+  size_t size = image->row_bytes * image->height;
+  if (!image->pixels || image->capacity < size) {
+    free_png_image(image);
+    image->pixels = (uint8_t*)malloc(size);
+    if (!image->pixels) {
+      fprintf(stderr, "Failed to allocate the image!\n");
+      return -1;
+    }
+    image->capacity = size;
+    image->allocated = 1;
+  }
+
+  context->image = image;
+  if (init_png_decoder_arena(&context->decoder, ihdr, store_row, context, &context->arena) < 0) {
+    return -1;
+  }
+  if (crop->width) {
+    // Nothing past the crop is inflated
+    set_png_row_limit(&context->decoder, crop->y + crop->height);
+  }
+  return scale > 1 ? start_scaled_image(context, ihdr, image) : 0;
+}
+
+// Decode the chunks of an opened input. The callers reset the arena first,
+// which then holds the stream buffer, the scanlines and the window.
+static int decode_png_input(PngContext* context, PngInput* input, PngImage* image) {
+  if (read_png_signature(input) < 0) {
+    return -1;
+  }
+
+  int have_header = 0;
+  int idat_state = 0; // 0 before the IDAT chunks, 1 within them, 2 after them
+  png_chunk chunk;
+  int chunk_pending = 0; // chunk was already read by the pipeline
+  while (1) {
+    if (chunk_pending) {
+      chunk_pending = 0;
+    }
+    else if (read_png_chunk(input, &chunk) < 0) {
+      return -1;
+    }
+
+    if (idat_state == 1 && chunk.chunk_type != IDAT) {
+      // The first chunk after the IDAT chunks ends the zlib stream
+      if (png_decode_finish(&context->decoder) == INFLATE_FAILED) {
+        return -1;
+      }
+      idat_state = 2;
+    }
+
+    switch (chunk.chunk_type) {
+    case IHDR: {
+      if (have_header || chunk.length != 13) {
+        fprintf(stderr, "Invalid IHDR chunk\n");
+        return -1;
+      }
+      const uint8_t* data = chunk.data;
+      png_IHDR ihdr = { read_be32(data), read_be32(data + 4), data[8], data[9], data[10], data[11], data[12] };
+      if (start_image(context, &ihdr, image) < 0) {
+        return -1;
+      }
+      have_header = 1;
+      break;
+    }
+    case IDAT:
+      if (!have_header || idat_state == 2) {
+        fprintf(stderr, "Unexpected IDAT chunk\n");
+        return -1;
+      }
+      if (context->pipelined) {
+        // Reads the remaining IDAT chunks and the one after them
+        if (png_decode_pipelined(&context->decoder, input, &chunk) < 0) {
+          return -1;
+        }
+        if (context->decoder.stopped) {
+          image->checked = 0;
+          return 0;
+        }
+        idat_state = 2;
+        chunk_pending = 1;
+        break;
+      }
+      idat_state = 1;
+      // Inflate reads the chunk in place
+      if (png_decode_data(&context->decoder, chunk.data, chunk.length, chunk.padding) == INFLATE_FAILED) {
+        return -1;
+      }
+      if (context->decoder.stopped) {
+        // All rows of the crop are done; the rest of the file is not read
+        image->checked = 0;
+        return 0;
+      }
+      break;
+    case PLTE:
+      if (have_header && set_png_palette(&context->converter, chunk.data, chunk.length) < 0) {
+        return -1;
+      }
+      break;
+    case tRNS:
+      // Invalid transparency is ignored, like other ancillary chunks
+      if (have_header && idat_state == 0) {
+        set_png_transparency(&context->converter, chunk.data, chunk.length);
+      }
+      break;
+    case IEND:
+      if (idat_state != 2) {
+        fprintf(stderr, "No image data\n");
+        return -1;
+      }
+      return 0;
+    default:
+      break;
+    }
+  }
+}
+
+int png_decode_file(PngContext* context, const char* filename, PngImage* image) {
+  PngInput input;
+  reset_arena(&context->arena);
+  if (open_png_input_file(&input, filename, &context->arena) < 0) {
+    return -1;
+  }
+  int result = decode_png_input(context, &input, image);
+  close_png_input(&input);
+  return result;
+}
+
+int png_decode_memory(PngContext* context, const uint8_t* data, size_t length, PngImage* image) {
+  PngInput input;
+  reset_arena(&context->arena);
+  open_png_input_memory(&input, data, length);
+  return decode_png_input(context, &input, image);
+}
+
+int png_decode_stream(PngContext* context, FILE* file, PngImage* image) {
+  PngInput input;
+  reset_arena(&context->arena);
+  open_png_input_stream(&input, file, &context->arena);
+  int result = decode_png_input(context, &input, image);
+  close_png_input(&input);
+  return result;
+}
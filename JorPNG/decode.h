@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "chunk.h"
+#include "png.h"
+#include "arena.h"
+#include "convert.h"
+#include "scale.h"
+
+// Rectangle of an image: width by height pixels from column x of row y
+typedef struct png_region_struct {
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+} PngRegion;
+
+// Decoded image: height rows of row_bytes bytes, without filter type bytes.
+// The pixels are in the bit depth and color type of the file (see ihdr), or
+// converted to 8 bit RGBA or BGRA when format asks for it.
+typedef struct png_image_struct {
+  png_IHDR ihdr;
+  PngPixelFormat format; // Set by the caller before decoding
+  int scale;             // Set by the caller: 2, 4 or 8 to decode at that fraction of the size (see scale.h), 0 for full size
+  PngRegion crop;        // Set by the caller to decode only this part, width 0 for the whole image
+  uint32_t width;        // Size of pixels, the image size reduced by scale or the crop size
+  uint32_t height;
+  int checked;           // All checksums ran; 0 when decoding stopped once the crop or scaled passes were done
+  size_t row_bytes;
+  uint8_t* pixels;       // Caller's buffer of capacity bytes, or NULL to have one allocated
+  size_t capacity;
+  int allocated;         // pixels was allocated by the decoder, see free_png_image
+} PngImage;
+
+// Decoding state of one thread, kept from image to image. All scratch
+// memory comes from the arena, which is reset for every image, so once it has
+// grown to the largest image decoding allocates nothing but output.
+typedef struct png_context_struct {
+  Arena arena;
+  PngDecoder decoder;
+  PngConverter converter;
+  PngImage* image;  // Image being decoded
+  PngScaler scaler;
+  uint8_t* row;     // Converted row before scaling
+  int pipelined; // Decode the IDAT chunks on three threads (see pipeline.h), for large images
+} PngContext;
+
+// allocator NULL uses the C heap
+void init_png_context(PngContext* context, const PngAllocator* allocator);
+void free_png_context(PngContext* context);
+
+// Decode a whole PNG without printing anything but errors. Files are
+// memory-mapped when possible, and mapped or in-memory IDAT data is inflated
+// in place. Streams like pipes are read chunk by chunk.
+int png_decode_file(PngContext* context, const char* filename, PngImage* image);
+int png_decode_memory(PngContext* context, const uint8_t* data, size_t length, PngImage* image);
+int png_decode_stream(PngContext* context, FILE* file, PngImage* image);
+void free_png_image(PngImage* image);
+
+void test_decode();
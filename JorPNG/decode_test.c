@@ -0,0 +1,985 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "decode.h"
+#include "deflate.h"
+#include "crc.h"
+#include "adam7.h"
+#include "unfilter.h"
+#include "zlib.h"
+#include "restart.h"
+#include "speculate.h"
+#include "batch.h"
+#include "probe.h"
+
+// Test images are encoded here with the deflater, filtered with every filter
+// type in turn, and decoded back through the library
+
+typedef struct test_png_struct {
+  uint8_t* file;      // Whole PNG
+  size_t length;
+  uint8_t* idat;      // Its zlib stream, followed by BITSTREAM_PADDING zero bytes
+  size_t idat_length;
+} TestPng;
+
+static void put_be32(uint8_t* p, uint32_t value) {
+  p[0] = (uint8_t)(value >> 24);
+  p[1] = (uint8_t)(value >> 16);
+  p[2] = (uint8_t)(value >> 8);
+  p[3] = (uint8_t)value;
+}
+
+// Append a chunk with its length, type and CRC, returning its size
+static size_t put_chunk(uint8_t* out, uint32_t type, const uint8_t* data, uint32_t length) {
+  put_be32(out, length);
+  put_be32(out + 4, type);
+  if (length > 0) memcpy(out + 8, data, length);
+  put_be32(out + 8 + length, crc(out + 4, length + 4));
+  return (size_t)length + 12;
+}
+
+// Wall clock time, as the threaded decodes use more CPU time than they take
+static double wall_seconds(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double seconds_since(double start) {
+  double seconds = wall_seconds() - start;
+  return seconds > 0 ? seconds : 1e-9;
+}
+
+// Pixels with gradients, flat areas and some noise, so every filter type and
+// match length turns up
+static uint8_t* make_test_pixels(const png_IHDR* ihdr, uint32_t seed) {
+  size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+  uint8_t* pixels = (uint8_t*)malloc(row_bytes * ihdr->height);
+  if (!pixels) return NULL;
+  uint32_t random = seed;
+  for (uint32_t y = 0; y < ihdr->height; y++) {
+    for (size_t i = 0; i < row_bytes; i++) {
+      random = random * 1103515245 + 12345;
+      uint8_t value = (uint8_t)(i * 3 + y * 5);
+      if (y % 7 == 3) value = (uint8_t)(i / 16);
+      if ((random >> 24) < 32) value ^= (uint8_t)(random >> 16);
+      pixels[y * row_bytes + i] = value;
+    }
+  }
+  return pixels;
+}
+
+static uint8_t paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return (uint8_t)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// The inverse of unfilter_row, written out plainly
+static void filter_row(uint8_t filter, const uint8_t* row, const uint8_t* prior, size_t length, size_t bpp, uint8_t* out) {
+  for (size_t i = 0; i < length; i++) {
+    int a = i >= bpp ? row[i - bpp] : 0;
+    int b = prior ? prior[i] : 0;
+    int c = prior && i >= bpp ? prior[i - bpp] : 0;
+    int predictor = 0;
+    switch (filter) {
+    case FILTER_SUB: predictor = a; break;
+    case FILTER_UP: predictor = b; break;
+    case FILTER_AVERAGE: predictor = (a + b) / 2; break;
+    case FILTER_PAETH: predictor = paeth(a, b, c); break;
+    }
+    out[i] = (uint8_t)(row[i] - predictor);
+  }
+}
+
+// Copy pixel x of a row with bits per pixel to pixel out_x of another
+static void copy_pixel(const uint8_t* row, uint32_t x, uint8_t* out, uint32_t out_x, size_t bits) {
+  if (bits >= 8) {
+    memcpy(out + out_x * bits / 8, row + x * bits / 8, bits / 8);
+    return;
+  }
+  size_t shift = 8 - bits - x * bits % 8;
+  uint8_t value = (uint8_t)(row[x * bits / 8] >> shift & ((1 << bits) - 1));
+  size_t out_shift = 8 - bits - out_x * bits % 8;
+  out[out_x * bits / 8] &= (uint8_t)~(((1 << bits) - 1) << out_shift);
+  out[out_x * bits / 8] |= (uint8_t)(value << out_shift);
+}
+
+// Filtered scanlines of the image, or of its seven passes when interlaced.
+// The filter type changes from row to row when filter is -1.
+static uint8_t* filter_image(const png_IHDR* ihdr, const uint8_t* pixels, int filter, size_t* length) {
+  size_t bits = png_bytes_per_pixel(ihdr) * 8;
+  if (ihdr->bit_depth < 8) bits = ihdr->bit_depth;
+  size_t bpp = bits < 8 ? 1 : bits / 8;
+  size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+  size_t size = ihdr->interlace_method ? adam7_filtered_bytes(ihdr) : (row_bytes + 1) * ihdr->height;
+  uint8_t* filtered = (uint8_t*)malloc(size);
+  uint8_t* rows = (uint8_t*)calloc(2, row_bytes + 1);
+  if (!filtered || !rows) {
+    free(filtered);
+    free(rows);
+    return NULL;
+  }
+  uint8_t* out = filtered;
+  int passes = ihdr->interlace_method ? ADAM7_PASSES : 1;
+  for (int pass = 0; pass < passes; pass++) {
+    uint32_t width = ihdr->interlace_method ? adam7_pass_width(pass, ihdr->width) : ihdr->width;
+    uint32_t height = ihdr->interlace_method ? adam7_pass_height(pass, ihdr->height) : ihdr->height;
+    if (width == 0) continue;
+    size_t pass_bytes = png_row_bytes(ihdr, width);
+    for (uint32_t y = 0; y < height; y++) {
+      uint8_t* row = rows + (y & 1) * (row_bytes + 1);
+      const uint8_t* prior = y > 0 ? rows + ((y - 1) & 1) * (row_bytes + 1) : NULL;
+      if (ihdr->interlace_method) {
+        const Adam7Pass* p = &adam7_passes[pass];
+        memset(row, 0, pass_bytes);
+        for (uint32_t x = 0; x < width; x++) {
+          copy_pixel(pixels + (p->y0 + y * p->dy) * row_bytes, p->x0 + x * p->dx, row, x, bits);
+        }
+      }
+      else {
+        memcpy(row, pixels + y * row_bytes, row_bytes);
+      }
+      uint8_t type = (uint8_t)(filter >= 0 ? filter : (y + pass) % 5);
+      *out++ = type;
+      filter_row(type, row, prior, pass_bytes, bpp, out);
+      out += pass_bytes;
+    }
+  }
+  free(rows);
+  *length = size;
+  return filtered;
+}
+
+// Write the PNG of png->idat: IHDR, the extra chunks, then the zlib stream
+// in IDAT chunks of idat_size bytes
+static int write_test_png(TestPng* png, const png_IHDR* ihdr, const uint8_t* chunks, size_t chunks_length, size_t idat_size) {
+  size_t idat_chunks = png->idat_length / idat_size + 1;
+  png->file = (uint8_t*)malloc(8 + 25 + chunks_length + png->idat_length + 12 * idat_chunks + 12);
+  if (!png->file) return -1;
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  uint8_t* out = png->file;
+  memcpy(out, signature, 8);
+  out += 8;
+  uint8_t header[13];
+  put_be32(header, ihdr->width);
+  put_be32(header + 4, ihdr->height);
+  header[8] = ihdr->bit_depth;
+  header[9] = ihdr->color_type;
+  header[10] = 0;
+  header[11] = 0;
+  header[12] = ihdr->interlace_method;
+  out += put_chunk(out, IHDR, header, 13);
+  if (chunks_length > 0) memcpy(out, chunks, chunks_length);
+  out += chunks_length;
+  for (size_t offset = 0; offset < png->idat_length; offset += idat_size) {
+    size_t length = png->idat_length - offset < idat_size ? png->idat_length - offset : idat_size;
+    out += put_chunk(out, IDAT, png->idat + offset, (uint32_t)length);
+  }
+  out += put_chunk(out, IEND, NULL, 0);
+  png->length = out - png->file;
+  return 0;
+}
+
+// Encode pixels (height rows of png_row_bytes bytes) as a PNG
+static int make_test_png(TestPng* png, const png_IHDR* ihdr, const uint8_t* pixels, int filter,
+  const uint8_t* chunks, size_t chunks_length, size_t idat_size, int level) {
+  memset(png, 0, sizeof(*png));
+  size_t filtered_length = 0;
+  uint8_t* filtered = filter_image(ihdr, pixels, filter, &filtered_length);
+  size_t capacity = deflate_bound(filtered_length) + BITSTREAM_PADDING;
+  png->idat = (uint8_t*)calloc(capacity, 1);
+  Deflater deflater;
+  int result = -1;
+  if (filtered && png->idat && init_deflater(&deflater, level, NULL) == 0) {
+    result = deflate_zlib_data(&deflater, filtered, filtered_length, png->idat, capacity, &png->idat_length);
+    free_deflater(&deflater);
+  }
+  free(filtered);
+  if (result == 0) {
+    memset(png->idat + png->idat_length, 0, BITSTREAM_PADDING);
+    result = write_test_png(png, ihdr, chunks, chunks_length, idat_size);
+  }
+  return result;
+}
+
+static void free_test_png(TestPng* png) {
+  free(png->file);
+  free(png->idat);
+}
+
+// Color types and bit depths a PNG can have
+static const uint8_t test_formats[][2] = {
+  { 0, 1 }, { 0, 2 }, { 0, 4 }, { 0, 8 }, { 0, 16 }, { 2, 8 }, { 2, 16 }, { 3, 1 },
+  { 3, 2 }, { 3, 4 }, { 3, 8 }, { 4, 8 }, { 4, 16 }, { 6, 8 }, { 6, 16 }
+};
+#define TEST_FORMATS (sizeof(test_formats) / sizeof(test_formats[0]))
+
+// Rows handed to a png_row_callback, collected into an image
+typedef struct test_rows_struct {
+  uint8_t* pixels;
+  size_t row_bytes;
+  uint32_t height;
+  uint32_t rows; // Rows received
+} TestRows;
+
+static void collect_row(void* context, uint32_t y, const uint8_t* pixels, size_t length) {
+  TestRows* rows = (TestRows*)context;
+  if (y < rows->height && length == rows->row_bytes) {
+    memcpy(rows->pixels + y * rows->row_bytes, pixels, length);
+    rows->rows++;
+  }
+}
+
+// Encode a non-interlaced image with count segments of rows that can be
+// inflated independently, listed in a joRP chunk (see restart.h). The
+// deflater cannot flush, so all segments but the last are stored blocks.
+static int make_restart_png(TestPng* png, const png_IHDR* ihdr, const uint8_t* pixels, int count, int level) {
+  memset(png, 0, sizeof(*png));
+  size_t filtered_length = 0;
+  uint8_t* filtered = filter_image(ihdr, pixels, -1, &filtered_length);
+  size_t capacity = 2 + filtered_length + 5 * (filtered_length / 65535 + count) + deflate_bound(filtered_length) + 4;
+  png->idat = (uint8_t*)calloc(capacity + BITSTREAM_PADDING, 1);
+  uint8_t chunk[12 + 4 + 8 * MAX_RESTART_POINTS];
+  uint8_t joRP_data[4 + 8 * MAX_RESTART_POINTS];
+  Deflater deflater;
+  int result = -1;
+  if (filtered && png->idat && count > 1 && count <= MAX_RESTART_POINTS && init_deflater(&deflater, level, NULL) == 0) {
+    size_t row_stride = png_row_bytes(ihdr, ihdr->width) + 1;
+    uint8_t* out = png->idat;
+    *out++ = 0x78;
+    *out++ = 0x01;
+    put_be32(joRP_data, (uint32_t)(count - 1));
+    for (int i = 0; i < count; i++) {
+      uint32_t row = (uint32_t)((uint64_t)ihdr->height * i / count);
+      size_t start = row * row_stride;
+      size_t end = i == count - 1 ? filtered_length : (size_t)((uint64_t)ihdr->height * (i + 1) / count) * row_stride;
+      if (i > 0) {
+        put_be32(joRP_data + 4 + (i - 1) * 8, row);
+        put_be32(joRP_data + 8 + (i - 1) * 8, (uint32_t)(out - png->idat));
+      }
+      if (i == count - 1) {
+        size_t length = 0;
+        result = deflate_data(&deflater, filtered + start, end - start, out, capacity - (out - png->idat) - 4, &length);
+        out += length;
+        break;
+      }
+      // Non-final stored blocks of at most 65535 bytes
+      for (size_t offset = start; offset < end; offset += 65535) {
+        size_t length = end - offset < 65535 ? end - offset : 65535;
+        *out++ = 0;
+        out[0] = (uint8_t)length;
+        out[1] = (uint8_t)(length >> 8);
+        out[2] = (uint8_t)~length;
+        out[3] = (uint8_t)(~length >> 8);
+        memcpy(out + 4, filtered + offset, length);
+        out += 4 + length;
+      }
+    }
+    free_deflater(&deflater);
+    put_be32(out, adler32(filtered, filtered_length));
+    png->idat_length = out + 4 - png->idat;
+  }
+  free(filtered);
+  if (result == 0) {
+    size_t chunk_length = put_chunk(chunk, joRP, joRP_data, 4 + 8 * (count - 1));
+    result = write_test_png(png, ihdr, chunk, chunk_length, 1 << 14);
+  }
+  return result;
+}
+
+// Test pixels with the unused bits at the end of sub-byte rows cleared, as
+// the decoder leaves them
+static uint8_t* make_test_image(const png_IHDR* ihdr, uint32_t seed) {
+  uint8_t* pixels = make_test_pixels(ihdr, seed);
+  size_t row_bits = (size_t)ihdr->width * png_bytes_per_pixel(ihdr) * 8;
+  if (ihdr->bit_depth < 8) row_bits = (size_t)ihdr->width * ihdr->bit_depth;
+  size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+  if (pixels && row_bits % 8) {
+    for (uint32_t y = 0; y < ihdr->height; y++) {
+      pixels[y * row_bytes + row_bytes - 1] &= (uint8_t)(0xFF00 >> (row_bits % 8));
+    }
+  }
+  return pixels;
+}
+
+// PLTE chunk of 256 entries and a tRNS chunk for palette images, returning
+// their size
+static size_t make_palette_chunks(const png_IHDR* ihdr, uint8_t* out) {
+  if (ihdr->color_type != 3) return 0;
+  uint8_t palette[256 * 3];
+  uint8_t alpha[256];
+  for (int i = 0; i < 256; i++) {
+    palette[i * 3] = (uint8_t)i;
+    palette[i * 3 + 1] = (uint8_t)(255 - i);
+    palette[i * 3 + 2] = (uint8_t)(i * 7);
+    alpha[i] = (uint8_t)(255 - i / 2);
+  }
+  size_t length = put_chunk(out, PLTE, palette, sizeof(palette));
+  return length + put_chunk(out + length, tRNS, alpha, 200);
+}
+
+// Decode with a fresh image into format, at scale or cropped to crop when non-NULL
+static int decode_test_png(PngContext* context, const TestPng* png, PngImage* image, PngPixelFormat format, int scale, const PngRegion* crop) {
+  memset(image, 0, sizeof(*image));
+  image->format = format;
+  image->scale = scale;
+  if (crop) image->crop = *crop;
+  return png_decode_memory(context, png->file, png->length, image);
+}
+
+// The pixels of a decode are those encoded, row by row
+static int image_matches(const PngImage* image, const uint8_t* pixels, size_t row_bytes) {
+  if (image->row_bytes != row_bytes) return 0;
+  return memcmp(image->pixels, pixels, row_bytes * image->height) == 0;
+}
+
+// Sink collecting the output of a ring window
+typedef struct test_output_struct {
+  uint8_t* data;
+  size_t length;
+  size_t capacity;
+} TestOutput;
+
+static void test_output_sink(void* context, const uint8_t* data, size_t length) {
+  TestOutput* output = (TestOutput*)context;
+  if (length > output->capacity - output->length) return;
+  memcpy(output->data + output->length, data, length);
+  output->length += length;
+}
+
+// Inflate a zlib stream through a ring window of size bytes
+static int inflate_through_ring(const TestPng* png, size_t size, TestOutput* output) {
+  Window window;
+  if (init_ring_window(&window, size, test_output_sink, output) < 0) return -1;
+  InflateState state;
+  init_inflate(&state, &window);
+  output->length = 0;
+  int result = inflate_data(&state, png->idat + 2, png->idat_length - 2, BITSTREAM_PADDING);
+  if (result == INFLATE_NEED_INPUT) result = inflate_finish(&state);
+  flush_window(&window);
+  free_window(&window);
+  return result == INFLATE_FINISHED ? 0 : -1;
+}
+
+// Flat colour decodes through the ring window of the library decoders with
+// wide match copies and memset runs. A ring of only the largest window size
+// takes the byte by byte copy, for comparison.
+static void test_ring_window(void) {
+  png_IHDR ihdr = { 1024, 1024, 8, 6, 0, 0, 0 };
+  size_t row_bytes = png_row_bytes(&ihdr, ihdr.width);
+  size_t size = row_bytes * ihdr.height;
+  uint8_t* pixels = (uint8_t*)malloc(size);
+  if (!pixels) return;
+  for (size_t i = 0; i < size; i++) {
+    pixels[i] = (uint8_t)(0x4080FF20 >> (i % 4 * 8));
+  }
+  TestPng png;
+  if (make_test_png(&png, &ihdr, pixels, FILTER_NONE, NULL, 0, 1 << 16, DEFLATE_FASTEST) < 0) {
+    printf("Flat colour decode: encoding failed\n");
+    free(pixels);
+    return;
+  }
+
+  PngContext context;
+  init_png_context(&context, NULL);
+  PngImage image;
+  memset(&image, 0, sizeof(image));
+  double start = wall_seconds();
+  int result = png_decode_memory(&context, png.file, png.length, &image);
+  double decode_seconds = seconds_since(start);
+  int matches = result == 0 && memcmp(image.pixels, pixels, size) == 0;
+
+  TestOutput output = { (uint8_t*)malloc(size + ihdr.height), 0, size + ihdr.height };
+  double byte_seconds = 0, wide_seconds = 0;
+  if (output.data) {
+    start = wall_seconds();
+    matches &= inflate_through_ring(&png, MAX_WINDOW_SIZE, &output) == 0 && output.length == size + ihdr.height;
+    byte_seconds = seconds_since(start);
+    start = wall_seconds();
+    matches &= inflate_through_ring(&png, RING_WINDOW_SIZE, &output) == 0 && output.length == size + ihdr.height;
+    wide_seconds = seconds_since(start);
+  }
+  printf("Flat colour decode: %.0f MB/s, ring copies byte by byte %.0f MB/s, wide %.0f MB/s, matches: %s\n",
+    size / 1e6 / decode_seconds, size / 1e6 / byte_seconds, size / 1e6 / wide_seconds, matches ? "True" : "False");
+
+  free(output.data);
+  free_png_image(&image);
+  free_png_context(&context);
+  free_test_png(&png);
+  free(pixels);
+}
+
+// Interlaced images of every color type and bit depth, some with empty
+// passes, decode to the same pixels as without interlacing, raw and in RGBA
+static void test_adam7(void) {
+  static const uint32_t sizes[][2] = { { 1, 1 }, { 3, 2 }, { 5, 9 }, { 9, 9 }, { 37, 29 }, { 130, 67 } };
+  uint8_t chunks[1100];
+  PngContext context;
+  init_png_context(&context, NULL);
+  int images = 0;
+  int matches = 1;
+  for (size_t f = 0; f < TEST_FORMATS; f++) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      png_IHDR ihdr = { sizes[i][0], sizes[i][1], test_formats[f][1], test_formats[f][0], 0, 0, 0 };
+      uint8_t* pixels = make_test_image(&ihdr, (uint32_t)(f * 16 + i));
+      size_t chunks_length = make_palette_chunks(&ihdr, chunks);
+      TestPng plain, interlaced;
+      int result = make_test_png(&plain, &ihdr, pixels, -1, chunks, chunks_length, 100, DEFLATE_DEFAULT);
+      ihdr.interlace_method = 1;
+      result |= make_test_png(&interlaced, &ihdr, pixels, -1, chunks, chunks_length, 100, DEFLATE_DEFAULT);
+      size_t row_bytes = png_row_bytes(&ihdr, ihdr.width);
+      PngImage image, rgba;
+      memset(&image, 0, sizeof(image));
+      memset(&rgba, 0, sizeof(rgba));
+      int same = result == 0 && pixels &&
+        decode_test_png(&context, &interlaced, &image, PNG_FORMAT_RAW, 0, NULL) == 0 && image_matches(&image, pixels, row_bytes) &&
+        decode_test_png(&context, &plain, &rgba, PNG_FORMAT_RGBA8, 0, NULL) == 0;
+      if (same) {
+        free_png_image(&image);
+        same = decode_test_png(&context, &interlaced, &image, PNG_FORMAT_RGBA8, 0, NULL) == 0 && image_matches(&image, rgba.pixels, rgba.row_bytes);
+      }
+      if (!same) {
+        printf("Adam7 %ux%u, color type %u, bit depth %u differs\n", ihdr.width, ihdr.height, ihdr.color_type, ihdr.bit_depth);
+        matches = 0;
+      }
+      images++;
+      free_png_image(&image);
+      free_png_image(&rgba);
+      free_test_png(&plain);
+      free_test_png(&interlaced);
+      free(pixels);
+    }
+  }
+  free_png_context(&context);
+  printf("Adam7: %d images of every color type and bit depth, matches: %s\n", images, matches ? "True" : "False");
+}
+
+// Segments decoded on their own threads from joRP restart points give the
+// same rows as a serial decode of the same file
+static void test_restart_points(void) {
+  png_IHDR ihdr = { 700, 900, 8, 6, 0, 0, 0 };
+  size_t row_bytes = png_row_bytes(&ihdr, ihdr.width);
+  uint8_t* pixels = make_test_image(&ihdr, 11);
+  uint8_t* parallel = (uint8_t*)malloc(row_bytes * ihdr.height);
+  PngContext context;
+  init_png_context(&context, NULL);
+  int matches = pixels && parallel;
+  double parallel_seconds = 0, serial_seconds = 0;
+  static const int counts[] = { 2, 3, 8 };
+  for (int c = 0; c < 3 && matches; c++) {
+    TestPng png;
+    RestartPoints points;
+    TestRows rows = { parallel, row_bytes, ihdr.height, 0 };
+    Zlib_Stream info;
+    matches = make_restart_png(&png, &ihdr, pixels, counts[c], DEFLATE_DEFAULT) == 0;
+    // The joRP chunk follows the 33 bytes of signature and IHDR
+    matches = matches && read_be32(png.file + 37) == joRP &&
+      parse_joRP(&points, png.file + 41, read_be32(png.file + 33), &ihdr) == 0 && points.count == counts[c] - 1;
+    double start = wall_seconds();
+    matches = matches && png_decode_parallel(&ihdr, png.idat, png.idat_length, BITSTREAM_PADDING, &points, collect_row, &rows, &info, NULL) == 0 &&
+      rows.rows == ihdr.height && memcmp(parallel, pixels, row_bytes * ihdr.height) == 0;
+    parallel_seconds = seconds_since(start);
+
+    PngImage image;
+    start = wall_seconds();
+    matches = matches && decode_test_png(&context, &png, &image, PNG_FORMAT_RAW, 0, NULL) == 0 && image_matches(&image, parallel, row_bytes);
+    serial_seconds = seconds_since(start);
+    if (matches) free_png_image(&image);
+
+    // A restart point off the segment start must fail, leaving the serial decode
+    if (matches) {
+      points.offsets[0] += 1;
+      matches = png_decode_parallel(&ihdr, png.idat, png.idat_length, BITSTREAM_PADDING, &points, collect_row, &rows, &info, NULL) < 0;
+    }
+    free_test_png(&png);
+  }
+  size_t size = row_bytes * ihdr.height;
+  printf("Restart points: 8 segments %.0f MB/s, serial %.0f MB/s, matches: %s\n",
+    size / 1e6 / parallel_seconds, size / 1e6 / serial_seconds, matches ? "True" : "False");
+  free_png_context(&context);
+  free(parallel);
+  free(pixels);
+}
+
+// A single zlib stream of dynamic blocks, inflated speculatively in ranges
+// on several threads, gives the same rows as the serial decode. Streams too
+// short to split must be refused.
+static void test_speculative(void) {
+  png_IHDR ihdr = { 1536, 1024, 8, 6, 0, 0, 0 };
+  size_t row_bytes = png_row_bytes(&ihdr, ihdr.width);
+  size_t size = row_bytes * ihdr.height;
+  uint8_t* pixels = make_test_image(&ihdr, 5);
+  uint8_t* speculative = (uint8_t*)calloc(size, 1);
+  TestPng png;
+  int matches = pixels && speculative && make_test_png(&png, &ihdr, pixels, -1, NULL, 0, 1 << 16, DEFLATE_DEFAULT) == 0;
+  int speculated = 0;
+  double speculative_seconds = 0, serial_seconds = 0;
+  if (matches) {
+    TestRows rows = { speculative, row_bytes, ihdr.height, 0 };
+    Zlib_Stream info;
+    int threads = (int)(png.idat_length / SPECULATIVE_MIN_RANGE);
+    threads = threads < 4 ? threads : 4;
+    double start = wall_seconds();
+    speculated = threads > 1 && png_decode_speculative(&ihdr, png.idat, png.idat_length, BITSTREAM_PADDING, threads, collect_row, &rows, &info, NULL) == 0;
+    speculative_seconds = seconds_since(start);
+    matches = speculated && rows.rows == ihdr.height && memcmp(speculative, pixels, size) == 0;
+
+    PngContext context;
+    init_png_context(&context, NULL);
+    PngImage image;
+    start = wall_seconds();
+    matches = matches && decode_test_png(&context, &png, &image, PNG_FORMAT_RAW, 0, NULL) == 0 && image_matches(&image, speculative, row_bytes);
+    serial_seconds = seconds_since(start);
+    if (matches) free_png_image(&image);
+    free_png_context(&context);
+
+    // Half a range per thread is not worth splitting
+    matches = matches && png_decode_speculative(&ihdr, png.idat, SPECULATIVE_MIN_RANGE, BITSTREAM_PADDING, 2, collect_row, &rows, &info, NULL) < 0;
+    printf("Speculative decode: %llu compressed bytes on %d threads %.0f MB/s, serial %.0f MB/s, matches: %s\n",
+      (unsigned long long)png.idat_length, threads, size / 1e6 / speculative_seconds, size / 1e6 / serial_seconds, matches ? "True" : "False");
+    free_test_png(&png);
+  }
+  else {
+    printf("Speculative decode: encoding failed\n");
+  }
+  free(speculative);
+  free(pixels);
+}
+
+// A batch of images of every format decoded on the pool gives the same
+// pixels as decoding them one by one. A truncated file fails on its own, and
+// a caller supplied buffer is filled in place.
+static void test_batch(void) {
+  enum { JOBS = 2 * TEST_FORMATS + 1 };
+  PngJob jobs[JOBS];
+  TestPng pngs[JOBS];
+  uint8_t chunks[1100];
+  memset(jobs, 0, sizeof(jobs));
+  memset(pngs, 0, sizeof(pngs));
+  int matches = 1;
+  for (size_t i = 0; i < JOBS; i++) {
+    const uint8_t* format = test_formats[i % TEST_FORMATS];
+    png_IHDR ihdr = { (uint32_t)(40 + i * 37), (uint32_t)(300 - i * 7), format[1], format[0], 0, 0, (uint8_t)(i / TEST_FORMATS == 1) };
+    uint8_t* pixels = make_test_image(&ihdr, (uint32_t)i);
+    size_t chunks_length = make_palette_chunks(&ihdr, chunks);
+    matches &= pixels && make_test_png(&pngs[i], &ihdr, pixels, -1, chunks, chunks_length, 4096, DEFLATE_FASTEST) == 0;
+    free(pixels);
+    jobs[i].data = pngs[i].file;
+    jobs[i].length = i == JOBS - 1 ? pngs[i].length / 2 : pngs[i].length;
+    jobs[i].size_hint = jobs[i].length;
+    jobs[i].image.format = i % 2 ? PNG_FORMAT_RGBA8 : PNG_FORMAT_RAW;
+  }
+  uint8_t* buffer = (uint8_t*)malloc(1 << 20);
+  jobs[1].image.pixels = buffer;
+  jobs[1].image.capacity = buffer ? 1 << 20 : 0;
+
+  double start = wall_seconds();
+  size_t failed = matches ? png_decode_batch(jobs, JOBS, 4) : 0;
+  double batch_seconds = seconds_since(start);
+  matches &= failed == 1 && jobs[JOBS - 1].result < 0 && jobs[1].image.pixels == buffer && !jobs[1].image.allocated;
+
+  PngContext context;
+  init_png_context(&context, NULL);
+  start = wall_seconds();
+  for (size_t i = 0; i < JOBS - 1 && matches; i++) {
+    PngImage image;
+    matches = jobs[i].result == 0 && decode_test_png(&context, &pngs[i], &image, jobs[i].image.format, 0, NULL) == 0 &&
+      image.height == jobs[i].image.height && image_matches(&image, jobs[i].image.pixels, jobs[i].image.row_bytes);
+    if (matches) free_png_image(&image);
+  }
+  double serial_seconds = seconds_since(start);
+  free_png_context(&context);
+  printf("Batch decode: %d images on 4 threads %.1f ms, one by one %.1f ms, matches: %s\n",
+    JOBS, batch_seconds * 1e3, serial_seconds * 1e3, matches ? "True" : "False");
+
+  for (size_t i = 0; i < JOBS; i++) {
+    free_png_image(&jobs[i].image);
+    free_test_png(&pngs[i]);
+  }
+  free(buffer);
+}
+
+// A context reused for the same image, or a smaller one, takes all its
+// scratch memory from the arena kept from the decodes before
+static void test_context_reuse(void) {
+  CountingAllocator counts = { 0, 0 };
+  PngAllocator allocator = counting_allocator(&counts);
+  PngContext context;
+  init_png_context(&context, &allocator);
+  png_IHDR ihdr = { 300, 200, 8, 2, 0, 0, 1 };
+  uint8_t* pixels = make_test_image(&ihdr, 9);
+  TestPng png;
+  int matches = pixels && make_test_png(&png, &ihdr, pixels, -1, NULL, 0, 8192, DEFLATE_FASTEST) == 0;
+  size_t allocations[4] = { 0 };
+  for (int i = 0; i < 4 && matches; i++) {
+    PngImage image;
+    matches = decode_test_png(&context, &png, &image, i % 2 ? PNG_FORMAT_RGBA8 : PNG_FORMAT_RAW, 0, NULL) == 0;
+    if (matches && i == 0) matches = image_matches(&image, pixels, png_row_bytes(&ihdr, ihdr.width));
+    if (matches) free_png_image(&image);
+    allocations[i] = counts.allocations;
+  }
+  matches = matches && allocations[3] == allocations[1];
+  printf("Context reuse: %llu arena allocations for the first decode, %llu for the next three, matches: %s\n",
+    (unsigned long long)allocations[0], (unsigned long long)(allocations[3] - allocations[0]), matches ? "True" : "False");
+  if (pixels) free_test_png(&png);
+  free_png_context(&context);
+  free(pixels);
+}
+
+// Mapped files, memory and streams, which are read chunk by chunk, give
+// the same pixels. Streams are decoded from a temporary file.
+static void test_inputs(void) {
+  static const char* filename = "jorpng_input_test.png";
+  png_IHDR ihdr = { 777, 333, 16, 6, 0, 0, 0 };
+  uint8_t* pixels = make_test_image(&ihdr, 21);
+  TestPng png;
+  int matches = pixels && make_test_png(&png, &ihdr, pixels, -1, NULL, 0, 3000, DEFLATE_FASTEST) == 0;
+  if (!matches) {
+    printf("Inputs: encoding failed\n");
+    free(pixels);
+    return;
+  }
+  FILE* file = fopen(filename, "wb");
+  FILE* stream = tmpfile();
+  matches = file && stream && fwrite(png.file, 1, png.length, file) == png.length && fwrite(png.file, 1, png.length, stream) == png.length;
+  if (file) fclose(file);
+
+  PngContext context;
+  init_png_context(&context, NULL);
+  size_t row_bytes = png_row_bytes(&ihdr, ihdr.width);
+  for (int input = 0; input < 3 && matches; input++) {
+    PngImage image;
+    memset(&image, 0, sizeof(image));
+    int result;
+    if (input == 0) {
+      result = png_decode_file(&context, filename, &image);
+    }
+    else if (input == 1) {
+      result = png_decode_memory(&context, png.file, png.length, &image);
+    }
+    else {
+      rewind(stream);
+      result = png_decode_stream(&context, stream, &image);
+    }
+    matches = result == 0 && image_matches(&image, pixels, row_bytes);
+    free_png_image(&image);
+  }
+  // A missing file and a stream cut short fail
+  PngImage image;
+  memset(&image, 0, sizeof(image));
+  matches = matches && png_decode_file(&context, "jorpng_missing_test.png", &image) < 0;
+  if (matches) {
+    FILE* short_stream = tmpfile();
+    matches = short_stream && fwrite(png.file, 1, png.length - 20, short_stream) == png.length - 20;
+    if (short_stream) {
+      rewind(short_stream);
+      matches = matches && png_decode_stream(&context, short_stream, &image) < 0;
+      fclose(short_stream);
+    }
+    free_png_image(&image);
+  }
+  printf("Inputs: file, memory and stream, matches: %s\n", matches ? "True" : "False");
+
+  if (stream) fclose(stream);
+  remove(filename);
+  free_png_context(&context);
+  free_test_png(&png);
+  free(pixels);
+}
+
+// Probing reads the header, and the metadata chunks before the IDAT chunks
+// when asked, without needing the image data
+static void test_probe(void) {
+  png_IHDR ihdr = { 640, 480, 4, 3, 0, 0, 1 };
+  uint8_t* pixels = make_test_image(&ihdr, 4);
+  uint8_t chunks[1300];
+  size_t chunks_length = make_palette_chunks(&ihdr, chunks);
+  uint8_t data[32];
+  put_be32(data, 45455);
+  chunks_length += put_chunk(chunks + chunks_length, gAMA, data, 4);
+  put_be32(data, 2835);
+  put_be32(data + 4, 3780);
+  data[8] = 1;
+  chunks_length += put_chunk(chunks + chunks_length, pHYs, data, 9);
+  data[0] = 2;
+  chunks_length += put_chunk(chunks + chunks_length, sRGB, data, 1);
+  for (int i = 0; i < 8; i++) {
+    put_be32(data + i * 4, 10000 * (i + 1));
+  }
+  chunks_length += put_chunk(chunks + chunks_length, cHRM, data, 32);
+  TestPng png;
+  int matches = pixels && make_test_png(&png, &ihdr, pixels, -1, chunks, chunks_length, 1 << 16, DEFLATE_FASTEST) == 0;
+  free(pixels);
+  if (!matches) {
+    printf("Probe: encoding failed\n");
+    return;
+  }
+
+  PngInfo info;
+  matches = png_probe_memory(png.file, png.length, &info, 0) == 0 &&
+    info.ihdr.width == 640 && info.ihdr.height == 480 && info.ihdr.bit_depth == 4 && info.ihdr.color_type == 3 &&
+    info.ihdr.interlace_method == 1 && !info.has_gAMA && !info.has_pHYs;
+  // The signature and IHDR are enough for the header alone
+  matches = matches && png_probe_memory(png.file, 33, &info, 0) == 0 && info.ihdr.width == 640;
+  matches = matches && png_probe_memory(png.file, png.length, &info, PNG_PROBE_METADATA) == 0 &&
+    info.has_gAMA && info.gama.gamma == 45455 &&
+    info.has_pHYs && info.phys.ppuX == 2835 && info.phys.ppuY == 3780 && info.phys.unit == 1 &&
+    info.has_sRGB && info.srgb.rendering_intent == 2 &&
+    info.has_cHRM && info.chrm.white_pointX == 10000 && info.chrm.blueY == 80000;
+
+  // A bad signature or header CRC fails
+  png.file[1] ^= 1;
+  matches = matches && png_probe_memory(png.file, png.length, &info, 0) < 0;
+  png.file[1] ^= 1;
+  png.file[30] ^= 1;
+  matches = matches && png_probe_memory(png.file, png.length, &info, 0) < 0;
+  png.file[30] ^= 1;
+
+  double start = wall_seconds();
+  for (int i = 0; i < 10000; i++) {
+    png_probe_memory(png.file, png.length, &info, PNG_PROBE_METADATA);
+  }
+  double seconds = seconds_since(start);
+  printf("Probe: %.2f us per file with metadata, matches: %s\n", seconds * 1e6 / 10000, matches ? "True" : "False");
+  free_test_png(&png);
+}
+
+// The three stage pipeline gives the same pixels as the serial decode, for
+// plain and interlaced images, streams, whose chunks it copies, and crops
+// that stop it early
+static void test_pipeline(void) {
+  static const png_IHDR headers[3] = { { 1200, 900, 8, 6, 0, 0, 0 }, { 513, 257, 16, 2, 0, 0, 1 }, { 64, 3, 1, 0, 0, 0, 0 } };
+  static const PngRegion crop = { 5, 10, 40, 50 };
+  PngContext serial, pipelined;
+  init_png_context(&serial, NULL);
+  init_png_context(&pipelined, NULL);
+  pipelined.pipelined = 1;
+  int matches = 1;
+  double serial_seconds = 0, pipelined_seconds = 0;
+  for (int i = 0; i < 3 && matches; i++) {
+    uint8_t* pixels = make_test_image(&headers[i], (uint32_t)i);
+    TestPng png;
+    matches = pixels && make_test_png(&png, &headers[i], pixels, -1, NULL, 0, 8192, DEFLATE_FASTEST) == 0;
+    free(pixels);
+    FILE* stream = matches ? tmpfile() : NULL;
+    matches = stream && fwrite(png.file, 1, png.length, stream) == png.length;
+    for (int cropped = 0; cropped < 2 && matches; cropped++) {
+      const PngRegion* region = cropped && i < 2 ? &crop : NULL;
+      PngImage expected, image;
+      double start = wall_seconds();
+      matches = decode_test_png(&serial, &png, &expected, PNG_FORMAT_RGBA8, 0, region) == 0;
+      if (i == 0 && !cropped) serial_seconds = seconds_since(start);
+      if (!matches) break;
+      start = wall_seconds();
+      matches = decode_test_png(&pipelined, &png, &image, PNG_FORMAT_RGBA8, 0, region) == 0 &&
+        image.height == expected.height && image_matches(&image, expected.pixels, expected.row_bytes);
+      if (i == 0 && !cropped) pipelined_seconds = seconds_since(start);
+      free_png_image(&image);
+      if (matches) {
+        memset(&image, 0, sizeof(image));
+        image.format = PNG_FORMAT_RGBA8;
+        if (region) image.crop = *region;
+        rewind(stream);
+        matches = png_decode_stream(&pipelined, stream, &image) == 0 && image_matches(&image, expected.pixels, expected.row_bytes);
+        free_png_image(&image);
+      }
+      free_png_image(&expected);
+    }
+    if (stream) fclose(stream);
+    free_test_png(&png);
+  }
+  size_t size = (size_t)headers[0].width * headers[0].height * 4;
+  printf("Pipelined decode: %.0f MB/s, serial %.0f MB/s, matches: %s\n",
+    size / 1e6 / pipelined_seconds, size / 1e6 / serial_seconds, matches ? "True" : "False");
+  free_png_context(&serial);
+  free_png_context(&pipelined);
+}
+
+// Reduced image of a full size RGBA decode: box averages rounded to nearest,
+// over the pixels a box has at the edges, or for interlaced images the pixel
+// at the top left of each box
+static void reference_scale(const PngImage* full, int scale, int interlaced, uint8_t* out) {
+  uint32_t width = png_scaled_size(full->width, scale);
+  uint32_t height = png_scaled_size(full->height, scale);
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      for (int c = 0; c < 4; c++) {
+        uint32_t sum = 0, count = 0;
+        for (uint32_t sy = y * scale; sy < (y + 1) * scale && sy < full->height; sy++) {
+          for (uint32_t sx = x * scale; sx < (x + 1) * scale && sx < full->width; sx++) {
+            if (!interlaced || (sx == x * scale && sy == y * scale)) {
+              sum += full->pixels[sy * full->row_bytes + 4 * sx + c];
+              count++;
+            }
+          }
+        }
+        out[((size_t)y * width + x) * 4 + c] = (uint8_t)((sum + count / 2) / count);
+      }
+    }
+  }
+}
+
+// Decodes at 1/2, 1/4 and 1/8 size match the reference reduction of the full
+// decode, for several color types, edge boxes and interlaced images
+static void test_scale(void) {
+  static const uint8_t formats[][2] = { { 6, 8 }, { 2, 16 }, { 0, 1 }, { 3, 4 }, { 4, 8 } };
+  static const uint32_t sizes[][2] = { { 203, 157 }, { 7, 5 }, { 64, 64 } };
+  uint8_t chunks[1100];
+  PngContext context;
+  init_png_context(&context, NULL);
+  int matches = 1;
+  int images = 0;
+  for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]) && matches; f++) {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && matches; i++) {
+      for (uint8_t interlaced = 0; interlaced < 2 && matches; interlaced++) {
+        png_IHDR ihdr = { sizes[i][0], sizes[i][1], formats[f][1], formats[f][0], 0, 0, interlaced };
+        uint8_t* pixels = make_test_image(&ihdr, (uint32_t)(f * 8 + i));
+        size_t chunks_length = make_palette_chunks(&ihdr, chunks);
+        TestPng png;
+        matches = pixels && make_test_png(&png, &ihdr, pixels, -1, chunks, chunks_length, 1000, DEFLATE_FASTEST) == 0;
+        free(pixels);
+        if (!matches) break;
+        PngImage full;
+        PngPixelFormat format = f % 2 ? PNG_FORMAT_BGRA8 : PNG_FORMAT_RGBA8;
+        matches = decode_test_png(&context, &png, &full, format, 0, NULL) == 0;
+        uint8_t* expected = (uint8_t*)malloc(png_scaled_size(ihdr.width, 2) * png_scaled_size(ihdr.height, 2) * 4);
+        matches = matches && expected;
+        for (int scale = 2; scale <= 8 && matches; scale *= 2) {
+          PngImage image;
+          reference_scale(&full, scale, interlaced, expected);
+          matches = decode_test_png(&context, &png, &image, format, scale, NULL) == 0 &&
+            image.width == png_scaled_size(ihdr.width, scale) && image.height == png_scaled_size(ihdr.height, scale) &&
+            image_matches(&image, expected, (size_t)image.width * 4);
+          if (!matches) {
+            printf("Scale 1/%d of %ux%u, color type %u, bit depth %u%s differs\n", scale, ihdr.width, ihdr.height,
+              ihdr.color_type, ihdr.bit_depth, interlaced ? ", interlaced" : "");
+          }
+          free_png_image(&image);
+          images++;
+        }
+        free(expected);
+        free_png_image(&full);
+        free_test_png(&png);
+      }
+    }
+  }
+  // Raw pixels cannot be scaled, and only halving steps are supported
+  png_IHDR ihdr = { 16, 16, 8, 6, 0, 0, 0 };
+  uint8_t* pixels = make_test_image(&ihdr, 1);
+  TestPng png;
+  if (pixels && make_test_png(&png, &ihdr, pixels, -1, NULL, 0, 1000, DEFLATE_FASTEST) == 0) {
+    PngImage image;
+    matches &= decode_test_png(&context, &png, &image, PNG_FORMAT_RAW, 2, NULL) != 0;
+    free_png_image(&image);
+    matches &= decode_test_png(&context, &png, &image, PNG_FORMAT_RGBA8, 3, NULL) != 0;
+    free_png_image(&image);
+    free_test_png(&png);
+  } else {
+    matches = 0;
+  }
+  free(pixels);
+  free_png_context(&context);
+  printf("Scaled decode: %d images at 1/2, 1/4 and 1/8, matches: %s\n", images, matches ? "True" : "False");
+}
+
+// Region of an image of bits per pixel, rows padded to whole bytes with the
+// unused bits cleared
+static uint8_t* reference_crop(const uint8_t* pixels, size_t row_bytes, const PngRegion* crop, size_t bits) {
+  size_t crop_row_bytes = ((size_t)crop->width * bits + 7) / 8;
+  uint8_t* out = (uint8_t*)calloc(crop_row_bytes * crop->height, 1);
+  if (!out) return NULL;
+  for (uint32_t y = 0; y < crop->height; y++) {
+    for (uint32_t x = 0; x < crop->width; x++) {
+      copy_pixel(pixels + (crop->y + y) * row_bytes, crop->x + x, out + y * crop_row_bytes, x, bits);
+    }
+  }
+  return out;
+}
+
+// Decodes of a region match that part of the full decode, raw and RGBA, for
+// every format, sub-byte offsets and interlaced images. A crop above the
+// bottom stops early and leaves the checksums unchecked.
+static void test_crop(void) {
+  const uint32_t width = 45, height = 33;
+  const PngRegion crops[] = { { 0, 0, 45, 33 }, { 3, 5, 17, 9 }, { 1, 0, 1, 1 }, { 38, 29, 7, 4 }, { 0, 32, 45, 1 }, { 5, 2, 3, 30 } };
+  const size_t count = sizeof(crops) / sizeof(crops[0]);
+  uint8_t chunks[1100];
+  PngContext context;
+  init_png_context(&context, NULL);
+  int matches = 1;
+  int images = 0;
+  for (int f = 0; f < TEST_FORMATS && matches; f++) {
+    for (uint8_t interlaced = 0; interlaced < 2 && matches; interlaced++) {
+      png_IHDR ihdr = { width, height, test_formats[f][1], test_formats[f][0], 0, 0, interlaced };
+      size_t bits = ihdr.bit_depth < 8 ? ihdr.bit_depth : png_bytes_per_pixel(&ihdr) * 8;
+      uint8_t* pixels = make_test_image(&ihdr, (uint32_t)f);
+      size_t chunks_length = make_palette_chunks(&ihdr, chunks);
+      TestPng png;
+      PngImage full;
+      matches = pixels && make_test_png(&png, &ihdr, pixels, -1, chunks, chunks_length, 500, DEFLATE_FASTEST) == 0;
+      if (!matches) {
+        free(pixels);
+        break;
+      }
+      matches = decode_test_png(&context, &png, &full, PNG_FORMAT_RGBA8, 0, NULL) == 0;
+      for (size_t c = 0; c < count && matches; c++) {
+        for (int raw = 0; raw < 2 && matches; raw++) {
+          uint8_t* expected = raw ? reference_crop(pixels, png_row_bytes(&ihdr, width), &crops[c], bits)
+            : reference_crop(full.pixels, full.row_bytes, &crops[c], 32);
+          PngImage image;
+          matches = expected && decode_test_png(&context, &png, &image, raw ? PNG_FORMAT_RAW : PNG_FORMAT_RGBA8, 0, &crops[c]) == 0 &&
+            image.width == crops[c].width && image.height == crops[c].height &&
+            image_matches(&image, expected, raw ? ((size_t)crops[c].width * bits + 7) / 8 : (size_t)crops[c].width * 4) &&
+            image.checked == (crops[c].y + crops[c].height == height);
+          if (!matches) {
+            printf("Crop %ux%u at %u,%u of color type %u, bit depth %u%s%s differs\n", crops[c].width, crops[c].height,
+              crops[c].x, crops[c].y, ihdr.color_type, ihdr.bit_depth, interlaced ? ", interlaced" : "", raw ? ", raw" : "");
+          }
+          free(expected);
+          free_png_image(&image);
+          images++;
+        }
+      }
+      free_png_image(&full);
+      free_test_png(&png);
+      free(pixels);
+    }
+  }
+
+  // Regions reaching outside the image, empty ones and crops of scaled images fail
+  const PngRegion invalid[] = { { 45, 0, 1, 1 }, { 40, 0, 6, 1 }, { 0, 33, 1, 1 }, { 0, 30, 1, 4 }, { 0, 0, 1, 0 } };
+  png_IHDR ihdr = { width, height, 8, 6, 0, 0, 0 };
+  uint8_t* pixels = make_test_image(&ihdr, 1);
+  TestPng png;
+  if (pixels && make_test_png(&png, &ihdr, pixels, -1, NULL, 0, 1000, DEFLATE_FASTEST) == 0) {
+    PngImage image;
+    for (size_t c = 0; c < sizeof(invalid) / sizeof(invalid[0]); c++) {
+      matches &= decode_test_png(&context, &png, &image, PNG_FORMAT_RGBA8, 0, &invalid[c]) != 0;
+      free_png_image(&image);
+    }
+    matches &= decode_test_png(&context, &png, &image, PNG_FORMAT_RGBA8, 2, &crops[1]) != 0;
+    free_png_image(&image);
+    free_test_png(&png);
+  } else {
+    matches = 0;
+  }
+  free(pixels);
+  free_png_context(&context);
+  printf("Cropped decode: %d regions, matches: %s\n", images, matches ? "True" : "False");
+}
+
+void test_decode() {
+  test_ring_window();
+  test_adam7();
+  test_restart_points();
+  test_speculative();
+  test_batch();
+  test_context_reuse();
+  test_inputs();
+  test_probe();
+  test_pipeline();
+  test_scale();
+  test_crop();
+}
@@ -0,0 +1,677 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deflate.h"
+#include "huffman.h"
+#include "adler.h"
+#include "thread.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define WINDOW_MASK (DEFLATE_WINDOW_SIZE - 1)
+#define FAR_MATCH 4096         // A 3 byte match further back costs about as much as its literals
+#define MAX_STORED 65535       // Longest stored block
+#define CODE_LENGTH_CODES 19
+#define MAX_CODE_LENGTH_BITS 7
+
+// Match search of a level, with the settings of the zlib levels
+typedef struct deflate_level_struct {
+  uint32_t lazy;  // Levels 1-3: longest match whose positions are all hashed. Levels 4-9: no lazy search past a match this long.
+  uint32_t good;  // Search a quarter of the chain once the match is this long
+  uint32_t nice;  // Stop searching at a match this long
+  uint32_t chain; // Most chain positions compared
+} DeflateLevel;
+
+#define LAZY_LEVEL 4
+
+static const DeflateLevel levels[10] = {
+  { 0, 0, 0, 0 },
+  { 4, 4, 8, 4 },
+  { 5, 4, 16, 8 },
+  { 6, 4, 32, 32 },
+  { 4, 4, 16, 16 },
+  { 16, 8, 32, 32 },
+  { 16, 8, 128, 128 },
+  { 32, 8, 128, 256 },
+  { 128, 32, 258, 1024 },
+  { 258, 32, 258, 4096 },
+};
+
+// Canonical Huffman code of an alphabet
+typedef struct huffman_encoder_struct {
+  uint16_t codes[288]; // Bit reversed, to be written LSB first
+  uint8_t lengths[288];
+} HuffmanEncoder;
+
+// Item of the package-merge: a symbol, or a package of two items of the level below
+typedef struct merge_node_struct {
+  uint32_t weight;
+  int16_t symbol; // -1 for packages
+  uint16_t left;
+  uint16_t right;
+} MergeNode;
+
+// Symbols plus at most one package per pair of items on each level
+#define MERGE_NODES (288 * (MAX_BITS + 1))
+
+// Symbol tables, built once and then shared read-only by all deflaters
+static uint8_t length_codes[MAX_MATCH - MIN_MATCH + 1]; // Length symbol - 257 by match length - 3
+static uint8_t distance_codes[512];                     // Distance symbol by distance - 1 up to 256, then by (distance - 1) >> 7
+static HuffmanEncoder fixed_literal_length_code;
+static HuffmanEncoder fixed_distance_code;
+static OnceFlag tables_once = ONCE_INIT;
+
+// Assign canonical codes to the code lengths (RFC 1951 3.2.2)
+static void assign_codes(HuffmanEncoder* encoder, int num_symbols) {
+  int counts[MAX_BITS + 1] = { 0 };
+  uint32_t next_code[MAX_BITS + 1];
+  for (int i = 0; i < num_symbols; i++) {
+    counts[encoder->lengths[i]]++;
+  }
+  counts[0] = 0;
+  uint32_t code = 0;
+  for (int bits = 1; bits <= MAX_BITS; bits++) {
+    code = (code + counts[bits - 1]) << 1;
+    next_code[bits] = code;
+  }
+  for (int i = 0; i < num_symbols; i++) {
+    int length = encoder->lengths[i];
+    encoder->codes[i] = length ? (uint16_t)reverse_bits(next_code[length]++, length) : 0;
+  }
+}
+
+static void build_tables(void) {
+  for (int code = 0; code < 29; code++) {
+    for (int length = length_base[code]; length < length_base[code] + (1 << length_extra_bits[code]) && length <= MAX_MATCH; length++) {
+      length_codes[length - MIN_MATCH] = (uint8_t)code;
+    }
+  }
+  for (int code = 0; code < 30; code++) {
+    for (int distance = distance_base[code]; distance < distance_base[code] + (1 << distance_extra_bits[code]); distance++) {
+      distance_codes[distance <= 256 ? distance - 1 : 256 + ((distance - 1) >> 7)] = (uint8_t)code;
+    }
+  }
+
+  // Fixed code lengths (RFC 1951 3.2.6)
+  for (int i = 0; i < 288; i++) {
+    fixed_literal_length_code.lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  }
+  for (int i = 0; i < 30; i++) {
+    fixed_distance_code.lengths[i] = 5;
+  }
+  assign_codes(&fixed_literal_length_code, 288);
+  assign_codes(&fixed_distance_code, 30);
+}
+
+static inline int distance_code(uint32_t distance) {
+  return distance <= 256 ? distance_codes[distance - 1] : distance_codes[256 + ((distance - 1) >> 7)];
+}
+
+static inline int trailing_zeros(uint64_t x) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  if ((uint32_t)x) {
+    _BitScanForward(&index, (uint32_t)x);
+    return (int)index;
+  }
+  _BitScanForward(&index, (uint32_t)(x >> 32));
+  return (int)index + 32;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
+
+// Number of equal leading bytes, up to max, compared a word at a time
+static inline uint32_t count_matching(const uint8_t* a, const uint8_t* b, uint32_t max) {
+  uint32_t n = 0;
+  for (; n + 8 <= max; n += 8) {
+    uint64_t x, y;
+    memcpy(&x, a + n, sizeof(x));
+    memcpy(&y, b + n, sizeof(y));
+    if (x != y) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      x = __builtin_bswap64(x);
+      y = __builtin_bswap64(y);
+#endif
+      return n + trailing_zeros(x ^ y) / 8;
+    }
+  }
+  while (n < max && a[n] == b[n]) {
+    n++;
+  }
+  return n;
+}
+
+// Hash of the 3 bytes a match starts with
+static inline uint32_t hash_at(const uint8_t* bytes) {
+  uint32_t value = bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16;
+  return (value * 0x9E3779B1u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Add position to its hash chain and return the previous position with the
+// same hash. At least MIN_MATCH bytes must follow position.
+static inline uint32_t insert_position(Deflater* deflater, const uint8_t* data, uint32_t position) {
+  uint32_t hash = hash_at(data + position);
+  uint32_t previous = deflater->head[hash];
+  deflater->head[hash] = position;
+  deflater->prev[position & WINDOW_MASK] = previous;
+  return previous;
+}
+
+// Follow the hash chain from candidate for a match longer than best, with
+// available bytes from position on. Returns the longest length found and
+// sets match to its position. Only distances below the window size are
+// taken, so the chain never reaches slots already reused by newer positions.
+static uint32_t longest_match(const Deflater* deflater, const DeflateLevel* level, const uint8_t* data, uint32_t position, uint32_t candidate, uint32_t available, uint32_t best, uint32_t* match) {
+  uint32_t max = available < MAX_MATCH ? available : MAX_MATCH;
+  uint32_t nice = level->nice < max ? level->nice : max;
+  uint32_t chain = best >= level->good ? level->chain >> 2 : level->chain;
+  const uint8_t* current = data + position;
+  if (best >= max) {
+    return best;
+  }
+  while (candidate != DEFLATE_NO_POSITION && position - candidate < DEFLATE_WINDOW_SIZE) {
+    const uint8_t* earlier = data + candidate;
+    // The byte that would make the match longer than the best rules out most candidates
+    if (earlier[best] == current[best] && earlier[0] == current[0]) {
+      uint32_t length = count_matching(earlier, current, max);
+      if (length > best) {
+        best = length;
+        *match = candidate;
+        if (length >= nice) {
+          break;
+        }
+      }
+    }
+    if (--chain == 0) {
+      break;
+    }
+    candidate = deflater->prev[candidate & WINDOW_MASK];
+  }
+  return best;
+}
+
+static inline void record_literal(Deflater* deflater, uint8_t literal) {
+  deflater->literals[deflater->symbols] = literal;
+  deflater->distances[deflater->symbols] = 0;
+  deflater->symbols++;
+  deflater->literal_length_counts[literal]++;
+}
+
+static inline void record_match(Deflater* deflater, uint32_t length, uint32_t distance) {
+  deflater->literals[deflater->symbols] = (uint16_t)length;
+  deflater->distances[deflater->symbols] = (uint16_t)distance;
+  deflater->symbols++;
+  deflater->literal_length_counts[257 + length_codes[length - MIN_MATCH]]++;
+  deflater->distance_counts[distance_code(distance)]++;
+}
+
+// Code lengths of at most max_bits that minimize the coded size, with the
+// package-merge algorithm. Every level pairs the items of the level below
+// into packages and merges them with the symbols by weight. The 2n - 2
+// lightest items of the last level contain each symbol once per bit of its code.
+static void limit_code_lengths(MergeNode* nodes, const uint32_t* counts, int num_symbols, int max_bits, uint8_t* lengths) {
+  uint16_t lists[2][2 * 288];
+  int n = 0;
+  memset(lengths, 0, num_symbols);
+
+  // Symbols in use, lightest first
+  for (int symbol = 0; symbol < num_symbols; symbol++) {
+    if (!counts[symbol]) {
+      continue;
+    }
+    int i = n++;
+    for (; i > 0 && nodes[i - 1].weight > counts[symbol]; i--) {
+      nodes[i] = nodes[i - 1];
+    }
+    nodes[i].weight = counts[symbol];
+    nodes[i].symbol = (int16_t)symbol;
+  }
+  if (n < 2) {
+    if (n == 1) {
+      lengths[nodes[0].symbol] = 1;
+    }
+    return;
+  }
+
+  uint16_t* list = lists[0];
+  int size = n;
+  for (int i = 0; i < n; i++) {
+    list[i] = (uint16_t)i;
+  }
+  int used = n;
+  for (int level = 1; level < max_bits; level++) {
+    uint16_t* next = lists[level & 1];
+    int packages = size / 2;
+    int leaf = 0;
+    int package = 0;
+    int count = 0;
+    while (leaf < n || package < packages) {
+      uint32_t weight = 0;
+      if (package < packages) {
+        weight = nodes[list[2 * package]].weight + nodes[list[2 * package + 1]].weight;
+      }
+      if (package == packages || (leaf < n && nodes[leaf].weight <= weight)) {
+        next[count++] = (uint16_t)leaf++;
+        continue;
+      }
+      MergeNode* node = &nodes[used];
+      node->weight = weight;
+      node->symbol = -1;
+      node->left = list[2 * package];
+      node->right = list[2 * package + 1];
+      next[count++] = (uint16_t)used++;
+      package++;
+    }
+    list = next;
+    size = count;
+  }
+
+  uint16_t stack[MERGE_NODES];
+  int top = 0;
+  for (int i = 0; i < 2 * n - 2; i++) {
+    stack[top++] = list[i];
+  }
+  while (top > 0) {
+    const MergeNode* node = &nodes[stack[--top]];
+    if (node->symbol >= 0) {
+      lengths[node->symbol]++;
+    }
+    else {
+      stack[top++] = node->left;
+      stack[top++] = node->right;
+    }
+  }
+}
+
+// The decoder takes complete codes only, which need two symbols at least
+static void use_two_symbols(uint32_t* counts, int num_symbols) {
+  int used = 0;
+  for (int symbol = 0; used < 2 && symbol < num_symbols; symbol++) {
+    used += counts[symbol] != 0;
+  }
+  for (int symbol = 0; used < 2; symbol++) {
+    if (!counts[symbol]) {
+      counts[symbol] = 1;
+      used++;
+    }
+  }
+}
+
+// Code lengths of a dynamic block header, run length coded with the symbols
+// 16 (repeat the previous length), 17 and 18 (runs of zeros)
+typedef struct block_header_struct {
+  int literal_lengths; // HLIT + 257
+  int distances;       // HDIST + 1
+  int code_lengths;    // HCLEN + 4
+  int count;
+  uint8_t symbols[DEFLATE_LITERAL_LENGTHS + DEFLATE_DISTANCES];
+  uint8_t extra[DEFLATE_LITERAL_LENGTHS + DEFLATE_DISTANCES];
+  uint32_t counts[CODE_LENGTH_CODES];
+  HuffmanEncoder code;
+} BlockHeader;
+
+static const int code_length_extra_bits[CODE_LENGTH_CODES] = { 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,3,7 };
+
+static inline void add_code_length(BlockHeader* header, int symbol, int extra) {
+  header->symbols[header->count] = (uint8_t)symbol;
+  header->extra[header->count] = (uint8_t)extra;
+  header->count++;
+  header->counts[symbol]++;
+}
+
+static void encode_code_lengths(BlockHeader* header, const HuffmanEncoder* literal_length, const HuffmanEncoder* distance) {
+  header->literal_lengths = DEFLATE_LITERAL_LENGTHS;
+  while (header->literal_lengths > 257 && !literal_length->lengths[header->literal_lengths - 1]) {
+    header->literal_lengths--;
+  }
+  header->distances = DEFLATE_DISTANCES;
+  while (header->distances > 1 && !distance->lengths[header->distances - 1]) {
+    header->distances--;
+  }
+
+  // Runs may cross from the literal/length into the distance code lengths
+  uint8_t lengths[DEFLATE_LITERAL_LENGTHS + DEFLATE_DISTANCES];
+  int total = header->literal_lengths + header->distances;
+  memcpy(lengths, literal_length->lengths, header->literal_lengths);
+  memcpy(lengths + header->literal_lengths, distance->lengths, header->distances);
+
+  header->count = 0;
+  memset(header->counts, 0, sizeof(header->counts));
+  for (int i = 0; i < total;) {
+    int length = lengths[i];
+    int run = 1;
+    while (i + run < total && lengths[i + run] == length) {
+      run++;
+    }
+    i += run;
+    if (length == 0) {
+      for (; run >= 11; run -= run < 138 ? run : 138) {
+        add_code_length(header, 18, (run < 138 ? run : 138) - 11);
+      }
+      if (run >= 3) {
+        add_code_length(header, 17, run - 3);
+        run = 0;
+      }
+    }
+    else {
+      add_code_length(header, length, 0);
+      run--;
+      for (; run >= 3; run -= run < 6 ? run : 6) {
+        add_code_length(header, 16, (run < 6 ? run : 6) - 3);
+      }
+    }
+    for (; run > 0; run--) {
+      add_code_length(header, length, 0);
+    }
+  }
+}
+
+// Bits of the block data under the codes, without the extra bits
+static uint64_t coded_size(const uint32_t* counts, const uint8_t* lengths, int num_symbols) {
+  uint64_t bits = 0;
+  for (int i = 0; i < num_symbols; i++) {
+    bits += (uint64_t)counts[i] * lengths[i];
+  }
+  return bits;
+}
+
+static void write_symbols(const Deflater* deflater, BitWriter* writer, const HuffmanEncoder* literal_length, const HuffmanEncoder* distance) {
+  for (size_t i = 0; i < deflater->symbols; i++) {
+    uint32_t value = deflater->literals[i];
+    uint32_t match_distance = deflater->distances[i];
+    if (!match_distance) {
+      write_bits_lsb(literal_length->codes[value], literal_length->lengths[value], writer);
+      continue;
+    }
+    // Each code is written together with its extra bits
+    int code = length_codes[value - MIN_MATCH];
+    int bits = literal_length->lengths[257 + code];
+    write_bits_lsb(literal_length->codes[257 + code] | (value - length_base[code]) << bits, bits + length_extra_bits[code], writer);
+    code = distance_code(match_distance);
+    bits = distance->lengths[code];
+    write_bits_lsb(distance->codes[code] | (match_distance - distance_base[code]) << bits, bits + distance_extra_bits[code], writer);
+  }
+  write_bits_lsb(literal_length->codes[256], literal_length->lengths[256], writer);
+}
+
+static void write_stored_blocks(BitWriter* writer, const uint8_t* data, size_t length, int final) {
+  do {
+    uint32_t count = length < MAX_STORED ? (uint32_t)length : MAX_STORED;
+    write_bits_lsb(final && count == length, 3, writer);
+    align_bit_writer(writer);
+    write_bits_lsb(count | (~count & 0xFFFF) << 16, 32, writer);
+    write_aligned_bytes(data, count, writer);
+    data += count;
+    length -= count;
+  } while (length > 0);
+}
+
+// Write the symbols recorded for the length raw bytes at data as one block,
+// in whichever form is shortest, and start the next block
+static void flush_block(Deflater* deflater, BitWriter* writer, const uint8_t* data, size_t length, int final) {
+  uint32_t* counts = deflater->literal_length_counts;
+  uint32_t* distance_counts = deflater->distance_counts;
+  counts[256] = 1;
+  use_two_symbols(counts, DEFLATE_LITERAL_LENGTHS);
+  use_two_symbols(distance_counts, DEFLATE_DISTANCES);
+
+  HuffmanEncoder literal_length;
+  HuffmanEncoder distance;
+  BlockHeader header;
+  limit_code_lengths(deflater->nodes, counts, DEFLATE_LITERAL_LENGTHS, MAX_BITS, literal_length.lengths);
+  limit_code_lengths(deflater->nodes, distance_counts, DEFLATE_DISTANCES, MAX_BITS, distance.lengths);
+  encode_code_lengths(&header, &literal_length, &distance);
+  use_two_symbols(header.counts, CODE_LENGTH_CODES);
+  limit_code_lengths(deflater->nodes, header.counts, CODE_LENGTH_CODES, MAX_CODE_LENGTH_BITS, header.code.lengths);
+  header.code_lengths = CODE_LENGTH_CODES;
+  while (header.code_lengths > 4 && !header.code.lengths[code_length_order[header.code_lengths - 1]]) {
+    header.code_lengths--;
+  }
+
+  // Sizes in bits of the three forms
+  uint64_t extra_bits = 0;
+  for (int code = 0; code < 29; code++) {
+    extra_bits += (uint64_t)counts[257 + code] * length_extra_bits[code];
+  }
+  for (int code = 0; code < 30; code++) {
+    extra_bits += (uint64_t)distance_counts[code] * distance_extra_bits[code];
+  }
+  uint64_t header_bits = 14 + 3 * (uint64_t)header.code_lengths +
+    coded_size(header.counts, header.code.lengths, CODE_LENGTH_CODES);
+  for (int i = 16; i < CODE_LENGTH_CODES; i++) {
+    header_bits += (uint64_t)header.counts[i] * code_length_extra_bits[i];
+  }
+  uint64_t dynamic_bits = 3 + header_bits + extra_bits +
+    coded_size(counts, literal_length.lengths, DEFLATE_LITERAL_LENGTHS) +
+    coded_size(distance_counts, distance.lengths, DEFLATE_DISTANCES);
+  uint64_t fixed_bits = 3 + extra_bits +
+    coded_size(counts, fixed_literal_length_code.lengths, DEFLATE_LITERAL_LENGTHS) +
+    coded_size(distance_counts, fixed_distance_code.lengths, DEFLATE_DISTANCES);
+  // Header and padding of each stored block, at most 42 bits
+  uint64_t stored_blocks = length ? (length + MAX_STORED - 1) / MAX_STORED : 1;
+  uint64_t stored_bits = 8 * ((uint64_t)length + 5 * stored_blocks) + 8;
+
+  if (stored_bits < dynamic_bits && stored_bits < fixed_bits) {
+    write_stored_blocks(writer, data, length, final);
+  }
+  else if (fixed_bits <= dynamic_bits) {
+    write_bits_lsb(final | 1 << 1, 3, writer);
+    write_symbols(deflater, writer, &fixed_literal_length_code, &fixed_distance_code);
+  }
+  else {
+    assign_codes(&literal_length, DEFLATE_LITERAL_LENGTHS);
+    assign_codes(&distance, DEFLATE_DISTANCES);
+    assign_codes(&header.code, CODE_LENGTH_CODES);
+    write_bits_lsb(final | 2 << 1, 3, writer);
+    write_bits_lsb((header.literal_lengths - 257) | (header.distances - 1) << 5 | (header.code_lengths - 4) << 10, 14, writer);
+    for (int i = 0; i < header.code_lengths; i++) {
+      write_bits_lsb(header.code.lengths[code_length_order[i]], 3, writer);
+    }
+    for (int i = 0; i < header.count; i++) {
+      int symbol = header.symbols[i];
+      int bits = header.code.lengths[symbol];
+      write_bits_lsb(header.code.codes[symbol] | (uint32_t)header.extra[i] << bits, bits + code_length_extra_bits[symbol], writer);
+    }
+    write_symbols(deflater, writer, &literal_length, &distance);
+  }
+
+  deflater->symbols = 0;
+  memset(deflater->literal_length_counts, 0, sizeof(deflater->literal_length_counts));
+  memset(deflater->distance_counts, 0, sizeof(deflater->distance_counts));
+}
+
+// Levels 1-3: take the longest match at each position. The positions inside
+// short matches are hashed as well, those inside long ones are skipped.
+static void deflate_greedy(Deflater* deflater, BitWriter* writer, const uint8_t* data, uint32_t length) {
+  const DeflateLevel* level = &levels[deflater->level];
+  uint32_t block_start = 0;
+  uint32_t position = 0;
+  while (position < length) {
+    uint32_t available = length - position;
+    uint32_t best = MIN_MATCH - 1;
+    uint32_t match = 0;
+    if (available >= MIN_MATCH) {
+      uint32_t candidate = insert_position(deflater, data, position);
+      best = longest_match(deflater, level, data, position, candidate, available, best, &match);
+    }
+
+    if (best >= MIN_MATCH) {
+      record_match(deflater, best, position - match);
+      uint32_t end = position + best;
+      if (best <= level->lazy) {
+        for (position++; position < end && position + MIN_MATCH <= length; position++) {
+          insert_position(deflater, data, position);
+        }
+      }
+      position = end;
+    }
+    else {
+      record_literal(deflater, data[position]);
+      position++;
+    }
+
+    if (deflater->symbols == DEFLATE_BLOCK_SYMBOLS) {
+      flush_block(deflater, writer, data + block_start, position - block_start, 0);
+      block_start = position;
+    }
+  }
+  flush_block(deflater, writer, data + block_start, length - block_start, 1);
+}
+
+// Levels 4-9: a match is only taken once the match at the next byte is not
+// longer. Otherwise the byte becomes a literal and the next match is held.
+static void deflate_lazy(Deflater* deflater, BitWriter* writer, const uint8_t* data, uint32_t length) {
+  const DeflateLevel* level = &levels[deflater->level];
+  uint32_t block_start = 0;
+  uint32_t position = 0;
+  uint32_t held = MIN_MATCH - 1; // Match starting at the byte before position
+  uint32_t held_match = 0;
+  int pending = 0;               // The byte before position is not recorded yet
+  while (position < length) {
+    uint32_t available = length - position;
+    uint32_t best = MIN_MATCH - 1;
+    uint32_t match = 0;
+    if (available >= MIN_MATCH) {
+      uint32_t candidate = insert_position(deflater, data, position);
+      if (held < level->lazy) {
+        uint32_t found = longest_match(deflater, level, data, position, candidate, available, held, &match);
+        if (found > held && !(found == MIN_MATCH && position - match > FAR_MATCH)) {
+          best = found;
+        }
+      }
+    }
+
+    if (held >= MIN_MATCH && best <= held) {
+      uint32_t start = position - 1;
+      record_match(deflater, held, start - held_match);
+      uint32_t end = start + held;
+      for (position++; position < end && position + MIN_MATCH <= length; position++) {
+        insert_position(deflater, data, position);
+      }
+      position = end;
+      pending = 0;
+      held = MIN_MATCH - 1;
+    }
+    else {
+      if (pending) {
+        record_literal(deflater, data[position - 1]);
+      }
+      pending = 1;
+      held = best;
+      held_match = match;
+      position++;
+    }
+
+    if (deflater->symbols >= DEFLATE_BLOCK_SYMBOLS) {
+      uint32_t end = position - pending;
+      flush_block(deflater, writer, data + block_start, end - block_start, 0);
+      block_start = end;
+    }
+  }
+  if (pending) {
+    record_literal(deflater, data[position - 1]);
+  }
+  flush_block(deflater, writer, data + block_start, length - block_start, 1);
+}
+
+int init_deflater(Deflater* deflater, int level, Arena* arena) {
+  memset(deflater, 0, sizeof(*deflater));
+  if (level < DEFLATE_FASTEST || level > DEFLATE_BEST) {
+    fprintf(stderr, "Unsupported compression level %d\n", level);
+    return -1;
+  }
+  run_once(&tables_once, build_tables);
+  deflater->level = level;
+  deflater->arena = arena;
+  deflater->head = (uint32_t*)arena_alloc(arena, HASH_SIZE * sizeof(uint32_t));
+  deflater->prev = (uint32_t*)arena_alloc(arena, DEFLATE_WINDOW_SIZE * sizeof(uint32_t));
+  deflater->literals = (uint16_t*)arena_alloc(arena, DEFLATE_BLOCK_SYMBOLS * sizeof(uint16_t));
+  deflater->distances = (uint16_t*)arena_alloc(arena, DEFLATE_BLOCK_SYMBOLS * sizeof(uint16_t));
+  deflater->nodes = (MergeNode*)arena_alloc(arena, MERGE_NODES * sizeof(MergeNode));
+  if (!deflater->head || !deflater->prev || !deflater->literals || !deflater->distances || !deflater->nodes) {
+    fprintf(stderr, "Failed to allocate the deflater!\n");
+    free_deflater(deflater);
+    return -1;
+  }
+  return 0;
+}
+
+void free_deflater(Deflater* deflater) {
+  arena_free(deflater->arena, deflater->head);
+  arena_free(deflater->arena, deflater->prev);
+  arena_free(deflater->arena, deflater->literals);
+  arena_free(deflater->arena, deflater->distances);
+  arena_free(deflater->arena, deflater->nodes);
+  memset(deflater, 0, sizeof(*deflater));
+}
+
+// Stored blocks bound the size of every block, plus the zlib wrapper
+size_t deflate_bound(size_t length) {
+  return length + (length / 8192 + 2) * 5 + 16;
+}
+
+static int deflate_stream(Deflater* deflater, const uint8_t* data, size_t length, BitWriter* writer) {
+  if (length >= DEFLATE_NO_POSITION) {
+    fprintf(stderr, "Cannot compress %llu bytes at once\n", (unsigned long long)length);
+    return -1;
+  }
+  memset(deflater->head, 0xFF, HASH_SIZE * sizeof(uint32_t));
+  deflater->symbols = 0;
+  memset(deflater->literal_length_counts, 0, sizeof(deflater->literal_length_counts));
+  memset(deflater->distance_counts, 0, sizeof(deflater->distance_counts));
+  if (deflater->level < LAZY_LEVEL) {
+    deflate_greedy(deflater, writer, data, (uint32_t)length);
+  }
+  else {
+    deflate_lazy(deflater, writer, data, (uint32_t)length);
+  }
+  align_bit_writer(writer);
+  return 0;
+}
+
+static int finish_output(BitWriter* writer, size_t* out_length) {
+  if (writer->overflow) {
+    fprintf(stderr, "Compressed data does not fit the output buffer!\n");
+    return -1;
+  }
+  *out_length = writer->byte_position;
+  return 0;
+}
+
+int deflate_data(Deflater* deflater, const uint8_t* data, size_t length, uint8_t* out, size_t capacity, size_t* out_length) {
+  BitWriter writer;
+  init_bit_writer(&writer, out, capacity);
+  if (deflate_stream(deflater, data, length, &writer) < 0) {
+    return -1;
+  }
+  return finish_output(&writer, out_length);
+}
+
+int deflate_zlib_data(Deflater* deflater, const uint8_t* data, size_t length, uint8_t* out, size_t capacity, size_t* out_length) {
+  BitWriter writer;
+  init_bit_writer(&writer, out, capacity);
+
+  // CM 8 with a 32K window, FLEVEL from the level, FCHECK making the header a multiple of 31
+  uint32_t cmf = 0x78;
+  uint32_t flevel = deflater->level == 1 ? 0 : deflater->level < 6 ? 1 : deflater->level == 6 ? 2 : 3;
+  uint32_t flg = flevel << 6;
+  flg |= (31 - (cmf << 8 | flg) % 31) % 31;
+  write_bits_lsb(cmf | flg << 8, 16, &writer);
+
+  if (deflate_stream(deflater, data, length, &writer) < 0) {
+    return -1;
+  }
+  uint32_t adler = adler32(data, length);
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    write_bits_lsb(adler >> shift & 0xFF, 8, &writer);
+  }
+  align_bit_writer(&writer);
+  return finish_output(&writer, out_length);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bitstream.h"
+#include "arena.h"
+
+// DEFLATE compressor (RFC 1951) for re-encoding images, matching the decoder
+// in inflate.c. Levels 1-3 take the longest match found within a short hash
+// chain search, levels 4-9 search longer chains and check whether the match
+// at the next byte is longer before taking one. Each block is written with dynamic
+// Huffman codes, the fixed codes or stored, whichever is shortest.
+
+#define DEFLATE_FASTEST 1
+#define DEFLATE_DEFAULT 6
+#define DEFLATE_BEST 9
+
+#define DEFLATE_WINDOW_SIZE (1 << 15)
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_BLOCK_SYMBOLS (1 << 14) // Literals and matches per block
+#define DEFLATE_NO_POSITION 0xFFFFFFFFu
+
+#define DEFLATE_LITERAL_LENGTHS 286
+#define DEFLATE_DISTANCES 30
+
+struct merge_node_struct;
+
+typedef struct deflater_struct {
+  int level;
+  Arena* arena;
+  uint32_t* head;         // Latest position of each hash, DEFLATE_NO_POSITION if none
+  uint32_t* prev;         // Previous position with the same hash, by position % window size
+  uint16_t* literals;     // Literal byte or match length of each symbol of the block
+  uint16_t* distances;    // Match distance, 0 for literals
+  size_t symbols;         // Symbols in the block so far
+  uint32_t literal_length_counts[DEFLATE_LITERAL_LENGTHS];
+  uint32_t distance_counts[DEFLATE_DISTANCES];
+  struct merge_node_struct* nodes; // Scratch of the code length limiting
+} Deflater;
+
+// level 1-9. The buffers come from arena, or the C heap with arena NULL.
+int init_deflater(Deflater* deflater, int level, Arena* arena);
+void free_deflater(Deflater* deflater);
+
+// Largest compressed size of length bytes, with the zlib wrapper
+size_t deflate_bound(size_t length);
+
+// Compress data as one raw DEFLATE stream into out. The deflater can be
+// reused for the next stream.
+int deflate_data(Deflater* deflater, const uint8_t* data, size_t length, uint8_t* out, size_t capacity, size_t* out_length);
+
+// The same in a zlib stream (RFC 1950), as in the IDAT chunks
+int deflate_zlib_data(Deflater* deflater, const uint8_t* data, size_t length, uint8_t* out, size_t capacity, size_t* out_length);
+
+void test_deflate();
@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "deflate.h"
+#include "inflate.h"
+#include "window.h"
+#include "zlib.h"
+
+#define TEST_LENGTH (1 << 20)
+
+// Inflate compressed and compare with the original
+static int inflates_to(uint8_t* compressed, size_t compressed_length, const uint8_t* original, size_t length) {
+  uint8_t* output_buffer = (uint8_t*)malloc(length + MATCH_SLACK);
+  if (!output_buffer) return 0;
+
+  BitStream out_stream;
+  init_bitstream_padded(&out_stream, output_buffer, length, MATCH_SLACK);
+  Window window;
+  init_output_window(&window, &out_stream);
+  InflateState state;
+  init_inflate(&state, &window);
+  int result = inflate_data(&state, compressed, compressed_length, 0);
+  if (result == INFLATE_NEED_INPUT) {
+    result = inflate_finish(&state);
+  }
+  int matches = result == INFLATE_FINISHED && out_stream.byte_position == length && memcmp(output_buffer, original, length) == 0;
+  free(output_buffer);
+  return matches;
+}
+
+// Feed a zlib stream to the decoder in two parts, checking the Adler-32.
+// compressed has BITSTREAM_PADDING readable bytes past its end.
+static int zlib_inflates_to(uint8_t* compressed, size_t compressed_length, const uint8_t* original, size_t length) {
+  uint8_t* output_buffer = (uint8_t*)malloc(length + MATCH_SLACK);
+  if (!output_buffer) return 0;
+
+  BitStream out_stream;
+  init_bitstream_padded(&out_stream, output_buffer, length, MATCH_SLACK);
+  Zlib_Stream stream;
+  init_zlib_stream(&stream, &out_stream, ZLIB_VERIFY);
+  size_t half = compressed_length / 2;
+  int result = feed_zlib_stream(&stream, compressed, half, BITSTREAM_PADDING);
+  if (result != INFLATE_FAILED) {
+    result = feed_zlib_stream(&stream, compressed + half, compressed_length - half, BITSTREAM_PADDING);
+  }
+  if (result != INFLATE_FAILED) {
+    result = finish_zlib_stream(&stream);
+  }
+  int matches = result == INFLATE_FINISHED && stream.mode == ZLIB_DONE && out_stream.byte_position == length && memcmp(output_buffer, original, length) == 0;
+  free_zlib_stream(&stream);
+  free(output_buffer);
+  return matches;
+}
+
+void test_deflate() {
+  // Text, bytes with short repeats like filtered scanlines, noise and a single repeated byte
+  const char* text = "Deflate: The Deflate algorithm is commonly used in file formats like ZIP and PNG. ";
+  size_t text_length = strlen(text);
+  uint8_t* inputs[4] = { NULL };
+  size_t capacity = deflate_bound(TEST_LENGTH) + BITSTREAM_PADDING;
+  uint8_t* compressed = (uint8_t*)calloc(capacity, 1);
+  for (int i = 0; i < 4; i++) {
+    inputs[i] = (uint8_t*)malloc(TEST_LENGTH);
+  }
+  if (!compressed || !inputs[0] || !inputs[1] || !inputs[2] || !inputs[3]) {
+    printf("Deflate test: out of memory\n");
+    free(compressed);
+    for (int i = 0; i < 4; i++) {
+      free(inputs[i]);
+    }
+    return;
+  }
+  uint32_t random = 1;
+  for (size_t i = 0; i < TEST_LENGTH; i++) {
+    random = random * 1103515245 + 12345;
+    inputs[0][i] = (uint8_t)text[i % text_length];
+    inputs[1][i] = (uint8_t)((i % 3 == 0 ? i / 3 : i / 97) + (random >> 28));
+    inputs[2][i] = (uint8_t)(random >> 24);
+    inputs[3][i] = 0xAB;
+  }
+  static const char* names[4] = { "text", "pixels", "noise", "repeated" };
+  size_t lengths[] = { 0, 1, 300, TEST_LENGTH };
+
+  for (int level = DEFLATE_FASTEST; level <= DEFLATE_BEST; level++) {
+    Deflater deflater;
+    if (init_deflater(&deflater, level, NULL) < 0) break;
+    for (int i = 0; i < 4; i++) {
+      for (int j = 0; j < 4; j++) {
+        size_t compressed_length = 0;
+        clock_t start = clock();
+        int result = deflate_data(&deflater, inputs[i], lengths[j], compressed, capacity, &compressed_length);
+        double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        int matches = result == 0 && inflates_to(compressed, compressed_length, inputs[i], lengths[j]);
+        if (lengths[j] == TEST_LENGTH || !matches) {
+          printf("Level %d %s: %llu -> %llu bytes, %.1f MB/s, round trip matches: %s\n", level, names[i],
+            (unsigned long long)lengths[j], (unsigned long long)compressed_length, lengths[j] / 1e6 / (seconds > 0 ? seconds : 1e-9), matches ? "True" : "False");
+        }
+      }
+    }
+    free_deflater(&deflater);
+  }
+
+  // The zlib wrapper, with a corrupted Adler-32 that must be rejected
+  static const int zlib_levels[3] = { DEFLATE_FASTEST, DEFLATE_DEFAULT, DEFLATE_BEST };
+  for (int l = 0; l < 3; l++) {
+    int level = zlib_levels[l];
+    Deflater deflater;
+    if (init_deflater(&deflater, level, NULL) < 0) break;
+    for (int i = 0; i < 4; i++) {
+      size_t compressed_length = 0;
+      int result = deflate_zlib_data(&deflater, inputs[i], TEST_LENGTH, compressed, capacity - BITSTREAM_PADDING, &compressed_length);
+      int matches = result == 0 && zlib_inflates_to(compressed, compressed_length, inputs[i], TEST_LENGTH);
+      int rejected = 0;
+      if (result == 0) {
+        compressed[compressed_length - 1] ^= 1;
+        rejected = !zlib_inflates_to(compressed, compressed_length, inputs[i], TEST_LENGTH);
+      }
+      printf("Level %d %s zlib stream: %llu bytes, round trip matches: %s, bad checksum rejected: %s\n", level, names[i],
+        (unsigned long long)compressed_length, matches ? "True" : "False", rejected ? "True" : "False");
+    }
+    free_deflater(&deflater);
+  }
+
+  free(compressed);
+  for (int i = 0; i < 4; i++) {
+    free(inputs[i]);
+  }
+}
@@ -1,115 +1,192 @@
 #include "huffman.h"
+#include "inflate.h"
 
-// Function prototypes
+// Largest alphabet handled by the table builder (fixed literal/length code)
+#define HUFFMAN_MAX_SYMBOLS 288
 
-void insert_symbol(HuffmanTree* tree, int symbol, int code, int length);
-HuffmanNode* create_node(int symbol, int is_leaf);
+// Copy the rest of a stored block to the output. Returns INFLATE_NEED_INPUT
+// when the current input ends before the block does.
+int copy_uncompressed_data(InflateState* state) {
+  BitStream* stream = &state->input;
 
-void copy_uncompressed_data(int len, BitStream* stream, Window* window) {
-  // Read and output 'len' bytes of uncompressed data
-  for (int i = 0; i < len; i++) {
-    uint8_t byte = read_bytes(1, stream);// stream->buffer[stream->byte_position];
-    output_byte(byte, window);  // Output the byte to your decompression buffer
+  // Bytes already loaded into the bit buffer come first
+  while (state->stored_remaining > 0 && stream->bit_count >= 8 && bits_left(stream) >= 8) {
+    if (output_byte((uint8_t)read_bits_lsb(8, stream), state->window) < 0) {
+      return INFLATE_FAILED;
+    }
+    state->stored_remaining--;
   }
+
+  // Then take the bytes straight from the input buffer
+  if (state->stored_remaining > 0 && stream->bit_count == 0) {
+    uint8_t* data;
+    size_t count = read_aligned_bytes(state->stored_remaining, stream, &data);
+    if (count > 0 && output_bytes(data, count, state->window) < 0) {
+      return INFLATE_FAILED;
+    }
+    state->stored_remaining -= count;
+    checksum_window_span(state->window);
+  }
+
+  if (state->stored_remaining > 0) {
+    if (state->final_input) {
+      fprintf(stderr, "Error: Uncompressed block is truncated\n");
+      return INFLATE_FAILED;
+    }
+    return INFLATE_NEED_INPUT;
+  }
+  return INFLATE_FINISHED;
 }
 
-// Builds the Huffman tree based on symbol code lengths
-void build_huffman_tree(HuffmanTree* tree, int* lengths, int num_symbols) {
+// Builds the canonical Huffman decode table based on symbol code lengths.
+// Codes of up to primary_bits bits are resolved by a single lookup indexed
+// with the next primary_bits stream bits. Longer codes share a link entry per
+// primary prefix that points to a subtable for their remaining bits.
+int build_huffman_table(HuffmanTable* table, int* lengths, int num_symbols, int primary_bits) {
   int bl_count[MAX_BITS + 1] = { 0 };  // Number of codes of each length
   int next_code[MAX_BITS + 1] = { 0 }; // Next available code for each length
+  uint16_t reversed_codes[HUFFMAN_MAX_SYMBOLS]; // Codes in stream bit order
+  uint8_t subtable_bits[HUFFMAN_TABLE_SIZE] = { 0 }; // Index bits of the subtable of each prefix
+
+  int primary_size = 1 << primary_bits;
+  if (num_symbols > HUFFMAN_MAX_SYMBOLS || primary_size > HUFFMAN_TABLE_SIZE) {
+    fprintf(stderr, "Error: Huffman alphabet too large (%d symbols, %d bits)\n", num_symbols, primary_bits);
+    return -1;
+  }
 
   // Step 1: Count the number of codes for each code length
   for (int i = 0; i < num_symbols; i++) {
-    if (lengths[i] > 0) {
-      bl_count[lengths[i]]++;
+    if (lengths[i] < 0 || lengths[i] > MAX_BITS) {
+      fprintf(stderr, "Error: Invalid Huffman code length %d\n", lengths[i]);
+      return -1;
     }
+    bl_count[lengths[i]]++;
   }
+  bl_count[0] = 0; // No codes with length 0
 
-  // Step 2: Calculate the starting code for each length
+  // Step 2: Reject over-subscribed codes and incomplete codes, except a lone one bit code (RFC 1951 3.2.7)
+  int left = 1;
+  int max_length = 0;
+  for (int bits = 1; bits <= MAX_BITS; bits++) {
+    left = (left << 1) - bl_count[bits];
+    if (left < 0) {
+      fprintf(stderr, "Error: Over-subscribed Huffman code\n");
+      return -1;
+    }
+    if (bl_count[bits] > 0) {
+      max_length = bits;
+    }
+  }
+  if (left > 0 && max_length > 1) {
+    fprintf(stderr, "Error: Incomplete Huffman code\n");
+    return -1;
+  }
+
+  // Step 3: Calculate the starting code for each length
   int code = 0;
-  next_code[0] = 0;  // No codes with length 0
   for (int bits = 1; bits <= MAX_BITS; bits++) {
     code = (code + bl_count[bits - 1]) << 1;
     next_code[bits] = code;
   }
 
-  // Step 3: Build the tree by inserting symbols based on their lengths and codes
-  tree->root = create_node(-1, 0);  // Create an empty root node
-  tree->num_symbols = num_symbols;
-
+  // Step 4: Assign the codes and size the subtable of every prefix shared by long codes
   for (int i = 0; i < num_symbols; i++) {
     int len = lengths[i];
-    if (len > 0) {
-      int symbol_code = next_code[len]++;
-      insert_symbol(tree, i, symbol_code, len);
+    if (len == 0) {
+      continue;
+    }
+    reversed_codes[i] = (uint16_t)reverse_bits(next_code[len]++, len);
+    if (len > primary_bits) {
+      int prefix = reversed_codes[i] & (primary_size - 1);
+      if (len - primary_bits > subtable_bits[prefix]) {
+        subtable_bits[prefix] = (uint8_t)(len - primary_bits);
+      }
     }
   }
-}
 
-// Function to print the Huffman tree for debugging
-void print_huffman_tree(HuffmanNode* node, int depth) {
-  if (node == NULL) return;
+  // Step 5: Lay out the subtables after the primary table
+  table->primary_bits = primary_bits;
+  table->num_symbols = num_symbols;
+  memset(table->entries, 0, primary_size * sizeof(table->entries[0]));
 
-  if (node->is_leaf) {
-    printf("Symbol: %d\tLength: %d\tCode: ", node->symbol, node->Len);
-    for (size_t i = 0; i < node->Len; i++) {
-      printf("%d", node->Code >> (node->Len - 1 - i) & 1);
+  int offset = primary_size;
+  for (int prefix = 0; prefix < primary_size && max_length > primary_bits; prefix++) {
+    if (subtable_bits[prefix] == 0) {
+      continue;
     }
-    printf("\tDepth: %d\n", depth);
-  }
-  else {
-    print_huffman_tree(node->left, depth + 1);
-    print_huffman_tree(node->right, depth + 1);
+    int size = 1 << subtable_bits[prefix];
+    if (offset + size > HUFFMAN_TABLE_SIZE) {
+      fprintf(stderr, "Error: Huffman table overflow\n");
+      return -1;
+    }
+    table->entries[prefix] = HUFFMAN_SUBTABLE | huffman_entry(offset, subtable_bits[prefix]);
+    memset(&table->entries[offset], 0, size * sizeof(table->entries[0]));
+    offset += size;
   }
-}
-
-// Inserts a symbol into the Huffman tree based on its code and length
-void insert_symbol(HuffmanTree* tree, int symbol, int code, int length) {
-  HuffmanNode* current = tree->root;
-
-  // Traverse the tree for each bit in the code
-  for (int i = length - 1; i >= 0; i--) {
-    int bit = (code >> i) & 1;
 
-    if (bit == 0) {
-      // Traverse to the left node (create it if it doesn't exist)
-      if (!current->left) {
-        current->left = create_node(-1, 0);  // Internal node
+  // Step 6: Replicate each code into every entry whose low bits match it
+  for (int i = 0; i < num_symbols; i++) {
+    int len = lengths[i];
+    if (len == 0) {
+      continue;
+    }
+    uint32_t reversed = reversed_codes[i];
+    if (len <= primary_bits) {
+      for (uint32_t index = reversed; index < (uint32_t)primary_size; index += 1u << len) {
+        table->entries[index] = huffman_entry(i, len);
       }
-      current = current->left;
     }
     else {
-      // Traverse to the right node (create it if it doesn't exist)
-      if (!current->right) {
-        current->right = create_node(-1, 0);  // Internal node
+      uint32_t link = table->entries[reversed & (primary_size - 1)];
+      uint32_t base = huffman_entry_symbol(link);
+      uint32_t size = 1u << huffman_entry_bits(link);
+      int sub_len = len - primary_bits;
+      for (uint32_t index = reversed >> primary_bits; index < size; index += 1u << sub_len) {
+        table->entries[base + index] = huffman_entry(i, sub_len);
       }
-      current = current->right;
     }
   }
 
-  // Once at the leaf, assign the symbol
-  current->symbol = symbol;
-  current->Len = length;
-  current->Code = code;
-  current->is_leaf = 1;  // Mark as a leaf node
+  return 0;
 }
 
-// Creates a new Huffman node
-HuffmanNode* create_node(int symbol, int is_leaf) {
-  HuffmanNode* node = (HuffmanNode*)malloc(sizeof(HuffmanNode));
-  if (!node) {
-    fprintf(stderr, "Failed to allocate memory for Huffman tree node");
-    return NULL;
+// Function to trace the canonical Huffman codes for debugging
+void print_huffman_codes(int* lengths, int num_symbols) {
+#if TRACE_LEVEL >= TRACE_BLOCK
+  int bl_count[MAX_BITS + 1] = { 0 };
+  int next_code[MAX_BITS + 1] = { 0 };
+
+  for (int i = 0; i < num_symbols; i++) {
+    bl_count[lengths[i]]++;
   }
-  node->symbol = symbol;
-  node->is_leaf = is_leaf;
-  node->left = NULL;
-  node->right = NULL;
-  return node;
+  bl_count[0] = 0;
+
+  int code = 0;
+  for (int bits = 1; bits <= MAX_BITS; bits++) {
+    code = (code + bl_count[bits - 1]) << 1;
+    next_code[bits] = code;
+  }
+
+  for (int i = 0; i < num_symbols; i++) {
+    int len = lengths[i];
+    if (len == 0) {
+      continue;
+    }
+    int symbol_code = next_code[len]++;
+    trace_block("Symbol: %d\tLength: %d\tCode: ", i, len);
+    for (int j = 0; j < len; j++) {
+      trace_block("%d", symbol_code >> (len - 1 - j) & 1);
+    }
+    trace_block("\n");
+  }
+#else
+  (void)lengths;
+  (void)num_symbols;
+#endif
 }
 
-static const int length_base[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
-static const int length_extra_bits[] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+const int length_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+const int length_extra_bits[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
 
 // Decode a length from the Huffman code
 int decode_length(int symbol, BitStream* stream) {
@@ -129,8 +206,8 @@ int decode_length(int symbol, BitStream* stream) {
   return length;
 }
 
-static const int distance_base[] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
-static const int distance_extra_bits[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+const int distance_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+const int distance_extra_bits[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
 
 // Decode a distance from the Huffman code
 int decode_distance(int symbol, BitStream* stream) {
@@ -151,52 +228,87 @@ int decode_distance(int symbol, BitStream* stream) {
   return distance;
 }
 
-// Table for extra bits for length codes
-static int length_extra_bits_fixed[] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,0 };
+// Decode a symbol with a single table lookup, or two for codes longer than the primary bits
+int decode_huffman_symbol(const HuffmanTable* table, BitStream* stream) {
+  uint32_t entry = table->entries[peek_bits_lsb(table->primary_bits, stream)];
 
-// Decode length from Huffman code
-int decode_fixed_length(int litlen, BitStream* stream) {
-  if (litlen < 257 || litlen > 285) {
-    printf("Invalid length code!\n");
+  if (entry & HUFFMAN_SUBTABLE) {
+    consume_bits(table->primary_bits, stream);
+    entry = table->entries[huffman_entry_symbol(entry) + peek_bits_lsb(huffman_entry_bits(entry), stream)];
+  }
+
+  int bits = huffman_entry_bits(entry);
+  if (bits == 0) {
+    fprintf(stderr, "Error: Invalid Huffman code.\n");
     return -1;
   }
+  consume_bits(bits, stream);
 
-  int length = length_base[(litlen - 257)];
-  int extra = length_extra_bits_fixed[litlen - 257];
-  return length + read_bits_lsb(extra, stream);
+  int symbol = huffman_entry_symbol(entry);
+  trace_symbol("Decoded symbol: %d (%#X %c)\n", symbol, symbol, symbol);
+  return symbol;
 }
 
-// Decode distance using fixed Huffman codes
-int decode_fixed_distance(BitStream* stream) {
-  int dist_code = read_bits_lsb(5, stream);
+// Decode literals and matches until the end of the block. Returns INFLATE_NEED_INPUT
+// when fewer bits are left than the longest literal or match may need.
+int decode_compressed_data(InflateState* state) {
+  BitStream* stream = &state->input;
+  const HuffmanTable* literal_length_table = state->literal_length;
+  const HuffmanTable* distance_table = state->distance;
 
-  int distance = distance_base[dist_code];
-  int extra_bits = distance_extra_bits[dist_code];
-  distance += read_bits_lsb(extra_bits, stream);
+  while (1) {
+    if (!inflate_has_bits(state, INFLATE_MAX_STEP_BITS)) {
+      return INFLATE_NEED_INPUT;
+    }
+    checksum_window_span(state->window);
+    if (state->window->stopped) {
+      return INFLATE_STOPPED;
+    }
 
-  return distance;
-}
+    // Decode each symbol from the literal/length table
+    int symbol = decode_huffman_symbol(literal_length_table, stream);
+    if (symbol < 0 || stream->overrun) {
+      return INFLATE_FAILED;
+    }
 
-int decode_fixed_huffman_literal(BitStream* stream) {
-  int code = read_bits_lsb(7, stream);  // Initially, read the first 7 bits
+    if (symbol < 256) {
+      // It's a literal byte, output it
+      if (output_byte((uint8_t)symbol, state->window) < 0) {
+        return INFLATE_FAILED;
+      }
+    }
+    else if (symbol == 256) {
+      // End of block
+      return INFLATE_FINISHED;
+    }
+    else {
+      // It's a length-distance pair, decode the length and distance
+      int length = decode_length(symbol, stream);
+      int distance_symbol = decode_huffman_symbol(distance_table, stream);
+      int distance = distance_symbol < 0 ? -1 : decode_distance(distance_symbol, stream);
+      if (length < 0 || distance < 0) {
+        return INFLATE_FAILED;
+      }
 
-  if (code <= 23) {
-    return code + 256;  // Return literal length code (256-279)
-  }
-  else if (code >= 24 && code <= 255) {
-    return code - 48;   // Return literal byte (0-143)
-  }
-  else if (code >= 280 && code <= 287) {
-    return code - 280 + 144;  // Literal byte (144-255)
+      // Copy the previous data from the sliding window
+      if (copy_from_window(length, distance, state->window) < 0) {
+        return INFLATE_FAILED;
+      }
+    }
   }
-
-  printf("Invalid Huffman code!\n");
-  return -1;
 }
 
+// Fixed Huffman tables, built once and then shared read-only by all decoders
+static HuffmanTable fixed_literal_length_table;
+static HuffmanTable fixed_distance_table;
+static OnceFlag fixed_tables_once = ONCE_INIT;
+
+// Code lengths of the fixed Huffman codes (RFC 1951 3.2.6)
 #define num_symbols 288
-void decode_fixed_huffman_block(BitStream* stream, Window* window) {
+#define num_fixed_distances 32
+static void build_fixed_huffman_tables(void) {
   int lengths[num_symbols] = { 0 };
+  int distance_lengths[num_fixed_distances] = { 0 };
 
   for (size_t i = 0; i < num_symbols; i++) {
     int length = 0;
@@ -212,184 +324,134 @@ void decode_fixed_huffman_block(BitStream* stream, Window* window) {
     lengths[i] = length;
   }
 
-  HuffmanTree fixed_tree;
-
-  build_huffman_tree(&fixed_tree, lengths, num_symbols);
-
-  //print_huffman_tree(fixed_tree.root, 0);
-
-  while (1) {
-    // Huffman tree for fixed codes: literals 0-255, end-of-block, lengths 3-258, distances 1-32
-    //int litlen = decode_fixed_huffman_literal(stream);  // Decode using fixed Huffman codes
-
-    int litlen = decode_huffman_symbol(&fixed_tree, stream);
-
-    if (litlen < 256) {
-      // Literal byte, output it directly
-      output_byte(litlen, window);
-    }
-    else if (litlen == 256) {
-      // End of block
-      return;
-    }
-    else {
-      // Length-distance pair, decode and copy
-      int length = decode_fixed_length(litlen, stream);
-      int distance = decode_fixed_distance(stream);
-      copy_from_window(length, distance, window);
-    }
+  // Distance codes 30 and 31 never occur but complete the 5 bit code
+  for (size_t i = 0; i < num_fixed_distances; i++) {
+    distance_lengths[i] = 5;
   }
+
+  // The fixed codes are complete and no longer than the primary lookup, so this cannot fail
+  build_huffman_table(&fixed_literal_length_table, lengths, num_symbols, LITERAL_LENGTH_TABLE_BITS);
+  build_huffman_table(&fixed_distance_table, distance_lengths, num_fixed_distances, DISTANCE_TABLE_BITS);
 }
 
-// Decode a symbol from the Huffman tree
-int decode_huffman_symbol(HuffmanTree* tree, BitStream* stream) {
-  HuffmanNode* node = tree->root;
-  int bit_count = 0;  // To track how many bits have been read
+void get_fixed_huffman_tables(const HuffmanTable** literal_length_table, const HuffmanTable** distance_table) {
+  run_once(&fixed_tables_once, build_fixed_huffman_tables);
+  *literal_length_table = &fixed_literal_length_table;
+  *distance_table = &fixed_distance_table;
+}
 
-  // Traverse the tree bit by bit
-  while (!node->is_leaf) { // is_leaf may not be necessary as non leaves have symbol -1
-    uint32_t bit = read_bits_lsb(1, stream);
-    if (bit == -1) {
-      fprintf(stderr, "Error: Failed to read bit from stream.\n");
-      return -1;
-    }
+const int code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
-    bit_count++;
-    printf("Read bit: %d\n", bit);
+// Read the code lengths of a dynamic block and build its tables. Each step
+// waits until all of its bits are buffered, so it can stop between any two
+// code lengths and resume with the next input buffer.
+int read_dynamic_huffman_tables(InflateState* state) {
+  BitStream* stream = &state->input;
 
-    if (bit == 0) {
-      node = node->left;
-    }
-    else {
-      node = node->right;
+  switch (state->mode) {
+  case INFLATE_TABLE_COUNTS:
+    // Step 1: Read the number of literal/length and distance codes
+    if (!inflate_has_bits(state, 14)) {
+      return INFLATE_NEED_INPUT;
     }
-
-    if (node == NULL) {
-      fprintf(stderr, "Error: Invalid Huffman tree traversal at bit %d.\n", bit_count);
-      return -1;
+    state->HLIT = read_bits_lsb(5, stream) + 257;  // Number of literal/length codes (257-286)
+    state->HDIST = read_bits_lsb(5, stream) + 1;   // Number of distance codes (1-32)
+    state->HCLEN = read_bits_lsb(4, stream) + 4;   // Number of code length codes (4-19)
+    memset(state->code_length_lengths, 0, sizeof(state->code_length_lengths));
+    state->index = 0;
+    state->mode = INFLATE_CODE_LENGTH_LENGTHS;
+    // fall through
+
+  case INFLATE_CODE_LENGTH_LENGTHS:
+    // Step 2: Read the code lengths for the code length alphabet
+    while (state->index < state->HCLEN) {
+      if (!inflate_has_bits(state, 3)) {
+        return INFLATE_NEED_INPUT;
+      }
+      state->code_length_lengths[code_length_order[state->index++]] = read_bits_lsb(3, stream);  // Read 3-bit code lengths
     }
-  }
-
-  printf("Decoded symbol: %d (%#X %c) after %d bits\n", node->symbol, node->symbol, node->symbol, bit_count);
-  return node->symbol;
-}
-
-void decode_compressed_data(HuffmanTree* literal_length_tree, HuffmanTree* distance_tree, BitStream* stream, Window* window) {
-  int symbol;
 
-  // Decode each symbol from the literal/length tree
-  while ((symbol = decode_huffman_symbol(literal_length_tree, stream)) != 256) {  // 256 is the end-of-block symbol
-    if (symbol < 256) {
-      // It's a literal byte, output it
-      output_byte((uint8_t)symbol, window);
+    // Step 3: Build Huffman table for the code length alphabet
+    if (build_huffman_table(&state->code_length_table, state->code_length_lengths, 19, CODE_LENGTH_TABLE_BITS) < 0) {
+      return INFLATE_FAILED;
     }
-    else {
-      // It's a length-distance pair, decode the length and distance
-      int length = decode_length(symbol, stream);
-      /*
-      int distance = decode_huffman_symbol(distance_tree, stream);
-      distance = decode_distance(distance, stream);
-      */
-      int distance = decode_distance(symbol, stream);
-
-      // Copy the previous data from the sliding window
-      copy_from_window(length, distance, window);
-    }
-  }
-}
-
-void decode_dynamic_huffman_block(BitStream* stream, Window* window) {
-  // Step 1: Read the number of literal/length and distance codes
-  int HLIT = read_bits_lsb(5, stream) + 257;  // Number of literal/length codes (257-286)
-  int HDIST = read_bits_lsb(5, stream) + 1;   // Number of distance codes (1-32)
-  int HCLEN = read_bits_lsb(4, stream) + 4;   // Number of code length codes (4-19)
-
-  // Step 2: Read the code lengths for the code length alphabet
-  int code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
-  int code_length_lengths[19] = { 0 };  // Code lengths for the code length alphabet
-
-  for (int i = 0; i < HCLEN; i++) {
-    code_length_lengths[code_length_order[i]] = read_bits_lsb(3, stream);  // Read 3-bit code lengths
-  }
-
-  // Step 3: Build Huffman tree for the code length alphabet
-  HuffmanTree code_length_tree;
-  build_huffman_tree(&code_length_tree, code_length_lengths, 19);
-
-  // Step 4: Decode literal/length and distance code lengths using the code length tree
-  int literal_length_lengths[288] = { 0 };  // Array for literal/length code lengths
-  int distance_lengths[32] = { 0 };  // Array for distance code lengths
-
-  int i = 0;
-  while (i < HLIT + HDIST) {
-    int symbol = decode_huffman_symbol(&code_length_tree, stream);  // Decode a symbol from the code length tree
-    if (symbol <= 15) {
-      // Symbols 0-15 represent literal lengths directly
-      if (i < HLIT) {
-        literal_length_lengths[i] = symbol;
+    memset(state->code_lengths, 0, sizeof(state->code_lengths));
+    state->index = 0;
+    state->mode = INFLATE_CODE_LENGTHS;
+    // fall through
+
+  case INFLATE_CODE_LENGTHS:
+    // Step 4: Decode literal/length and distance code lengths using the code length table
+    while (state->index < state->HLIT + state->HDIST) {
+      // A code length code is at most 7 bits, followed by at most 7 extra bits
+      if (!inflate_has_bits(state, 14)) {
+        return INFLATE_NEED_INPUT;
       }
-      else {
-        distance_lengths[i - HLIT] = symbol;
+      int symbol = decode_huffman_symbol(&state->code_length_table, stream);
+      if (symbol < 0 || stream->overrun) {
+        return INFLATE_FAILED;
       }
-      i++;
-    }
-    else if (symbol == 16) {
-      // Repeat the last length 3-6 times
-      int repeat_length = 3 + read_bits_lsb(2, stream);  // Read 2 extra bits (3-6 repeats)
-      int last_length = (i < HLIT) ? literal_length_lengths[i - 1] : distance_lengths[i - HLIT - 1];
-
-      for (int j = 0; j < repeat_length && i < HLIT + HDIST; j++) {
-        if (i < HLIT) {
-          literal_length_lengths[i] = last_length;
-        }
-        else {
-          distance_lengths[i - HLIT] = last_length;
-        }
-        i++;
+
+      int length = 0;
+      int repeat_length = 1;
+      if (symbol <= 15) {
+        // Symbols 0-15 represent code lengths directly
+        length = symbol;
       }
-    }
-    else if (symbol == 17) {
-      // Repeat a zero length 3-10 times
-      int repeat_length = 3 + read_bits_lsb(3, stream);  // Read 3 extra bits (3-10 repeats)
-      for (int j = 0; j < repeat_length && i < HLIT + HDIST; j++) {
-        if (i < HLIT) {
-          literal_length_lengths[i] = 0;
-        }
-        else {
-          distance_lengths[i - HLIT] = 0;
+      else if (symbol == 16) {
+        // Repeat the last length 3-6 times
+        if (state->index == 0) {
+          fprintf(stderr, "Error: Repeated code length without a previous length\n");
+          return INFLATE_FAILED;
         }
-        i++;
+        length = state->code_lengths[state->index - 1];
+        repeat_length = 3 + read_bits_lsb(2, stream);  // Read 2 extra bits (3-6 repeats)
       }
-    }
-    else if (symbol == 18) {
-      // Repeat a zero length 11-138 times
-      int repeat_length = 11 + read_bits_lsb(7, stream);  // Read 7 extra bits (11-138 repeats)
-      for (int j = 0; j < repeat_length && i < HLIT + HDIST; j++) {
-        if (i < HLIT) {
-          literal_length_lengths[i] = 0;
-        }
-        else {
-          distance_lengths[i - HLIT] = 0;
-        }
-        i++;
+      else if (symbol == 17) {
+        // Repeat a zero length 3-10 times
+        repeat_length = 3 + read_bits_lsb(3, stream);  // Read 3 extra bits (3-10 repeats)
+      }
+      else {
+        // Repeat a zero length 11-138 times
+        repeat_length = 11 + read_bits_lsb(7, stream); // Read 7 extra bits (11-138 repeats)
       }
-    }
-  }
-
-  // Step 5: Build the literal/length and distance Huffman trees
-  HuffmanTree literal_length_tree;
-  build_huffman_tree(&literal_length_tree, literal_length_lengths, HLIT);
 
-  HuffmanTree distance_tree;
-  build_huffman_tree(&distance_tree, distance_lengths, HDIST);
+      // Repeats may cross from the literal/length into the distance lengths, but not past them
+      if (state->index + repeat_length > state->HLIT + state->HDIST) {
+        fprintf(stderr, "Error: Repeated code lengths past the last code\n");
+        return INFLATE_FAILED;
+      }
+      for (int j = 0; j < repeat_length; j++) {
+        state->code_lengths[state->index++] = length;
+      }
+    }
 
-  printf("-- code_length_tree --\n");
-  print_huffman_tree(code_length_tree.root, 0);
-  printf("-- literal_length_tree --\n");
-  print_huffman_tree(literal_length_tree.root, 0);
-  printf("-- distance_tree --\n");
-  print_huffman_tree(distance_tree.root, 0);
+    if (state->code_lengths[256] == 0) {
+      fprintf(stderr, "Error: Missing end-of-block code\n");
+      return INFLATE_FAILED;
+    }
 
-  // Step 6: Decode the actual compressed data
-  decode_compressed_data(&literal_length_tree, &distance_tree, stream, window);
+    // Step 5: Build the literal/length and distance Huffman tables
+    if (build_huffman_table(&state->literal_length_table, state->code_lengths, state->HLIT, LITERAL_LENGTH_TABLE_BITS) < 0 ||
+        build_huffman_table(&state->distance_table, state->code_lengths + state->HLIT, state->HDIST, DISTANCE_TABLE_BITS) < 0) {
+      return INFLATE_FAILED;
+    }
+    state->literal_length = &state->literal_length_table;
+    state->distance = &state->distance_table;
+
+#if TRACE_LEVEL >= TRACE_BLOCK
+    trace_block("-- code_length_tree --\n");
+    print_huffman_codes(state->code_length_lengths, 19);
+    trace_block("-- literal_length_tree --\n");
+    print_huffman_codes(state->code_lengths, state->HLIT);
+    trace_block("-- distance_tree --\n");
+    print_huffman_codes(state->code_lengths + state->HLIT, state->HDIST);
+#endif
+
+    state->mode = INFLATE_HUFFMAN_DATA;
+    return INFLATE_FINISHED;
+
+  default:
+    return INFLATE_FAILED;
+  }
 }
@@ -5,27 +5,56 @@
 #include <stdint.h>
 
 #include "bitstream.h"
-#include "inflate.h"
+#include "window.h"
+#include "thread.h"
 
 #define MAX_BITS 15
 
-// Huffman tree node
-typedef struct HuffmanNode {
-  int symbol;             // The symbol (character or value)
-  int Len;             // The code length in bits
-  int Code;               // The code
-  int is_leaf;            // 1 if this is a leaf node, 0 otherwise
-  struct HuffmanNode* left;  // Left child (for bit 0)
-  struct HuffmanNode* right; // Right child (for bit 1)
-} HuffmanNode;
-
-// Huffman tree
-typedef struct HuffmanTree {
-  HuffmanNode* root;   // Pointer to the root node of the tree
-  int num_symbols;     // Number of symbols in the Huffman tree
-} HuffmanTree;
-
-void copy_uncompressed_data(int len, BitStream* stream, Window* window);
-void decode_fixed_huffman_block(BitStream* stream, Window* window);
-void decode_dynamic_huffman_block(BitStream* stream, Window* window);
-int decode_huffman_symbol(HuffmanTree* tree, BitStream* stream);
+// Number of code bits resolved by the primary lookup of each alphabet.
+// Longer codes continue in a subtable indexed by the remaining bits.
+#define LITERAL_LENGTH_TABLE_BITS 9
+#define DISTANCE_TABLE_BITS 6
+#define CODE_LENGTH_TABLE_BITS 7
+
+// Primary table plus all subtables. The worst case for a complete deflate
+// code is 852 entries (literal/length alphabet, 9 primary bits, 15 bit codes).
+#define HUFFMAN_TABLE_SIZE 1024
+
+// Huffman table entry layout
+// bits  0-15 symbol, or start index of the subtable for links
+// bits 16-19 code bits consumed by this entry, or index bits of the linked subtable
+// bit  31    entry links to a subtable
+// An entry with zero bits is an unused code.
+#define HUFFMAN_SUBTABLE 0x80000000u
+#define huffman_entry(symbol, bits) ((uint32_t)(symbol) | ((uint32_t)(bits) << 16))
+#define huffman_entry_symbol(entry) ((entry) & 0xFFFF)
+#define huffman_entry_bits(entry) (((entry) >> 16) & 0xF)
+
+// Base values and extra bits of the length symbols 257-285 and the distance
+// symbols, and the order of the code length code lengths (RFC 1951 3.2.5-7).
+// Shared with the encoder.
+extern const int length_base[29];
+extern const int length_extra_bits[29];
+extern const int distance_base[30];
+extern const int distance_extra_bits[30];
+extern const int code_length_order[19];
+
+// Canonical Huffman decode table
+typedef struct huffman_table_struct {
+  uint32_t entries[HUFFMAN_TABLE_SIZE];
+  int primary_bits; // Bits peeked for the primary lookup
+  int num_symbols;  // Number of symbols in the alphabet
+} HuffmanTable;
+
+int build_huffman_table(HuffmanTable* table, int* lengths, int num_symbols, int primary_bits);
+void print_huffman_codes(int* lengths, int num_symbols);
+void get_fixed_huffman_tables(const HuffmanTable** literal_length_table, const HuffmanTable** distance_table);
+
+// Resumable block decoding steps, see inflate.h for the state and return values
+struct inflate_state_struct;
+int copy_uncompressed_data(struct inflate_state_struct* state);
+int read_dynamic_huffman_tables(struct inflate_state_struct* state);
+int decode_compressed_data(struct inflate_state_struct* state);
+int decode_huffman_symbol(const HuffmanTable* table, BitStream* stream);
+int decode_length(int symbol, BitStream* stream);
+int decode_distance(int symbol, BitStream* stream);
@@ -31,36 +31,128 @@ uint8_t btypes[][39] = {
   "Compression with dynamic Huffman codes"
 };
 
-int inflate_block(BitStream* stream, Window* window) {
-  int bfinal = read_bits_lsb(1, stream);  // 1 if this is the final block
-  int btype = read_bits_lsb(2, stream);   // 2-bit block type
-  
-  printf("Block type: %s (BTYPE=%d%d)\n", btypes[btype], (btype >> 1) & 1, btype & 1);
-
-  if (btype == 0) {
-    // Uncompressed block
-    skip_to_next_byte(stream); // Any bits of input up to the next byte boundary are ignored
-    int len = read_bytes(2, stream);  // block length
-    int nlen = read_bytes(2, stream); // one's complement of len
-    if ((len ^ nlen) != 0xFFFF) {
-      printf("Invalid uncompressed block length!\n");
-      return -1;
+void init_inflate(InflateState* state, Window* window) {
+  memset(state, 0, sizeof(*state));
+  state->mode = INFLATE_BLOCK_HEADER;
+  state->window = window;
+  init_bitstream(&state->input, NULL, 0);
+}
+
+// Run the decoder on the attached input until it ends or the final block is done
+int inflate_blocks(InflateState* state) {
+  BitStream* stream = &state->input;
+
+  while (1) {
+    int result = INFLATE_FINISHED;
+    if (state->window->stopped) {
+      return INFLATE_STOPPED;
+    }
+
+    switch (state->mode) {
+    case INFLATE_BLOCK_HEADER: {
+      // Input that ends exactly at a block boundary may continue elsewhere,
+      // even when it is the final input (see restart.c)
+      if (!inflate_has_bits(state, 3) || (state->final_input && bits_left(stream) == 0)) {
+        return INFLATE_NEED_INPUT;
+      }
+      trace_block("Processing Zlib block %d\n", ++state->block);
+      state->final_block = read_bits_lsb(1, stream);  // 1 if this is the final block
+      int btype = read_bits_lsb(2, stream);           // 2-bit block type
+      if (btype == 3) {
+        fprintf(stderr, "Invalid block type!\n");
+        state->mode = INFLATE_ERROR;
+        return INFLATE_FAILED;
+      }
+      trace_block("Block type: %s (BTYPE=%d%d)\n", btypes[btype], (btype >> 1) & 1, btype & 1);
+
+      if (btype == 0) {
+        state->mode = INFLATE_STORED_HEADER;
+      }
+      else if (btype == 1) {
+        get_fixed_huffman_tables(&state->literal_length, &state->distance);
+        state->mode = INFLATE_HUFFMAN_DATA;
+      }
+      else {
+        state->mode = INFLATE_TABLE_COUNTS;
+      }
+      break;
+    }
+
+    case INFLATE_STORED_HEADER: {
+      // Up to 7 bits to the byte boundary and 32 bits of LEN and NLEN
+      if (!inflate_has_bits(state, 39)) {
+        return INFLATE_NEED_INPUT;
+      }
+      skip_to_next_byte(stream); // Any bits of input up to the next byte boundary are ignored
+      uint32_t len = read_bits_lsb(16, stream);  // block length (little-endian)
+      uint32_t nlen = read_bits_lsb(16, stream); // one's complement of len
+      if ((len ^ nlen) != 0xFFFF) {
+        fprintf(stderr, "Invalid uncompressed block length!\n");
+        state->mode = INFLATE_ERROR;
+        return INFLATE_FAILED;
+      }
+      state->stored_remaining = len;
+      state->mode = INFLATE_STORED_DATA;
+      break;
+    }
+
+    case INFLATE_STORED_DATA:
+      result = copy_uncompressed_data(state);
+      if (result == INFLATE_FINISHED) {
+        state->mode = state->final_block ? INFLATE_DONE : INFLATE_BLOCK_HEADER;
+      }
+      break;
+
+    case INFLATE_TABLE_COUNTS:
+    case INFLATE_CODE_LENGTH_LENGTHS:
+    case INFLATE_CODE_LENGTHS:
+      result = read_dynamic_huffman_tables(state);
+      break;
+
+    case INFLATE_HUFFMAN_DATA:
+      result = decode_compressed_data(state);
+      if (result == INFLATE_FINISHED) {
+        // End of block, continue to the next block if this was not the last block
+        state->mode = state->final_block ? INFLATE_DONE : INFLATE_BLOCK_HEADER;
+      }
+      break;
+
+    case INFLATE_DONE:
+      return INFLATE_FINISHED;
+
+    default:
+      return INFLATE_FAILED;
+    }
+
+    if (result == INFLATE_FAILED) {
+      state->mode = INFLATE_ERROR;
+      return INFLATE_FAILED;
+    }
+    if (result == INFLATE_NEED_INPUT || result == INFLATE_STOPPED) {
+      return result;
     }
-    copy_uncompressed_data(len, stream, window);
-  }
-  else if (btype == 1) {
-    // Fixed Huffman codes
-    decode_fixed_huffman_block(stream, window);
-  }
-  else if (btype == 2) {
-    // Dynamic Huffman codes
-    decode_dynamic_huffman_block(stream, window);
   }
-  else {
-    printf("Invalid block type!\n");
-    return -1;
+}
+
+// Decode a slice of the stream. The decoder reads the slice in place and keeps
+// what it needs of it, so the slice can be released once this returns.
+int inflate_data(InflateState* state, uint8_t* data, size_t length, size_t padding) {
+  attach_bitstream(&state->input, data, length, padding);
+  int result = inflate_blocks(state);
+  if (result == INFLATE_NEED_INPUT) {
+    detach_bitstream(&state->input);
   }
+  return result;
+}
 
-  // Return continue to the next block if this was not the last block
-  return (bfinal == 0);
+// Signal that no more input follows and decode what is left
+int inflate_finish(InflateState* state) {
+  state->final_input = 1;
+  int result = inflate_blocks(state);
+  if (result == INFLATE_NEED_INPUT) {
+    fprintf(stderr, "Error: Deflate stream is truncated\n");
+    state->mode = INFLATE_ERROR;
+    return INFLATE_FAILED;
+  }
+  return result;
 }
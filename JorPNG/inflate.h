@@ -9,5 +9,67 @@
 #include "window.h"
 #include "huffman.h"
 
-int inflate_block(BitStream* stream, Window* window);
+// Return values of inflate_data and inflate_finish
+#define INFLATE_FAILED -1
+#define INFLATE_FINISHED 0   // Final block decoded
+#define INFLATE_NEED_INPUT 1 // All input used, feed the next buffer
+#define INFLATE_STOPPED 2    // The window sink needs no more output, see Window.stopped
+
+// Where the decoder stopped, so it can resume when the next buffer arrives
+typedef enum inflate_mode_enum {
+  INFLATE_BLOCK_HEADER,
+  INFLATE_STORED_HEADER,
+  INFLATE_STORED_DATA,
+  INFLATE_TABLE_COUNTS,
+  INFLATE_CODE_LENGTH_LENGTHS,
+  INFLATE_CODE_LENGTHS,
+  INFLATE_HUFFMAN_DATA,
+  INFLATE_DONE,
+  INFLATE_ERROR
+} InflateMode;
+
+// Most bits a single resumable step reads: a length/distance pair with
+// 15 + 5 + 15 + 13 bits. Steps only start once this many bits are buffered,
+// so a step never has to stop halfway.
+#define INFLATE_MAX_STEP_BITS 48
+
+// Resumable DEFLATE decoder. Input may be fed in any number of slices; the
+// bit position, block state, Huffman tables and window carry across calls.
+typedef struct inflate_state_struct {
+  InflateMode mode;
+  int final_block;  // BFINAL of the current block
+  int final_input;  // No more input follows the current buffer
+  int block;        // Number of blocks started
+  BitStream input;
+  Window* window;
+
+  // Stored block
+  size_t stored_remaining;
+
+  // Dynamic block header
+  int HLIT;
+  int HDIST;
+  int HCLEN;
+  int index; // Next code length to read
+  int code_length_lengths[19];
+  int code_lengths[288 + 32]; // Literal/length then distance code lengths
+  HuffmanTable code_length_table;
+
+  // Tables of the current block, either the dynamic ones below or the fixed ones
+  const HuffmanTable* literal_length;
+  const HuffmanTable* distance;
+  HuffmanTable literal_length_table;
+  HuffmanTable distance_table;
+} InflateState;
+
+// Whether a step needing num_bits can run now. After the last buffer any
+// missing bits read as zero and are caught as an overrun.
+static inline int inflate_has_bits(InflateState* state, size_t num_bits) {
+  return state->final_input || bits_left(&state->input) >= num_bits;
+}
+
+void init_inflate(InflateState* state, Window* window);
+int inflate_data(InflateState* state, uint8_t* data, size_t length, size_t padding);
+int inflate_finish(InflateState* state);
+int inflate_blocks(InflateState* state);
 void test_inflate();
@@ -19,26 +19,23 @@ size_t text_length = 323;
 void test_inflate() {
   size_t stream_length = sizeof(test_data) / sizeof(test_data[0]);
 
-  BitStream in_stream;
-  init_bitstream(&in_stream, test_data, stream_length);
-
-
-  uint8_t* output_buffer = (uint8_t*)malloc(text_length);
+  uint8_t* output_buffer = (uint8_t*)malloc(text_length + MATCH_SLACK);
   if (!output_buffer) return;
 
   memset(output_buffer, '\0', text_length);
 
   BitStream out_stream;
-  init_bitstream(&out_stream, output_buffer, text_length);
+  init_bitstream_padded(&out_stream, output_buffer, text_length, MATCH_SLACK);
   
-  // create 32k window
+  // resolve back-references against the output buffer
   Window window;
-  init_window(&window, s32K, &out_stream);
+  init_output_window(&window, &out_stream);
 
-  int block = 1;
-  do {
-    printf("Processing Zlib block %d\n", block++);
-  } while (inflate_block(&in_stream, &window));
+  InflateState state;
+  init_inflate(&state, &window);
+  if (inflate_data(&state, test_data, stream_length, 0) == INFLATE_NEED_INPUT) {
+    inflate_finish(&state);
+  }
 
   print_bitstream(&out_stream, 0);
 
@@ -46,4 +43,33 @@ void test_inflate() {
     printf("%c", out_stream.buffer[i]);
   }
   printf("\n");
+
+  // decode again through a 32k ring window, as in streaming mode
+  uint8_t* ring_buffer = (uint8_t*)calloc(text_length, 1);
+  if (ring_buffer) {
+    BitStream ring_stream;
+    init_bitstream(&ring_stream, ring_buffer, text_length);
+
+    // feed the input one byte at a time to exercise resuming between slices
+    Window ring;
+    if (init_ring_window(&ring, s32K, bitstream_sink, &ring_stream) == 0) {
+      init_inflate(&state, &ring);
+      enable_window_checksum(&ring);
+      int result = INFLATE_NEED_INPUT;
+      for (size_t i = 0; i < stream_length && result == INFLATE_NEED_INPUT; i++) {
+        result = inflate_data(&state, &test_data[i], 1, 0);
+      }
+      if (result == INFLATE_NEED_INPUT) {
+        inflate_finish(&state);
+      }
+      uint32_t ring_adler = get_window_checksum(&ring); // also flushes the ring
+      free_window(&ring);
+      int matches = ring_stream.byte_position == out_stream.byte_position && memcmp(ring_buffer, output_buffer, out_stream.byte_position) == 0;
+      printf("Ring window output matches: %s\n", matches ? "True" : "False");
+      int checksum_matches = ring_adler == adler32(output_buffer, out_stream.byte_position);
+      printf("Ring window checksum matches: %s\n", checksum_matches ? "True" : "False");
+    }
+    free(ring_buffer);
+  }
+  free(output_buffer);
 }
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "input.h"
+#include "bitstream.h"
+#include "crc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+// Map the whole file read-only. Empty files cannot be mapped.
+static int map_file(PngInput* input, const char* filename) {
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return -1;
+  }
+  LARGE_INTEGER size;
+  HANDLE mapping = NULL;
+  if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && (unsigned long long)size.QuadPart <= SIZE_MAX) {
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  }
+  CloseHandle(file);
+  if (!mapping) {
+    return -1;
+  }
+  const uint8_t* data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!data) {
+    CloseHandle(mapping);
+    return -1;
+  }
+  input->data = data;
+  input->length = (size_t)size.QuadPart;
+  input->mapping = mapping;
+  return 0;
+}
+
+static void unmap_file(PngInput* input) {
+  UnmapViewOfFile(input->data);
+  CloseHandle((HANDLE)input->mapping);
+}
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Map the whole file read-only. Empty files and pipes cannot be mapped.
+static int map_file(PngInput* input, const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat info;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  input->data = (const uint8_t*)data;
+  input->length = (size_t)info.st_size;
+  return 0;
+}
+
+static void unmap_file(PngInput* input) {
+  munmap((void*)input->data, input->length);
+}
+#endif
+
+int open_png_input_file(PngInput* input, const char* filename, Arena* arena) {
+  memset(input, 0, sizeof(*input));
+  input->arena = arena;
+  if (map_file(input, filename) == 0) {
+    input->kind = PNG_INPUT_MAPPED;
+    return 0;
+  }
+  FILE* file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return -1;
+  }
+  open_png_input_stream(input, file, arena);
+  input->close_file = 1;
+  return 0;
+}
+
+void open_png_input_memory(PngInput* input, const uint8_t* data, size_t length) {
+  memset(input, 0, sizeof(*input));
+  input->kind = PNG_INPUT_MEMORY;
+  input->data = data;
+  input->length = length;
+}
+
+void open_png_input_stream(PngInput* input, FILE* file, Arena* arena) {
+  memset(input, 0, sizeof(*input));
+  input->kind = PNG_INPUT_STREAM;
+  input->file = file;
+  input->arena = arena;
+}
+
+void close_png_input(PngInput* input) {
+  if (input->kind == PNG_INPUT_MAPPED) {
+    unmap_file(input);
+  }
+  if (input->close_file) {
+    fclose(input->file);
+  }
+  arena_free(input->arena, input->buffer);
+  memset(input, 0, sizeof(*input));
+}
+
+// Copy the next count bytes out of the input
+static int read_input(PngInput* input, uint8_t* bytes, size_t count) {
+  if (input->kind == PNG_INPUT_STREAM) {
+    if (fread(bytes, 1, count, input->file) != count) {
+      return -1;
+    }
+  }
+  else {
+    if (input->length - input->position < count) {
+      return -1;
+    }
+    memcpy(bytes, input->data + input->position, count);
+  }
+  input->position += count;
+  return 0;
+}
+
+int read_png_signature(PngInput* input) {
+  uint8_t signature[8];
+  if (read_input(input, signature, 8) < 0 || memcmp(signature, png_signature, 8) != 0) {
+    fprintf(stderr, "Not a PNG file\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Buffer for the data of a streamed chunk, plus the bit reader padding
+static int reserve_buffer(PngInput* input, size_t size) {
+  if (size <= input->capacity) {
+    return 0;
+  }
+  size_t capacity = input->capacity ? input->capacity : 1 << 14;
+  while (capacity < size) {
+    capacity *= 2;
+  }
+  // Arena buffers are left for the arena, heap buffers are freed
+  arena_free(input->arena, input->buffer);
+  input->buffer = (uint8_t*)arena_alloc(input->arena, capacity);
+  input->capacity = input->buffer ? capacity : 0;
+  if (!input->buffer) {
+    fprintf(stderr, "Could not allocate memory for chunk\n");
+    return -1;
+  }
+  return 0;
+}
+
+int read_png_chunk_header(PngInput* input, png_chunk* chunk) {
+  uint8_t length_bytes[4];
+  if (read_input(input, length_bytes, 4) < 0 || read_input(input, input->type, 4) < 0) {
+    fprintf(stderr, "Error: PNG file is truncated\n");
+    return -1;
+  }
+  chunk->length = read_be32(length_bytes);
+  chunk->chunk_type = read_be32(input->type);
+  chunk->data = NULL;
+  chunk->crc = 0;
+  chunk->padding = 0;
+  if (chunk->length > 0x7FFFFFFF) {
+    fprintf(stderr, "Invalid chunk length %u\n", chunk->length);
+    return -1;
+  }
+  return 0;
+}
+
+int read_png_chunk_data(PngInput* input, png_chunk* chunk) {
+  uint8_t crc_bytes[4];
+  if (input->kind == PNG_INPUT_STREAM) {
+    if (reserve_buffer(input, (size_t)chunk->length + BITSTREAM_PADDING) < 0 ||
+        read_input(input, input->buffer, chunk->length) < 0) {
+      fprintf(stderr, "Error: PNG file is truncated\n");
+      return -1;
+    }
+    chunk->data = input->buffer;
+    chunk->padding = BITSTREAM_PADDING;
+  }
+  else {
+    // A view of the data in place, the bytes after it are the padding
+    if (input->length - input->position < chunk->length) {
+      fprintf(stderr, "Error: PNG file is truncated\n");
+      return -1;
+    }
+    chunk->data = (uint8_t*)input->data + input->position;
+    input->position += chunk->length;
+    size_t after = input->length - input->position;
+    chunk->padding = after < BITSTREAM_PADDING ? after : BITSTREAM_PADDING;
+  }
+
+  if (read_input(input, crc_bytes, 4) < 0) {
+    fprintf(stderr, "Error: PNG file is truncated\n");
+    return -1;
+  }
+  chunk->crc = read_be32(crc_bytes);
+  uint32_t c = chunk_crc(input->type, chunk->data, chunk->length);
+  if (chunk->crc != c) {
+    fprintf(stderr, "CRC mismatch! %X != %X\n", chunk->crc, c);
+    return -1;
+  }
+  return 0;
+}
+
+// Skip the data and the CRC, unchecked
+int skip_png_chunk_data(PngInput* input, const png_chunk* chunk) {
+  size_t count = (size_t)chunk->length + 4;
+  if (input->kind != PNG_INPUT_STREAM) {
+    if (input->length - input->position < count) {
+      fprintf(stderr, "Error: PNG file is truncated\n");
+      return -1;
+    }
+    input->position += count;
+    return 0;
+  }
+  if (fseek(input->file, (long)count, SEEK_CUR) == 0) {
+    input->position += count;
+    return 0;
+  }
+  // Pipes cannot seek, so read and drop the bytes
+  uint8_t discard[4096];
+  while (count > 0) {
+    size_t part = count < sizeof(discard) ? count : sizeof(discard);
+    if (read_input(input, discard, part) < 0) {
+      fprintf(stderr, "Error: PNG file is truncated\n");
+      return -1;
+    }
+    count -= part;
+  }
+  return 0;
+}
+
+int read_png_chunk(PngInput* input, png_chunk* chunk) {
+  if (read_png_chunk_header(input, chunk) < 0) {
+    return -1;
+  }
+  return read_png_chunk_data(input, chunk);
+}
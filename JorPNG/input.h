@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "chunk.h"
+#include "arena.h"
+
+// Where PNG bytes come from. Files are memory-mapped where possible and
+// buffers in memory are used as they are; chunks from either are views into
+// the bytes, so their data is neither copied nor allocated. Streams that
+// cannot be mapped, like pipes, are read chunk by chunk into a buffer.
+typedef enum png_input_kind_enum {
+  PNG_INPUT_MEMORY, // Caller's buffer
+  PNG_INPUT_MAPPED, // Memory-mapped file
+  PNG_INPUT_STREAM  // FILE* read with fread
+} PngInputKind;
+
+typedef struct png_input_struct {
+  PngInputKind kind;
+  const uint8_t* data;  // All bytes (memory and mapped)
+  size_t length;
+  size_t position;      // Offset of the next unread byte
+  FILE* file;           // Stream input
+  int close_file;       // file was opened by open_png_input_file
+  uint8_t* buffer;      // Data of the last chunk (stream)
+  size_t capacity;
+  Arena* arena;         // Source of buffer, NULL for the heap
+  void* mapping;        // File mapping handle (Windows)
+  uint8_t type[4];      // Type of the last chunk as stored, for its CRC
+} PngInput;
+
+// Map the file, or read it as a stream when it cannot be mapped
+int open_png_input_file(PngInput* input, const char* filename, Arena* arena);
+void open_png_input_memory(PngInput* input, const uint8_t* data, size_t length);
+void open_png_input_stream(PngInput* input, FILE* file, Arena* arena);
+void close_png_input(PngInput* input);
+
+int read_png_signature(PngInput* input);
+
+// Read the next chunk and check its CRC. chunk->data stays valid until the
+// next chunk is read; it is padded with chunk->padding readable bytes.
+// chunk_type is in the byte order of the typeFromName constants.
+int read_png_chunk(PngInput* input, png_chunk* chunk);
+
+// The same in two steps, to look at the length and type before deciding
+// whether to read the data or skip it. Skipping seeks where the input can,
+// so the data is never read.
+int read_png_chunk_header(PngInput* input, png_chunk* chunk);
+int read_png_chunk_data(PngInput* input, png_chunk* chunk);
+int skip_png_chunk_data(PngInput* input, const png_chunk* chunk);
@@ -9,114 +9,253 @@
 #include "crc.h"
 #include "zlib.h"
 #include "huffman.h"
-
-// PNG file signature (8 bytes)
-// http://www.libpng.org/pub/png/spec/1.2/PNG-Rationale.html#R.PNG-file-signature
-const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+#include "png.h"
+#include "restart.h"
+#include "speculate.h"
+#include "input.h"
+#include "pipeline.h"
+#include "convert.h"
+#include "deflate.h"
+#include "decode.h"
+#include "unfilter.h"
 
 png_IHDR ihdr = { 0 };
 
+// Threads for the opt-in speculative parallel inflate of images without
+// restart points, 0 to always decode those serially
+int speculative_threads = 0;
+
+// Opt-in three-stage pipeline for the IDAT chunks of images decoded serially
+int pipelined_decode = 0;
+
+// Layout the rows are printed in, converted from the file's with converter
+PngPixelFormat output_format = PNG_FORMAT_RAW;
+PngConverter converter;
+static uint8_t* converted_row = NULL;
+
+// Row callback that prints each decoded row and keeps an Adler-32 of the pixels
+static void print_row(void* context, uint32_t y, const uint8_t* pixels, size_t length) {
+  uint32_t* adler = (uint32_t*)context;
+  (void)y;
+  if (converted_row) {
+    convert_png_row(&converter, pixels, converted_row, ihdr.width);
+    pixels = converted_row;
+    length = png_converted_row_bytes(&converter, ihdr.width);
+  }
+  for (size_t i = 0; i < length; i++) {
+    printf("%02X ", pixels[i]);
+  }
+  printf("\n");
+  *adler = update_adler32(*adler, pixels, length);
+}
+
 void read_png(const char* filename) {
-  FILE* file = fopen(filename, "rb");
-  if (!file) {
+  converted_row = NULL;
+
+  // Chunk buffers, the scanlines and the window all come from one arena
+  Arena arena;
+  init_arena(&arena, NULL);
+
+  // The file is mapped when possible, so chunks are views into it
+  PngInput input;
+  if (open_png_input_file(&input, filename, &arena) < 0) {
     printf("Could not open file\n");
     return;
   }
 
   // Read and verify PNG signature
-  uint8_t signature[8];
-  fread(signature, 1, 8, file);
-  if (memcmp(signature, png_signature, 8) != 0) {
-    printf("Not a PNG file\n");
-    fclose(file);
+  if (read_png_signature(&input) < 0) {
+    close_png_input(&input);
     return;
   }
 
-  BitStream output;
+  // Rows are decoded and printed as the IDAT chunks arrive, without
+  // holding the whole image in memory
+  PngDecoder decoder;
+  int decoder_ready = 0;
+  uint32_t pixels_adler = 1;
+
+  // The image data may be split across any number of consecutive IDAT chunks
+  int idat_state = 0; // 0 before the IDAT chunks, 1 within them, 2 after them
+
+  // With restart points or speculation the IDAT data is collected and decoded in parallel
+  RestartPoints restart = { 0 };
+  uint8_t* idat = NULL; // In the arena
+  size_t idat_length = 0;
+  size_t idat_capacity = 0;
 
   fprintf(stdout, "PNG file\n");
 
   // Start reading chunks
   int hasMore = 1;
+  png_chunk chunk = { 0 };
+  int chunk_pending = 0; // chunk was already read by the pipeline
   while (hasMore) {
-    png_chunk chunk = { 0 };
-
-    // Read chunk length (4 bytes)
-    fread(&chunk.length, 4, 1, file);
-    chunk.length = __builtin_bswap32(chunk.length); // Convert from big-endian
-
-    // Read chunk type (4 bytes)
-    fread(&chunk.chunk_type, 4, 1, file);
-    
-    // Allocate memory for chunk data
-    chunk.data = (uint8_t*)malloc(chunk.length);
-    
-    if (chunk.length != 0) { // if length is 0, don't do data operations
-      if (chunk.data) {
-        fread(chunk.data, chunk.length, 1, file);
-      }
-      else {
-        printf("Could not allocate memory for chunk\n");
-        free(chunk.data);
-        fclose(file);
-        return;
-      }
-    }
+    long chunk_position = (long)input.position;
 
-    // Read chunk CRC (4 bytes)
-    fread(&chunk.crc, 4, 1, file);
-    chunk.crc = __builtin_bswap32(chunk.crc);
+    // Length, type, data and CRC, with the CRC checked
+    if (chunk_pending) {
+      chunk_pending = 0;
+    }
+    else if (read_png_chunk(&input, &chunk) < 0) {
+      close_png_input(&input);
+      free_arena(&arena);
+      return;
+    }
 
-    fprintf(stdout, 
+    trace_chunk(
       "Type: %c%c%c%c\nData length: %u\nCRC-32: %08X\n", 
-      chunk.chunk_type & 0xFF, 
-      chunk.chunk_type >> 8 & 0xFF, 
-      chunk.chunk_type >> 16 & 0xFF,
-      chunk.chunk_type >> 24 & 0xFF,
+      chunk.chunk_type >> 24 & 0xFF, 
+      chunk.chunk_type >> 16 & 0xFF, 
+      chunk.chunk_type >> 8 & 0xFF,
+      chunk.chunk_type & 0xFF,
       chunk.length,
       chunk.crc
     );
 
-    uint32_t c = chunk_crc((uint8_t*) &chunk.chunk_type, chunk.data, chunk.length);
-
-    if (chunk.crc != c) {
-      fprintf(stderr, "CRC mismatch! %X != %X\n", chunk.crc, c);
-      return;
+    if (idat_state == 1 && chunk.chunk_type != IDAT) {
+      // The first chunk after the IDAT chunks ends the zlib stream
+      Zlib_Stream parallel_info;
+      if (restart.count && png_decode_parallel(&ihdr, idat, idat_length, BITSTREAM_PADDING,
+          &restart, print_row, &pixels_adler, &parallel_info, &arena) == 0) {
+        printf("Decoded %d segments in parallel\n", restart.count + 1);
+        print_stream_info(&parallel_info);
+      }
+      else if (!restart.count && idat && png_decode_speculative(&ihdr, idat, idat_length, BITSTREAM_PADDING,
+          speculative_threads, print_row, &pixels_adler, &parallel_info, &arena) == 0) {
+        printf("Decoded speculatively in parallel\n");
+        print_stream_info(&parallel_info);
+      }
+      else {
+        if (idat) {
+          if (restart.count) {
+            fprintf(stderr, "Parallel decoding failed, decoding serially\n");
+          }
+          png_decode_data(&decoder, idat, idat_length, BITSTREAM_PADDING);
+        }
+        png_decode_finish(&decoder);
+        print_stream_info(&decoder.zlib);
+      }
+      idat = NULL;
+      idat_state = 2;
     }
 
-    // chunk type has to be reversed for comparison, but not for crc check, so I do it here.
-    chunk.chunk_type = __builtin_bswap32(chunk.chunk_type);
     switch (chunk.chunk_type) {
     case IHDR: { // Header chunk
-      memcpy(&ihdr, chunk.data, sizeof(png_IHDR));
-      ihdr.width = __builtin_bswap32(ihdr.width);
-      ihdr.height = __builtin_bswap32(ihdr.height);
+      const uint8_t* data = chunk.data;
+      if (decoder_ready || chunk.length != 13) {
+        fprintf(stderr, "Invalid IHDR chunk\n");
+        close_png_input(&input);
+        free_arena(&arena);
+        return;
+      }
+      png_IHDR header = { read_be32(data), read_be32(data + 4), data[8], data[9], data[10], data[11], data[12] };
+      // Everything below sizes buffers and looks up tables from the header
+      if (check_IHDR(&header) < 0) {
+        close_png_input(&input);
+        free_arena(&arena);
+        return;
+      }
+      ihdr = header;
       print_IHDR(&ihdr);
 
-      extern uint8_t color_channels[];
-      size_t bits_per_pixel = ihdr.bit_depth * color_channels[ihdr.color_type];
-      // ((width * bits per pixel + 1 byte per scanline for filter type) * height) / bits per byte
-      size_t decompressed_bytes_count = ((ihdr.width * bits_per_pixel + 8) * ihdr.height) / 8;
-      uint8_t* buffer = (uint8_t*)malloc(decompressed_bytes_count);
-      if (buffer) {
-        init_bitstream(&output, buffer, decompressed_bytes_count);
+      if (init_png_decoder_arena(&decoder, &ihdr, print_row, &pixels_adler, &arena) == 0) {
+        decoder_ready = 1;
+      }
+      init_png_converter(&converter, &ihdr, output_format);
+      converted_row = NULL;
+      if (output_format != PNG_FORMAT_RAW) {
+        converted_row = (uint8_t*)arena_alloc(&arena, png_converted_row_bytes(&converter, ihdr.width));
       }
 
       break;
     }
     case IDAT: {// Data chunk
       // Process compressed image data here
+#if TRACE_LEVEL >= TRACE_BIT
       print_chunk_data(chunk.data, chunk.length);
-      process_zlib_stream(chunk.data, chunk.length, &output);
-      // TODO reverse filtering
+#endif
+      if (idat_state == 0) {
+        if (!decoder_ready) {
+          fprintf(stderr, "IDAT chunk without image decoder\n");
+          close_png_input(&input);
+          free_arena(&arena);
+          return;
+        }
+        printf("Displaying output rows:\n");
+        idat_state = 1;
+      }
+      else if (idat_state == 2) {
+        fprintf(stderr, "IDAT chunks are not consecutive\n");
+        break;
+      }
+      if (pipelined_decode && idat_state == 1 && !idat && !restart.count && speculative_threads < 2) {
+        // Reads the remaining IDAT chunks and the one after them
+        if (png_decode_pipelined(&decoder, &input, &chunk) < 0) {
+          close_png_input(&input);
+          free_arena(&arena);
+          return;
+        }
+        printf("Decoded in a pipeline\n");
+        print_stream_info(&decoder.zlib);
+        idat_state = 2;
+        chunk_pending = 1;
+        break;
+      }
+      if (!restart.count && (speculative_threads < 2 || ihdr.interlace_method != 0)) {
+        png_decode_data(&decoder, chunk.data, chunk.length, chunk.padding);
+        break;
+      }
+      resolve_restart_points(&restart, chunk_position, idat_length);
+      size_t needed = idat_length + chunk.length + BITSTREAM_PADDING;
+      if (needed > idat_capacity) {
+        // Arena allocations cannot grow, so the data moves to one at least twice the size
+        size_t capacity = needed > 2 * idat_capacity ? needed : 2 * idat_capacity;
+        uint8_t* joined = (uint8_t*)arena_alloc(&arena, capacity);
+        if (!joined) {
+          fprintf(stderr, "Could not allocate memory for IDAT data\n");
+          close_png_input(&input);
+          free_arena(&arena);
+          return;
+        }
+        if (idat_length > 0) {
+          memcpy(joined, idat, idat_length);
+        }
+        idat = joined;
+        idat_capacity = capacity;
+      }
+      memcpy(idat + idat_length, chunk.data, chunk.length);
+      idat_length += chunk.length;
+      memset(idat + idat_length, 0, BITSTREAM_PADDING);
+      break;
+    }
+    case iDOT:
+    case joRP: { // Restart points for parallel decoding
+      if (idat_state != 0 || !decoder_ready || ihdr.interlace_method != 0) {
+        break;
+      }
+      if (chunk.chunk_type == iDOT) {
+        parse_iDOT(&restart, chunk.data, chunk.length, chunk_position, &ihdr);
+      }
+      else {
+        parse_joRP(&restart, chunk.data, chunk.length, &ihdr);
+      }
       break;
     }
     case PLTE: {
       if (chunk.length % 3) {
         fprintf(stderr, "PLTE Palette length not divisible by 3\n");
-        fclose(file);
+        close_png_input(&input);
+        free_arena(&arena);
         return;
       }
+      set_png_palette(&converter, chunk.data, chunk.length);
+      break;
+    }
+    case tRNS: {
+      if (idat_state == 0) {
+        set_png_transparency(&converter, chunk.data, chunk.length);
+      }
       break;
     }
     case gAMA: {
@@ -148,14 +287,16 @@ void read_png(const char* filename) {
       break;
     }
 
-    // Free allocated memory
-    free(chunk.data);
   }
 
-  fclose(file);
+  close_png_input(&input);
 
-  printf("Displaying output buffer ");
-  print_bitstream(&output, ihdr.width * (size_t)color_channels[ihdr.color_type] + 1ULL);
+  if (decoder_ready) {
+    free_png_decoder(&decoder);
+    printf("Adler-32: %08X\n", pixels_adler);
+  }
+  converted_row = NULL;
+  free_arena(&arena);
 }
 
 // Validate crc code
@@ -163,58 +304,45 @@ void crc_test() {
   uint8_t data[3] = {'a', 'b', 'c'};
   uint32_t expected = 0x352441C2;
   uint32_t result = crc(data, sizeof(data));
-  printf("%X == %X: %s", expected, result, result == expected ? "True" : "False");
+  printf("%X == %X: %s\n", expected, result, result == expected ? "True" : "False");
+
+  // Long enough for the wide paths, split at an odd point and joined again
+  uint8_t long_data[1000];
+  for (size_t i = 0; i < sizeof(long_data); i++) {
+    long_data[i] = (uint8_t)(i * 31 + 7);
+  }
+  uint32_t whole = crc(long_data, sizeof(long_data));
+  uint32_t combined = crc32_combine(crc(long_data, 333), crc(long_data + 333, sizeof(long_data) - 333), sizeof(long_data) - 333);
+  printf("%X == %X: %s\n", whole, combined, whole == combined ? "True" : "False");
 }
 
-// Validate huffman tree traversal decoding
-void huffman_tree_test() {
-// Create a simple test tree
+// Validate huffman table decoding
+void huffman_table_test() {
+// Create a simple test code
 //     (*)
 //     / \
 //   (A) (*)
 //       / \
 //     (B) (C)
 
-  HuffmanNode* root = malloc(sizeof(HuffmanNode));
-  HuffmanNode* node1 = malloc(sizeof(HuffmanNode));
-  HuffmanNode* leafA = malloc(sizeof(HuffmanNode));
-  HuffmanNode* leafB = malloc(sizeof(HuffmanNode));
-  HuffmanNode* leafC = malloc(sizeof(HuffmanNode));
+  int lengths['C' + 1] = { 0 };
+  lengths['A'] = 1;
+  lengths['B'] = 2;
+  lengths['C'] = 2;
 
-  if (!root || !node1 || !leafA || !leafB || !leafC) {
+  HuffmanTable debug_table;
+  if (build_huffman_table(&debug_table, lengths, 'C' + 1, 2) < 0) {
     return;
   }
 
-  root->symbol = -1;  // Internal node
-  node1->symbol = -1; // Internal node
-  leafA->symbol = 'A';// Leaf node (A)
-  leafB->symbol = 'B';// Leaf node (B)
-  leafC->symbol = 'C';// Leaf node (C)
-
-  root->is_leaf = 0;
-  node1->is_leaf = 0;
-  leafA->is_leaf = 1;
-  leafB->is_leaf = 1;
-  leafC->is_leaf = 1;
-
-  // Set up tree structure
-  root->left = leafA;
-  root->right = node1;
-  node1->left = leafB;
-  node1->right = leafC;
-
-  HuffmanTree debug_tree;
-  debug_tree.root = root;
-  debug_tree.num_symbols = 3;
-
   const uint8_t input_data[] = { 0b11010U }; // Example: A (0), B (10), C (11)
 
   BitStream stream;
   init_bitstream(&stream, input_data, 1);
 
   // Decode symbols from the stream
-  for (int i = 0; i < debug_tree.num_symbols; ++i) {
-    int symbol = decode_huffman_symbol(&debug_tree, &stream);
+  for (int i = 0; i < 3; ++i) {
+    int symbol = decode_huffman_symbol(&debug_table, &stream);
     if (symbol != -1) {
       printf("Decoded symbol: %c\n", symbol);
     }
@@ -222,20 +350,21 @@ void huffman_tree_test() {
       printf("Failed to decode symbol\n");
     }
   }
-
-  // Cleanup tree (free memory)
-  free(leafC);
-  free(leafB);
-  free(node1);
-  free(leafA);
-  free(root);
 }
 
 int main() {
   //read_png("0088FF.png");
   //crc_test();
-  //huffman_tree_test();
+  //huffman_table_test();
   test_inflate();
+  test_deflate();
+  test_decode();
+  test_crc();
+  test_adler();
+  test_unfilter();
+  test_arena();
+  test_convert();
+  test_packed_convert();
   // TODO extract test functions to own files
   return 0;
 }
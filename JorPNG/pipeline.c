@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+// IDAT chunk from stage 1. Stream input reuses its buffer for the next chunk,
+// so those chunks are copied; views of mapped and in-memory input are not.
+typedef struct pipeline_chunk_struct {
+  uint8_t* data;
+  size_t length;
+  size_t padding;
+  int last;         // No chunk follows, the zlib stream ends
+  uint8_t* copy;    // Stream data, kept from chunk to chunk in this slot
+  size_t capacity;
+} PipelineChunk;
+
+// Inflated data from stage 2
+typedef struct pipeline_span_struct {
+  size_t length;
+  int last;         // No span follows
+  uint8_t data[PIPELINE_SPAN_SIZE];
+} PipelineSpan;
+
+typedef struct pipeline_struct {
+  PngDecoder* decoder;
+  AtomicCounter failed; // Set by the stage that failed, the others stop at their next wait
+  AtomicCounter stopped; // Set by stage 3 once the decoder has all rows it wants
+  SpscRing chunk_ring;
+  PipelineChunk chunks[PIPELINE_CHUNKS];
+  SpscRing span_ring;
+  PipelineSpan* spans;
+  PipelineSpan* filling; // Span stage 2 is writing, not yet published
+  Mutex mutex;           // Held by a stage from counting itself a sleeper until it sleeps
+  Condition changed;     // Signalled when a ring changes or the pipeline fails
+  AtomicCounter sleepers; // Stages sleeping or about to sleep on changed
+} Pipeline;
+
+// Wake the stages sleeping in wait_for_change after a ring changed. Without
+// sleepers no lock is taken. The fence pairs with the one of the sleeper:
+// either it sees the change, or this sees it counted and the mutex makes the
+// wake-up come after it is asleep.
+static void wake_stages(Pipeline* pipeline) {
+  full_fence();
+  if (load_acquire(&pipeline->sleepers) != 0) {
+    lock_mutex(&pipeline->mutex);
+    wake_all_condition(&pipeline->changed);
+    unlock_mutex(&pipeline->mutex);
+  }
+}
+
+static void fail_pipeline(Pipeline* pipeline) {
+  store_release(&pipeline->failed, 1);
+  wake_stages(pipeline);
+}
+
+// Producer side: whether the ring has a free slot after head
+static int slot_free(SpscRing* ring, uint32_t head) {
+  return head - load_acquire(&ring->tail) < ring->size;
+}
+
+// Consumer side: whether the ring has a published slot at tail
+static int slot_published(SpscRing* ring, uint32_t tail) {
+  return load_acquire(&ring->head) != tail;
+}
+
+// Wait until ready(ring, count) or the pipeline failed. Stalls are mostly
+// short, so the stage yields for a while before going to sleep.
+static void wait_for_change(Pipeline* pipeline, SpscRing* ring, uint32_t count, int (*ready)(SpscRing*, uint32_t)) {
+  for (int spin = 0; spin < PIPELINE_SPINS; spin++) {
+    if (ready(ring, count) || load_acquire(&pipeline->failed)) {
+      return;
+    }
+    yield_thread();
+  }
+  lock_mutex(&pipeline->mutex);
+  add_counter(&pipeline->sleepers, 1);
+  full_fence();
+  while (!ready(ring, count) && !load_acquire(&pipeline->failed)) {
+    wait_condition(&pipeline->changed, &pipeline->mutex);
+  }
+  add_counter(&pipeline->sleepers, -1);
+  unlock_mutex(&pipeline->mutex);
+}
+
+// Producer side: the next free slot, waiting while the ring is full.
+// -1 once the pipeline failed.
+static int reserve_slot(Pipeline* pipeline, SpscRing* ring) {
+  uint32_t head = ring->head;
+  wait_for_change(pipeline, ring, head, slot_free);
+  return load_acquire(&pipeline->failed) ? -1 : (int)(head % ring->size);
+}
+
+static void publish_slot(Pipeline* pipeline, SpscRing* ring) {
+  store_release(&ring->head, ring->head + 1);
+  wake_stages(pipeline);
+}
+
+// Consumer side: the oldest published slot, waiting while the ring is empty.
+// -1 once the pipeline failed.
+static int take_slot(Pipeline* pipeline, SpscRing* ring) {
+  uint32_t tail = ring->tail;
+  wait_for_change(pipeline, ring, tail, slot_published);
+  return load_acquire(&pipeline->failed) ? -1 : (int)(tail % ring->size);
+}
+
+static void release_slot(Pipeline* pipeline, SpscRing* ring) {
+  store_release(&ring->tail, ring->tail + 1);
+  wake_stages(pipeline);
+}
+
+// Window sink of stage 2, copying the inflated data into spans for stage 3
+static void pipeline_sink(void* context, const uint8_t* data, size_t length) {
+  Pipeline* pipeline = (Pipeline*)context;
+  if (load_acquire(&pipeline->stopped)) {
+    // Ends the inflate, which then only drains the remaining chunks
+    pipeline->decoder->zlib.window.stopped = 1;
+    return;
+  }
+  while (length > 0) {
+    if (!pipeline->filling) {
+      int slot = reserve_slot(pipeline, &pipeline->span_ring);
+      if (slot < 0) {
+        return;
+      }
+      pipeline->filling = &pipeline->spans[slot];
+      pipeline->filling->length = 0;
+      pipeline->filling->last = 0;
+    }
+
+    PipelineSpan* span = pipeline->filling;
+    size_t count = PIPELINE_SPAN_SIZE - span->length;
+    count = count < length ? count : length;
+    memcpy(span->data + span->length, data, count);
+    span->length += count;
+    data += count;
+    length -= count;
+
+    if (span->length == PIPELINE_SPAN_SIZE) {
+      pipeline->filling = NULL;
+      publish_slot(pipeline, &pipeline->span_ring);
+    }
+  }
+}
+
+// Stage 2: inflate the chunks. The zlib stream checks the Adler-32.
+static void run_inflate_stage(void* argument) {
+  Pipeline* pipeline = (Pipeline*)argument;
+  Zlib_Stream* zlib = &pipeline->decoder->zlib;
+  while (1) {
+    int slot = take_slot(pipeline, &pipeline->chunk_ring);
+    if (slot < 0) {
+      return;
+    }
+    if (load_acquire(&pipeline->stopped)) {
+      zlib->window.stopped = 1;
+    }
+    PipelineChunk* chunk = &pipeline->chunks[slot];
+    if (chunk->last) {
+      release_slot(pipeline, &pipeline->chunk_ring);
+      break;
+    }
+    int result = feed_zlib_stream(zlib, chunk->data, chunk->length, chunk->padding);
+    release_slot(pipeline, &pipeline->chunk_ring);
+    if (result == INFLATE_FAILED) {
+      fail_pipeline(pipeline);
+      return;
+    }
+  }
+
+  // Stage 1 stops reading once stage 3 stopped, so the stream may be cut short
+  if (!load_acquire(&pipeline->stopped) && finish_zlib_stream(zlib) == INFLATE_FAILED) {
+    fail_pipeline(pipeline);
+    return;
+  }
+
+  // Publish the partly filled span, marked as the last one
+  if (!pipeline->filling) {
+    int slot = reserve_slot(pipeline, &pipeline->span_ring);
+    if (slot < 0) {
+      return;
+    }
+    pipeline->filling = &pipeline->spans[slot];
+    pipeline->filling->length = 0;
+  }
+  pipeline->filling->last = 1;
+  pipeline->filling = NULL;
+  publish_slot(pipeline, &pipeline->span_ring);
+}
+
+// Stage 3: cut the spans into scanlines, unfilter them and hand out the rows
+static void run_unfilter_stage(void* argument) {
+  Pipeline* pipeline = (Pipeline*)argument;
+  PngDecoder* decoder = pipeline->decoder;
+  while (1) {
+    int slot = take_slot(pipeline, &pipeline->span_ring);
+    if (slot < 0) {
+      return;
+    }
+    PipelineSpan* span = &pipeline->spans[slot];
+    int last = span->last;
+    if (png_decode_inflated(decoder, span->data, span->length) < 0) {
+      fail_pipeline(pipeline);
+      return;
+    }
+    if (decoder->stopped) {
+      store_release(&pipeline->stopped, 1);
+    }
+    release_slot(pipeline, &pipeline->span_ring);
+    if (last) {
+      break;
+    }
+  }
+
+  if (png_decode_complete(decoder) < 0) {
+    fail_pipeline(pipeline);
+  }
+}
+
+// Stage 1: read and check the IDAT chunks, from the one in chunk on.
+// This is the only stage using the arena while the others run.
+static void run_read_stage(Pipeline* pipeline, PngInput* input, png_chunk* chunk) {
+  Arena* arena = pipeline->decoder->arena;
+  while (chunk->chunk_type == IDAT && !load_acquire(&pipeline->stopped)) {
+    int slot = reserve_slot(pipeline, &pipeline->chunk_ring);
+    if (slot < 0) {
+      return;
+    }
+    PipelineChunk* entry = &pipeline->chunks[slot];
+    entry->length = chunk->length;
+    entry->padding = chunk->padding;
+    entry->last = 0;
+    if (input->kind == PNG_INPUT_STREAM) {
+      size_t size = chunk->length + chunk->padding;
+      if (entry->capacity < size) {
+        arena_free(arena, entry->copy);
+        entry->copy = (uint8_t*)arena_alloc(arena, size);
+        entry->capacity = entry->copy ? size : 0;
+        if (!entry->copy) {
+          fprintf(stderr, "Failed to allocate IDAT chunk!\n");
+          fail_pipeline(pipeline);
+          return;
+        }
+      }
+      memcpy(entry->copy, chunk->data, size);
+      entry->data = entry->copy;
+    }
+    else {
+      entry->data = chunk->data;
+    }
+    publish_slot(pipeline, &pipeline->chunk_ring);
+
+    if (read_png_chunk(input, chunk) < 0) {
+      fail_pipeline(pipeline);
+      return;
+    }
+  }
+
+  // Marks the end of the chunks, or of those wanted once stage 3 stopped
+  int slot = reserve_slot(pipeline, &pipeline->chunk_ring);
+  if (slot < 0) {
+    return;
+  }
+  pipeline->chunks[slot].last = 1;
+  publish_slot(pipeline, &pipeline->chunk_ring);
+}
+
+// Without threads the same work runs one stage after the other
+static int decode_serially(PngDecoder* decoder, PngInput* input, png_chunk* chunk) {
+  while (chunk->chunk_type == IDAT && !decoder->stopped) {
+    if (png_decode_data(decoder, chunk->data, chunk->length, chunk->padding) == INFLATE_FAILED) {
+      return -1;
+    }
+    if (read_png_chunk(input, chunk) < 0) {
+      return -1;
+    }
+  }
+  if (decoder->stopped) {
+    return 0;
+  }
+  return png_decode_finish(decoder) == INFLATE_FAILED ? -1 : 0;
+}
+
+int png_decode_pipelined(PngDecoder* decoder, PngInput* input, png_chunk* chunk) {
+  if (png_decode_start(decoder) < 0) {
+    return -1;
+  }
+
+  Pipeline pipeline;
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.decoder = decoder;
+  pipeline.chunk_ring.size = PIPELINE_CHUNKS;
+  pipeline.span_ring.size = PIPELINE_SPANS;
+  pipeline.spans = (PipelineSpan*)arena_alloc(decoder->arena, PIPELINE_SPANS * sizeof(PipelineSpan));
+  if (!pipeline.spans) {
+    fprintf(stderr, "Failed to allocate pipeline buffers!\n");
+    return decode_serially(decoder, input, chunk);
+  }
+  init_mutex(&pipeline.mutex);
+  init_condition(&pipeline.changed);
+
+  // The window of stage 2 flushes into the spans instead of the scanlines
+  Window* window = &decoder->zlib.window;
+  window_sink sink = window->sink;
+  void* sink_context = window->sink_context;
+  window->sink = pipeline_sink;
+  window->sink_context = &pipeline;
+
+  Thread inflate_thread;
+  Thread unfilter_thread;
+  int inflating = create_thread(&inflate_thread, run_inflate_stage, &pipeline) == 0;
+  int unfiltering = inflating && create_thread(&unfilter_thread, run_unfilter_stage, &pipeline) == 0;
+  if (unfiltering) {
+    run_read_stage(&pipeline, input, chunk);
+  }
+  else {
+    // Nothing has been read yet, so the stages can still run serially
+    fail_pipeline(&pipeline);
+  }
+  if (inflating) {
+    join_thread(&inflate_thread);
+  }
+  if (unfiltering) {
+    join_thread(&unfilter_thread);
+  }
+
+  window->sink = sink;
+  window->sink_context = sink_context;
+  for (int i = 0; i < PIPELINE_CHUNKS; i++) {
+    arena_free(decoder->arena, pipeline.chunks[i].copy);
+  }
+  arena_free(decoder->arena, pipeline.spans);
+  free_condition(&pipeline.changed);
+  free_mutex(&pipeline.mutex);
+
+  if (!unfiltering) {
+    return decode_serially(decoder, input, chunk);
+  }
+  return load_acquire(&pipeline.failed) ? -1 : 0;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chunk.h"
+#include "png.h"
+#include "input.h"
+#include "thread.h"
+
+// Pipelined decode of one large image on three threads:
+//   1. the calling thread reads the IDAT chunks and checks their CRCs,
+//   2. a thread inflates them,
+//   3. a thread cuts the inflated data into scanlines, unfilters them and
+//      hands the rows to the callback.
+// The stages pass their work on through bounded lock-free rings, so they run
+// at the same time and the decode takes about as long as the slowest stage.
+// A stage waiting on a full or empty ring yields for a while, then sleeps;
+// only then, and to wake it, is a lock taken.
+
+#define PIPELINE_CHUNKS 8            // IDAT chunks read ahead of the inflate, a power of two
+#define PIPELINE_SPANS 16            // Inflated spans ahead of the unfilter, a power of two
+#define PIPELINE_SPAN_SIZE (1 << 15)
+#define PIPELINE_SPINS 100           // Yields of a waiting stage before it sleeps until woken
+
+// Ring of slots shared by one producer and one consumer. head counts the
+// slots published and is only written by the producer, tail the slots
+// released and is only written by the consumer. Slot of count n is n % size.
+typedef struct spsc_ring_struct {
+  AtomicCounter head;
+  AtomicCounter tail;
+  uint32_t size;
+} SpscRing;
+
+// chunk is the first IDAT chunk, already read. The decoder must be set up
+// for the image and have seen no data yet. Reads the chunks up to the end of
+// the IDAT chunks and decodes them completely, rows reaching the callback on
+// the third thread. On success chunk is the first chunk after the IDAT
+// chunks, already read, unless the decoder stopped early (see
+// set_png_row_limit); then the remaining chunks are not read.
+int png_decode_pipelined(PngDecoder* decoder, PngInput* input, png_chunk* chunk);
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "png.h"
+#include "unfilter.h"
+#include "adam7.h"
+
+// Set up the first pass from pass on that has pixels
+static void start_pass(PngDecoder* decoder, int pass) {
+  const png_IHDR* ihdr = &decoder->ihdr;
+  for (; pass < decoder->passes; pass++) {
+    uint32_t width = ihdr->width;
+    uint32_t height = ihdr->height;
+    if (ihdr->interlace_method != 0) {
+      width = adam7_pass_width(pass, ihdr->width);
+      height = adam7_pass_height(pass, ihdr->height);
+    }
+    if (width > 0 && height > 0) {
+      decoder->pass_height = height;
+      decoder->pass_row_bytes = png_row_bytes(ihdr, width);
+      break;
+    }
+  }
+  decoder->pass = pass;
+  decoder->y = 0;
+}
+
+// Hand the finished rows of the deinterlaced image before row end to the
+// callback, none past the row limit
+static void emit_rows(PngDecoder* decoder, uint32_t end) {
+  if (decoder->row_limit && end > decoder->row_limit) {
+    end = decoder->row_limit;
+  }
+  for (; decoder->emitted < end; decoder->emitted++) {
+    decoder->callback(decoder->context, decoder->emitted, decoder->image + (size_t)decoder->emitted * decoder->row_bytes, decoder->row_bytes);
+  }
+}
+
+// Deliver an unfiltered scanline of the current pass
+static void finish_row(PngDecoder* decoder, const uint8_t* pixels) {
+  if (decoder->ihdr.interlace_method == 0) {
+    decoder->callback(decoder->context, decoder->y, pixels, decoder->pass_row_bytes);
+  }
+  else if (decoder->pass_callback) {
+    decoder->pass_callback(decoder->context, decoder->pass, decoder->y, pixels, decoder->pass_row_bytes);
+  }
+  else {
+    adam7_scatter_row(decoder->image, &decoder->ihdr, decoder->pass, decoder->y, pixels);
+    if (decoder->pass == decoder->last_pass) {
+      // All other passes are done, so every image row up to this one is complete
+      const Adam7Pass* p = &adam7_passes[decoder->pass];
+      emit_rows(decoder, p->y0 + decoder->y * p->dy + 1);
+    }
+  }
+}
+
+static void png_row_sink(void* context, const uint8_t* data, size_t length);
+
+// Everything wanted is decoded. When the decoder inflates itself, the window
+// stops the inflate; the pipeline checks stopped between spans instead.
+static void stop_png_decoder(PngDecoder* decoder) {
+  decoder->stopped = 1;
+  if (decoder->zlib.window.sink == png_row_sink) {
+    decoder->zlib.window.stopped = 1;
+  }
+}
+
+// Image rows handed to the row callback so far
+static uint32_t rows_emitted(const PngDecoder* decoder) {
+  if (decoder->image) {
+    return decoder->emitted;
+  }
+  if (decoder->ihdr.interlace_method != 0) {
+    return 0; // Passes go to the pass callback
+  }
+  return decoder->pass >= decoder->passes ? decoder->ihdr.height : decoder->y;
+}
+
+// Window sink that cuts the inflated data into scanlines
+static void png_row_sink(void* context, const uint8_t* data, size_t length) {
+  PngDecoder* decoder = (PngDecoder*)context;
+
+  while (length > 0 && !decoder->error) {
+    if (decoder->stopped) {
+      return; // Data of rows that are not wanted
+    }
+    if (decoder->pass >= decoder->passes) {
+      fprintf(stderr, "Error: Image data past the last scanline\n");
+      decoder->error = 1;
+      return;
+    }
+
+    size_t scanline = decoder->pass_row_bytes + 1;
+    size_t count = scanline - decoder->row_filled;
+    count = count < length ? count : length;
+    memcpy(decoder->row + decoder->row_filled, data, count);
+    decoder->row_filled += count;
+    data += count;
+    length -= count;
+
+    if (decoder->row_filled < scanline) {
+      return;
+    }
+
+    // Scanline complete, unfilter it against the previous one of its pass and hand it out
+    const uint8_t* prior = decoder->y > 0 ? decoder->prior + 1 : NULL;
+    if (unfilter_row(decoder->row[0], decoder->row + 1, prior, decoder->pass_row_bytes, decoder->bpp) < 0) {
+      decoder->error = 1;
+      return;
+    }
+    finish_row(decoder, decoder->row + 1);
+
+    uint8_t* swap = decoder->prior;
+    decoder->prior = decoder->row;
+    decoder->row = swap;
+    decoder->row_filled = 0;
+    if (++decoder->y == decoder->pass_height) {
+      start_pass(decoder, decoder->pass + 1);
+      if (decoder->pass >= decoder->passes && decoder->image) {
+        emit_rows(decoder, decoder->ihdr.height);
+      }
+      if (decoder->pass >= decoder->passes && decoder->limited) {
+        stop_png_decoder(decoder);
+        return;
+      }
+    }
+    if (decoder->row_limit && rows_emitted(decoder) >= decoder->row_limit) {
+      stop_png_decoder(decoder);
+      return;
+    }
+  }
+}
+
+// Decode passes 0 to passes - 1 and find the last of them that has pixels
+static void set_passes(PngDecoder* decoder, int passes) {
+  const png_IHDR* ihdr = &decoder->ihdr;
+  decoder->passes = passes;
+  decoder->last_pass = 0;
+  for (int pass = 0; pass < decoder->passes; pass++) {
+    if (ihdr->interlace_method == 0 ||
+        (adam7_pass_width(pass, ihdr->width) > 0 && adam7_pass_height(pass, ihdr->height) > 0)) {
+      decoder->last_pass = pass;
+    }
+  }
+  start_pass(decoder, 0);
+}
+
+int init_png_decoder(PngDecoder* decoder, const png_IHDR* ihdr, png_row_callback callback, void* context) {
+  return init_png_decoder_arena(decoder, ihdr, callback, context, NULL);
+}
+
+// Decoder whose buffers all come from arena. They are released with the
+// arena, so reset the arena and init again for the next image rather than
+// calling reset_png_decoder.
+int init_png_decoder_arena(PngDecoder* decoder, const png_IHDR* ihdr, png_row_callback callback, void* context, Arena* arena) {
+  memset(decoder, 0, sizeof(*decoder));
+  decoder->arena = arena;
+  if (reset_png_decoder(decoder, ihdr, callback, context) < 0) {
+    free_png_decoder(decoder);
+    return -1;
+  }
+  return 0;
+}
+
+// Set up a decoder from init_png_decoder for the next image. The scanline
+// buffer is kept when it is large enough and the window is always kept, so
+// decoding a series of images does not allocate for every one.
+int reset_png_decoder(PngDecoder* decoder, const png_IHDR* ihdr, png_row_callback callback, void* context) {
+  arena_free(decoder->arena, decoder->image);
+  decoder->image = NULL;
+  decoder->emitted = 0;
+  decoder->ihdr = *ihdr;
+  decoder->callback = callback;
+  decoder->pass_callback = NULL;
+  decoder->context = context;
+  decoder->row_bytes = png_row_bytes(ihdr, ihdr->width);
+  decoder->bpp = png_bytes_per_pixel(ihdr);
+  decoder->row_filled = 0;
+  decoder->error = 0;
+  decoder->limited = 0;
+  decoder->row_limit = 0;
+  decoder->stopped = 0;
+  set_passes(decoder, ihdr->interlace_method != 0 ? ADAM7_PASSES : 1);
+
+  // Pass scanlines are never longer than image scanlines
+  size_t rows_size = 2 * (decoder->row_bytes + 1);
+  if (rows_size > decoder->rows_size) {
+    uint8_t* rows = decoder->arena ? (uint8_t*)arena_alloc(decoder->arena, rows_size) : (uint8_t*)realloc(decoder->rows, rows_size);
+    if (!rows) {
+      fprintf(stderr, "Failed to allocate scanlines!\n");
+      return -1;
+    }
+    decoder->rows = rows;
+    decoder->rows_size = rows_size;
+  }
+  decoder->row = decoder->rows;
+  decoder->prior = decoder->rows + decoder->row_bytes + 1;
+
+  if (decoder->zlib.window.window) {
+    reset_zlib_stream_sink(&decoder->zlib, png_row_sink, decoder, ZLIB_VERIFY);
+    return 0;
+  }
+  return init_zlib_stream_arena(&decoder->zlib, png_row_sink, decoder, ZLIB_VERIFY, decoder->arena);
+}
+
+// Take the passes of an interlaced image as they are decoded instead of the
+// deinterlaced rows. Set before the first png_decode_data.
+void set_png_pass_callback(PngDecoder* decoder, png_pass_callback callback) {
+  decoder->pass_callback = callback;
+}
+
+// Decode only the Adam7 passes up to pass (0-6), for the reduced images they
+// form, and stop inflating once it is done. Needs set_png_pass_callback, as
+// the deinterlaced image is never complete. Set before the first data.
+void set_png_last_pass(PngDecoder* decoder, int pass) {
+  if (decoder->ihdr.interlace_method == 0 || pass + 1 >= ADAM7_PASSES) {
+    return;
+  }
+  set_passes(decoder, pass + 1);
+  decoder->limited = 1;
+}
+
+// Stop inflating once image rows 0 to rows - 1 have reached the row
+// callback, for callers that want no more of the image. The remaining data
+// and the Adler-32 are skipped. Set before the first data.
+void set_png_row_limit(PngDecoder* decoder, uint32_t rows) {
+  decoder->row_limit = rows < decoder->ihdr.height ? rows : 0;
+}
+
+// Allocate what the decoder needs before the first data. png_decode_data
+// calls this itself.
+int png_decode_start(PngDecoder* decoder) {
+  if (decoder->error) {
+    return INFLATE_FAILED;
+  }
+  if (decoder->ihdr.interlace_method != 0 && !decoder->pass_callback && !decoder->image) {
+    // Passes are scattered over the whole image, so rows are only complete in the last pass
+    decoder->image = (uint8_t*)arena_calloc(decoder->arena, decoder->ihdr.height, decoder->row_bytes);
+    if (!decoder->image) {
+      fprintf(stderr, "Failed to allocate the deinterlaced image!\n");
+      decoder->error = 1;
+      return INFLATE_FAILED;
+    }
+  }
+  return 0;
+}
+
+// Decode the data of the next IDAT chunk. Finished rows reach the callback
+// before this returns.
+int png_decode_data(PngDecoder* decoder, uint8_t* data, size_t length, size_t padding) {
+  if (png_decode_start(decoder) < 0) {
+    return INFLATE_FAILED;
+  }
+  int result = feed_zlib_stream(&decoder->zlib, data, length, padding);
+  return decoder->error ? INFLATE_FAILED : result;
+}
+
+// Scanlines from data the caller inflated itself, for decoders whose zlib
+// stream runs on another thread (see pipeline.c). Needs png_decode_start.
+int png_decode_inflated(PngDecoder* decoder, const uint8_t* data, size_t length) {
+  png_row_sink(decoder, data, length);
+  return decoder->error ? INFLATE_FAILED : 0;
+}
+
+// Check that the inflated data held every scanline
+int png_decode_complete(PngDecoder* decoder) {
+  if (decoder->error) {
+    return INFLATE_FAILED;
+  }
+  if (decoder->stopped) {
+    return 0; // Every wanted row is done
+  }
+  if (decoder->pass < decoder->passes) {
+    fprintf(stderr, "Error: Image data ends in pass %d after %u of %u scanlines\n", decoder->pass + 1, decoder->y, decoder->pass_height);
+    decoder->error = 1;
+    return INFLATE_FAILED;
+  }
+  return 0;
+}
+
+// Call after the last IDAT chunk
+int png_decode_finish(PngDecoder* decoder) {
+  if (decoder->error) {
+    return INFLATE_FAILED;
+  }
+  int result = finish_zlib_stream(&decoder->zlib);
+  if (result == INFLATE_FINISHED && png_decode_complete(decoder) < 0) {
+    return INFLATE_FAILED;
+  }
+  return decoder->error ? INFLATE_FAILED : result;
+}
+
+void free_png_decoder(PngDecoder* decoder) {
+  free_zlib_stream(&decoder->zlib);
+  arena_free(decoder->arena, decoder->rows);
+  decoder->rows = NULL;
+  decoder->rows_size = 0;
+  arena_free(decoder->arena, decoder->image);
+  decoder->image = NULL;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chunk.h"
+#include "zlib.h"
+
+// Receives each finished scanline of pixels, top to bottom. The pixels are
+// only valid during the call.
+typedef void (*png_row_callback)(void* context, uint32_t y, const uint8_t* pixels, size_t length);
+
+// Receives each unfiltered scanline of an Adam7 pass (0-6 for passes 1-7),
+// for callers that only need the reduced images of the first passes
+typedef void (*png_pass_callback)(void* context, int pass, uint32_t y, const uint8_t* pixels, size_t length);
+
+// Streaming image decoder. IDAT data is inflated through a ring window of
+// RING_WINDOW_SIZE (64K) plus MATCH_SLACK bytes, cut into scanlines and
+// unfiltered one row at a time, so memory use is the window plus two
+// scanlines no matter how large the image is. The window is twice the 32K
+// deflate needs so that most matches do not wrap and are copied in wide
+// chunks (see window.h), at the cost of 32K more than the smallest decoder.
+// Interlaced images are deinterlaced into a full image buffer, unless the
+// passes are taken directly with set_png_pass_callback.
+typedef struct png_decoder_struct {
+  png_IHDR ihdr;
+  size_t row_bytes;  // Scanline length of the image without the filter type byte
+  size_t bpp;        // Bytes per pixel for the filters
+  uint8_t* rows;     // Two scanlines of 1 + row_bytes, the current and the prior one
+  size_t rows_size;  // Allocated size of rows, kept by reset_png_decoder
+  uint8_t* row;      // Scanline being assembled
+  uint8_t* prior;    // Previous scanline, already unfiltered
+  size_t row_filled; // Bytes of the current scanline received so far
+  int error;
+
+  // Current pass. Images without interlacing are a single pass over all pixels.
+  int pass;
+  int passes;
+  int last_pass;          // Last pass that has pixels
+  uint32_t pass_height;
+  size_t pass_row_bytes;
+  uint32_t y;             // Rows of the pass finished
+  int limited;            // Only the passes up to passes are wanted, see set_png_last_pass
+  uint32_t row_limit;     // Image rows wanted, 0 for all, see set_png_row_limit
+  int stopped;            // All wanted rows are done, the rest of the data is not inflated
+
+  uint8_t* image;         // Deinterlaced image, height rows of row_bytes
+  uint32_t emitted;       // Rows of image handed to the row callback
+
+  png_row_callback callback;
+  png_pass_callback pass_callback;
+  void* context;
+  Arena* arena;      // Source of the buffers above and the window, NULL for the heap
+  Zlib_Stream zlib;
+} PngDecoder;
+
+int init_png_decoder(PngDecoder* decoder, const png_IHDR* ihdr, png_row_callback callback, void* context);
+int init_png_decoder_arena(PngDecoder* decoder, const png_IHDR* ihdr, png_row_callback callback, void* context, Arena* arena);
+int reset_png_decoder(PngDecoder* decoder, const png_IHDR* ihdr, png_row_callback callback, void* context);
+void set_png_pass_callback(PngDecoder* decoder, png_pass_callback callback);
+void set_png_last_pass(PngDecoder* decoder, int pass);
+void set_png_row_limit(PngDecoder* decoder, uint32_t rows);
+int png_decode_start(PngDecoder* decoder);
+int png_decode_data(PngDecoder* decoder, uint8_t* data, size_t length, size_t padding);
+int png_decode_inflated(PngDecoder* decoder, const uint8_t* data, size_t length);
+int png_decode_complete(PngDecoder* decoder);
+int png_decode_finish(PngDecoder* decoder);
+void free_png_decoder(PngDecoder* decoder);
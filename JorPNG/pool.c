@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+// Take the next task of a queue, 0 when it is empty
+static int take_task(PoolQueue* queue, size_t* task) {
+  int taken = 0;
+  lock_mutex(&queue->lock);
+  if (queue->head < queue->tail) {
+    *task = queue->tasks[queue->head++];
+    taken = 1;
+  }
+  unlock_mutex(&queue->lock);
+  return taken;
+}
+
+// Run the own queue dry, then steal from the others until all are empty.
+// No tasks are added once the pool runs, so empty queues stay empty.
+static void run_worker(void* argument) {
+  PoolWorker* worker = (PoolWorker*)argument;
+  ThreadPool* pool = worker->pool;
+  size_t task;
+  for (int i = 0; i < pool->workers; i++) {
+    PoolQueue* queue = &pool->queues[(worker->index + i) % pool->workers];
+    while (take_task(queue, &task)) {
+      pool->function(pool->context, task, worker->index);
+    }
+  }
+}
+
+int start_thread_pool(ThreadPool* pool, int workers, const size_t* order, size_t count, pool_task function, void* context) {
+  if (workers < 1) {
+    workers = 1;
+  }
+  if ((size_t)workers > count && count > 0) {
+    workers = (int)count;
+  }
+  pool->workers = workers;
+  pool->function = function;
+  pool->context = context;
+  pool->queues = (PoolQueue*)calloc(workers, sizeof(PoolQueue));
+  pool->threads = (PoolWorker*)calloc(workers, sizeof(PoolWorker));
+  pool->tasks = (size_t*)malloc((count > 0 ? count : 1) * sizeof(size_t));
+  if (!pool->queues || !pool->threads || !pool->tasks) {
+    fprintf(stderr, "Failed to allocate the thread pool!\n");
+    free(pool->queues);
+    free(pool->threads);
+    free(pool->tasks);
+    pool->queues = NULL;
+    pool->threads = NULL;
+    pool->tasks = NULL;
+    return -1;
+  }
+
+  // Queue w holds tasks w, w + workers, ... of the order, stored contiguously
+  size_t next = 0;
+  for (int w = 0; w < workers; w++) {
+    PoolQueue* queue = &pool->queues[w];
+    init_mutex(&queue->lock);
+    queue->tasks = pool->tasks + next;
+    queue->head = 0;
+    for (size_t i = w; i < count; i += workers) {
+      queue->tasks[queue->tail++] = order ? order[i] : i;
+    }
+    next += queue->tail;
+  }
+
+  for (int w = 0; w < workers; w++) {
+    pool->threads[w].pool = pool;
+    pool->threads[w].index = w;
+    pool->threads[w].started = create_thread(&pool->threads[w].thread, run_worker, &pool->threads[w]) == 0;
+  }
+  return 0;
+}
+
+// Wait for all tasks. Workers whose thread could not be created run here.
+void wait_thread_pool(ThreadPool* pool) {
+  if (!pool->queues) {
+    return;
+  }
+  for (int w = 0; w < pool->workers; w++) {
+    if (!pool->threads[w].started) {
+      run_worker(&pool->threads[w]);
+    }
+  }
+  for (int w = 0; w < pool->workers; w++) {
+    if (pool->threads[w].started) {
+      join_thread(&pool->threads[w].thread);
+    }
+  }
+  // Workers steal from every queue, so the locks go once all have finished
+  for (int w = 0; w < pool->workers; w++) {
+    free_mutex(&pool->queues[w].lock);
+  }
+  free(pool->queues);
+  free(pool->threads);
+  free(pool->tasks);
+  pool->queues = NULL;
+  pool->threads = NULL;
+  pool->tasks = NULL;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "thread.h"
+
+// Work-stealing thread pool for a fixed set of independent tasks. The tasks
+// are dealt round-robin to one queue per worker in the order given, so the
+// most expensive tasks should come first. Each worker takes tasks from the
+// front of its own queue, and once that is empty, from the front of the
+// others', so one long task never holds up the short ones queued behind it.
+
+// Runs task number task on worker number worker (0 to workers - 1). The
+// worker number selects per-worker state, no two tasks share it at once.
+typedef void (*pool_task)(void* context, size_t task, int worker);
+
+typedef struct pool_queue_struct {
+  Mutex lock;
+  size_t* tasks;
+  size_t head; // Next task to take
+  size_t tail;
+} PoolQueue;
+
+typedef struct pool_worker_struct {
+  struct thread_pool_struct* pool;
+  int index;
+  Thread thread;
+  int started;
+} PoolWorker;
+
+typedef struct thread_pool_struct {
+  int workers;
+  PoolQueue* queues;
+  PoolWorker* threads;
+  size_t* tasks;
+  pool_task function;
+  void* context;
+} ThreadPool;
+
+// Start running count tasks in the order given (NULL for 0 to count - 1).
+// Returns before the tasks are done, wait_thread_pool waits for them.
+int start_thread_pool(ThreadPool* pool, int workers, const size_t* order, size_t count, pool_task function, void* context);
+void wait_thread_pool(ThreadPool* pool);
@@ -0,0 +1,111 @@
+#include <string.h>
+
+#include "probe.h"
+
+// Take the metadata chunks that have their expected length, ignore the rest
+static void read_metadata(const png_chunk* chunk, PngInfo* info) {
+  const uint8_t* data = chunk->data;
+  switch (chunk->chunk_type) {
+  case pHYs:
+    if (chunk->length == 9) {
+      info->phys.ppuX = read_be32(data);
+      info->phys.ppuY = read_be32(data + 4);
+      info->phys.unit = data[8];
+      info->has_pHYs = 1;
+    }
+    break;
+  case gAMA:
+    if (chunk->length == 4) {
+      info->gama.gamma = read_be32(data);
+      info->has_gAMA = 1;
+    }
+    break;
+  case sRGB:
+    if (chunk->length == 1) {
+      info->srgb.rendering_intent = data[0];
+      info->has_sRGB = 1;
+    }
+    break;
+  case cHRM:
+    if (chunk->length == 32) {
+      info->chrm.white_pointX = read_be32(data);
+      info->chrm.white_pointY = read_be32(data + 4);
+      info->chrm.redX = read_be32(data + 8);
+      info->chrm.redY = read_be32(data + 12);
+      info->chrm.greenX = read_be32(data + 16);
+      info->chrm.greenY = read_be32(data + 20);
+      info->chrm.blueX = read_be32(data + 24);
+      info->chrm.blueY = read_be32(data + 28);
+      info->has_cHRM = 1;
+    }
+    break;
+  }
+}
+
+int png_probe(PngInput* input, PngInfo* info, int flags) {
+  memset(info, 0, sizeof(*info));
+  if (read_png_signature(input) < 0) {
+    return -1;
+  }
+
+  png_chunk chunk;
+  if (read_png_chunk_header(input, &chunk) < 0) {
+    return -1;
+  }
+  if (chunk.chunk_type != IHDR || chunk.length != 13) {
+    fprintf(stderr, "Missing IHDR chunk\n");
+    return -1;
+  }
+  if (read_png_chunk_data(input, &chunk) < 0) {
+    return -1;
+  }
+  const uint8_t* data = chunk.data;
+  png_IHDR ihdr = { read_be32(data), read_be32(data + 4), data[8], data[9], data[10], data[11], data[12] };
+  if (check_IHDR(&ihdr) < 0) {
+    return -1;
+  }
+  info->ihdr = ihdr;
+
+  if (!(flags & PNG_PROBE_METADATA)) {
+    return 0;
+  }
+  while (1) {
+    if (read_png_chunk_header(input, &chunk) < 0) {
+      return -1;
+    }
+    if (chunk.chunk_type == IDAT || chunk.chunk_type == IEND) {
+      return 0;
+    }
+    int wanted = chunk.chunk_type == pHYs || chunk.chunk_type == gAMA ||
+                 chunk.chunk_type == sRGB || chunk.chunk_type == cHRM;
+    if (wanted) {
+      if (read_png_chunk_data(input, &chunk) < 0) {
+        return -1;
+      }
+      read_metadata(&chunk, info);
+    }
+    else if (skip_png_chunk_data(input, &chunk) < 0) {
+      return -1;
+    }
+  }
+}
+
+int png_probe_file(const char* filename, PngInfo* info, int flags) {
+  FILE* file = fopen(filename, "rb");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", filename);
+    return -1;
+  }
+  PngInput input;
+  open_png_input_stream(&input, file, NULL);
+  int result = png_probe(&input, info, flags);
+  close_png_input(&input);
+  fclose(file);
+  return result;
+}
+
+int png_probe_memory(const uint8_t* data, size_t length, PngInfo* info, int flags) {
+  PngInput input;
+  open_png_input_memory(&input, data, length);
+  return png_probe(&input, info, flags);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "chunk.h"
+#include "input.h"
+
+// Header-only inspection of a PNG. Only the signature and IHDR are read, or
+// with PNG_PROBE_METADATA also the chunks up to the first IDAT, where the
+// metadata below has to be. Other chunks are skipped over and no image data
+// is ever read or inflated.
+
+#define PNG_PROBE_METADATA 1 // Collect pHYs, gAMA, sRGB and cHRM
+
+typedef struct png_info_struct {
+  png_IHDR ihdr;
+  int has_pHYs;
+  int has_gAMA;
+  int has_sRGB;
+  int has_cHRM;
+  png_pHYs phys;
+  png_gAMA gama;
+  png_sRGB srgb;
+  png_cHRM chrm;
+} PngInfo;
+
+int png_probe(PngInput* input, PngInfo* info, int flags);
+// Files are read with a few small reads rather than mapped
+int png_probe_file(const char* filename, PngInfo* info, int flags);
+int png_probe_memory(const uint8_t* data, size_t length, PngInfo* info, int flags);
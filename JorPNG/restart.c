@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "restart.h"
+#include "inflate.h"
+#include "unfilter.h"
+#include "thread.h"
+#include "adler.h"
+
+// Restart rows must lie inside the image and increase
+static int check_restart_rows(const RestartPoints* points, const png_IHDR* ihdr) {
+  uint32_t previous = 0;
+  for (int i = 0; i < points->count; i++) {
+    if (points->rows[i] <= previous || points->rows[i] >= ihdr->height) {
+      fprintf(stderr, "Invalid restart point at row %u\n", points->rows[i]);
+      return -1;
+    }
+    previous = points->rows[i];
+  }
+  return 0;
+}
+
+int parse_joRP(RestartPoints* points, const uint8_t* data, uint32_t length, const png_IHDR* ihdr) {
+  points->count = 0;
+  if (length < 4) {
+    return -1;
+  }
+  uint32_t count = read_be32(data);
+  if (count > MAX_RESTART_POINTS || length != 4 + count * 8) {
+    fprintf(stderr, "Invalid joRP chunk\n");
+    return -1;
+  }
+  size_t previous = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    points->rows[i] = read_be32(data + 4 + i * 8);
+    points->offsets[i] = read_be32(data + 8 + i * 8);
+    points->chunk_positions[i] = -1;
+    if (points->offsets[i] <= previous) {
+      fprintf(stderr, "Invalid joRP chunk\n");
+      return -1;
+    }
+    previous = points->offsets[i];
+  }
+  points->count = (int)count;
+  if (check_restart_rows(points, ihdr) < 0) {
+    points->count = 0;
+    return -1;
+  }
+  return 0;
+}
+
+int parse_iDOT(RestartPoints* points, const uint8_t* data, uint32_t length, long chunk_position, const png_IHDR* ihdr) {
+  points->count = 0;
+  if (length != 28 || read_be32(data) != 2) {
+    fprintf(stderr, "Unknown iDOT layout\n");
+    return -1;
+  }
+  uint32_t first_height = read_be32(data + 16);
+  uint32_t second_height = read_be32(data + 20);
+  if (first_height + second_height != ihdr->height) {
+    fprintf(stderr, "Invalid iDOT chunk\n");
+    return -1;
+  }
+  points->rows[0] = first_height;
+  points->offsets[0] = 0;
+  points->chunk_positions[0] = chunk_position + (long)read_be32(data + 24);
+  points->count = 1;
+  if (check_restart_rows(points, ihdr) < 0) {
+    points->count = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// Called for every IDAT chunk with its file position and the offset of its
+// data in the joined IDAT data, to turn iDOT chunk positions into offsets
+void resolve_restart_points(RestartPoints* points, long chunk_position, size_t idat_offset) {
+  for (int i = 0; i < points->count; i++) {
+    if (points->chunk_positions[i] == chunk_position) {
+      points->offsets[i] = idat_offset;
+      points->chunk_positions[i] = -1;
+    }
+  }
+}
+
+// One independently decodable part of the stream and its slice of the image
+typedef struct segment_struct {
+  uint8_t* input;
+  size_t input_length;
+  size_t input_padding;
+  BitStream output;
+  int last;          // Ends with the final block and the zlib trailer
+  uint32_t adler;    // Adler-32 of the output of this segment alone
+  uint32_t trailer;  // ADLER32 of the stream, read by the last segment
+  int result;
+  Thread thread;
+  int threaded;
+} Segment;
+
+static void decode_segment(void* argument) {
+  Segment* segment = (Segment*)argument;
+
+  Window window;
+  init_output_window(&window, &segment->output);
+  enable_window_checksum(&window);
+
+  InflateState state;
+  init_inflate(&state, &window);
+  attach_bitstream(&state.input, segment->input, segment->input_length, segment->input_padding);
+  state.final_input = 1;
+
+  int result = inflate_blocks(&state);
+  segment->adler = get_window_checksum(&window);
+
+  int ok;
+  if (segment->last) {
+    ok = result == INFLATE_FINISHED;
+    skip_to_next_byte(&state.input);
+    if (ok && bits_left(&state.input) >= 32) {
+      segment->trailer = read_bytes(4, &state.input);
+    }
+    else {
+      ok = 0;
+    }
+  }
+  else {
+    // Must end exactly at the next restart point, between two blocks
+    ok = result == INFLATE_NEED_INPUT && state.mode == INFLATE_BLOCK_HEADER;
+  }
+  segment->result = ok && segment->output.byte_position == segment->output.length ? 0 : -1;
+}
+
+// Unfilter the scanlines of a segment, the first one against the last scanline
+// of the previous segment
+static int unfilter_segment(Segment* segment, const uint8_t* prior, size_t row_bytes, size_t bpp) {
+  size_t rows = segment->output.length / (row_bytes + 1);
+  for (size_t y = 0; y < rows; y++) {
+    uint8_t* row = segment->output.buffer + y * (row_bytes + 1);
+    if (unfilter_row(row[0], row + 1, prior, row_bytes, bpp) < 0) {
+      return -1;
+    }
+    row[0] = FILTER_NONE;
+    prior = row + 1;
+  }
+  return 0;
+}
+
+// Decode the joined IDAT data of a non-interlaced image one segment per
+// thread. Rows reach the callback only once the whole image has been decoded
+// and verified, so on failure (-1) the caller can still decode serially.
+// The image and the segments come from arena, or the heap when it is NULL.
+int png_decode_parallel(const png_IHDR* ihdr, uint8_t* idat, size_t length, size_t padding,
+  const RestartPoints* points, png_row_callback callback, void* context, Zlib_Stream* info, Arena* arena) {
+  if (ihdr->interlace_method != 0 || points->count == 0 || length < 2) {
+    return -1;
+  }
+  for (int i = 0; i < points->count; i++) {
+    if (points->chunk_positions[i] >= 0 || points->offsets[i] <= 2 || points->offsets[i] >= length ||
+        (i > 0 && points->offsets[i] <= points->offsets[i - 1])) {
+      return -1;
+    }
+  }
+
+  memset(info, 0, sizeof(*info));
+  info->CMF.byte = idat[0];
+  info->FLG.byte = idat[1];
+  if (((idat[0] << 8) | idat[1]) % 31 != 0 || info->CMF.CM != 8 || info->FLG.FDICT) {
+    return -1;
+  }
+
+  size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+  if (ihdr->height == 0 || row_bytes + 1 > (SIZE_MAX - MATCH_SLACK) / ihdr->height) {
+    return -1; // The filtered image does not fit in memory
+  }
+  size_t image_length = (row_bytes + 1) * ihdr->height;
+  uint8_t* image = (uint8_t*)arena_alloc(arena, image_length + MATCH_SLACK);
+  Segment* segments = (Segment*)arena_calloc(arena, points->count + 1, sizeof(Segment));
+  if (!image || !segments) {
+    arena_free(arena, image);
+    arena_free(arena, segments);
+    return -1;
+  }
+
+  int count = points->count + 1;
+  for (int i = 0; i < count; i++) {
+    Segment* segment = &segments[i];
+    size_t start = i == 0 ? 2 : points->offsets[i - 1];
+    size_t end = i == count - 1 ? length : points->offsets[i];
+    uint32_t first_row = i == 0 ? 0 : points->rows[i - 1];
+    uint32_t end_row = i == count - 1 ? ihdr->height : points->rows[i];
+
+    segment->input = idat + start;
+    segment->input_length = end - start;
+    // Bytes after the segment are readable, they belong to the next one
+    segment->input_padding = length + padding - end < BITSTREAM_PADDING ? length + padding - end : BITSTREAM_PADDING;
+    segment->last = i == count - 1;
+    // Wide match copies may only spill past the end of the image, not into the next slice
+    init_bitstream_padded(&segment->output, image + first_row * (row_bytes + 1),
+      (end_row - first_row) * (row_bytes + 1), segment->last ? MATCH_SLACK : 0);
+  }
+
+  // The first segment runs on this thread
+  for (int i = 1; i < count; i++) {
+    segments[i].threaded = create_thread(&segments[i].thread, decode_segment, &segments[i]) == 0;
+  }
+  decode_segment(&segments[0]);
+
+  // Unfilter each segment as soon as it and the one before it are done
+  size_t bpp = png_bytes_per_pixel(ihdr);
+  int failed = 0;
+  uint32_t adler = 1;
+  for (int i = 0; i < count; i++) {
+    Segment* segment = &segments[i];
+    if (segment->threaded) {
+      join_thread(&segment->thread);
+    }
+    else if (i > 0) {
+      decode_segment(segment);
+    }
+    if (failed || segment->result < 0) {
+      failed = 1;
+      continue;
+    }
+    const uint8_t* prior = i > 0 ? segment->output.buffer - row_bytes : NULL;
+    adler = i == 0 ? segment->adler : adler32_combine(adler, segment->adler, segment->output.length);
+    if (unfilter_segment(segment, prior, row_bytes, bpp) < 0) {
+      failed = 1;
+    }
+  }
+
+  if (!failed) {
+    info->ADLER32 = segments[count - 1].trailer;
+    if (adler != info->ADLER32) {
+      fprintf(stderr, "Error: Adler-32 mismatch! %08X != %08X\n", info->ADLER32, adler);
+      failed = 1;
+    }
+  }
+  if (!failed) {
+    for (uint32_t y = 0; y < ihdr->height; y++) {
+      callback(context, y, image + y * (row_bytes + 1) + 1, row_bytes);
+    }
+  }
+
+  arena_free(arena, segments);
+  arena_free(arena, image);
+  return failed ? -1 : 0;
+}
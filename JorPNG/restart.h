@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chunk.h"
+#include "png.h"
+#include "zlib.h"
+
+// Restart points are places in the IDAT zlib stream where the encoder did a
+// full flush (byte aligned, no references to earlier data) at the start of a
+// scanline. The segments between them can be inflated independently, each on
+// its own thread, into its own slice of the image.
+//
+// joRP chunk (private, before the first IDAT), all values big-endian uint32:
+//   count
+//   count times: row, offset
+// row is the first scanline of the segment and offset the position of its
+// first byte in the IDAT data of all IDAT chunks joined together, counting
+// from the zlib header. Rows and offsets must increase.
+//
+// iDOT chunk (written by Apple, not publicly documented), big-endian uint32:
+//   divisor (2), 0, first half height, 40, first half height, second half
+//   height, position of the IDAT chunk that starts the second half relative
+//   to the iDOT chunk
+// Only the two-half layout is known, so only that one is accepted.
+
+#define MAX_RESTART_POINTS 64
+
+typedef struct restart_points_struct {
+  int count;
+  uint32_t rows[MAX_RESTART_POINTS];
+  size_t offsets[MAX_RESTART_POINTS];         // Offsets into the joined IDAT data
+  long chunk_positions[MAX_RESTART_POINTS];   // File positions of iDOT split chunks, -1 once resolved
+} RestartPoints;
+
+int parse_joRP(RestartPoints* points, const uint8_t* data, uint32_t length, const png_IHDR* ihdr);
+int parse_iDOT(RestartPoints* points, const uint8_t* data, uint32_t length, long chunk_position, const png_IHDR* ihdr);
+void resolve_restart_points(RestartPoints* points, long chunk_position, size_t idat_offset);
+
+int png_decode_parallel(const png_IHDR* ihdr, uint8_t* idat, size_t length, size_t padding,
+  const RestartPoints* points, png_row_callback callback, void* context, Zlib_Stream* info, Arena* arena);
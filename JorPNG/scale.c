@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scale.h"
+#include "cpu.h"
+
+#if CPU_X86
+#include <immintrin.h>
+#endif
+
+// Up to 8 rows of 255 fit easily in 16 bits
+
+static void add_row(uint16_t* sums, const uint8_t* pixels, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    sums[i] += pixels[i];
+  }
+}
+
+#if CPU_X86
+// 16 bytes widened to 16 bit lanes and added per step
+TARGET("sse2")
+static void add_row_sse2(uint16_t* sums, const uint8_t* pixels, size_t length) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(pixels + i));
+    __m128i* s = (__m128i*)(sums + i);
+    _mm_storeu_si128(s, _mm_add_epi16(_mm_loadu_si128(s), _mm_unpacklo_epi8(x, zero)));
+    _mm_storeu_si128(s + 1, _mm_add_epi16(_mm_loadu_si128(s + 1), _mm_unpackhi_epi8(x, zero)));
+  }
+  add_row(sums + i, pixels + i, length - i);
+}
+
+TARGET("avx2")
+static void add_row_avx2(uint16_t* sums, const uint8_t* pixels, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(pixels + i)));
+    __m256i* s = (__m256i*)(sums + i);
+    _mm256_storeu_si256(s, _mm256_add_epi16(_mm256_loadu_si256(s), x));
+  }
+  add_row(sums + i, pixels + i, length - i);
+}
+#endif
+
+int init_png_scaler(PngScaler* scaler, uint32_t width, uint32_t height, int factor, Arena* arena) {
+  if (factor != 2 && factor != 4 && factor != 8) {
+    fprintf(stderr, "Unsupported scale 1/%d\n", factor);
+    return -1;
+  }
+  scaler->factor = factor;
+  scaler->width = width;
+  scaler->height = height;
+  scaler->scaled_width = png_scaled_size(width, factor);
+  scaler->scaled_height = png_scaled_size(height, factor);
+  scaler->rows = 0;
+  scaler->sums = (uint16_t*)arena_calloc(arena, (size_t)width * 4, sizeof(uint16_t));
+  if (!scaler->sums) {
+    fprintf(stderr, "Failed to allocate scaling buffer!\n");
+    return -1;
+  }
+  return 0;
+}
+
+int scale_png_row(PngScaler* scaler, uint32_t y, const uint8_t* pixels, uint8_t* out) {
+  size_t length = (size_t)scaler->width * 4;
+#if CPU_X86
+  const CpuFeatures* cpu = get_cpu_features();
+  if (cpu->avx2) {
+    add_row_avx2(scaler->sums, pixels, length);
+  }
+  else if (cpu->sse2) {
+    add_row_sse2(scaler->sums, pixels, length);
+  }
+  else
+#endif
+  add_row(scaler->sums, pixels, length);
+
+  scaler->rows++;
+  if (scaler->rows < (uint32_t)scaler->factor && y + 1 < scaler->height) {
+    return 0;
+  }
+
+  // Sum the columns of each box and round the average. Whole boxes divide by
+  // a power of two.
+  int shift = scaler->factor == 2 ? 2 : scaler->factor == 4 ? 4 : 6;
+  uint32_t factor = (uint32_t)scaler->factor;
+  for (uint32_t x = 0; x < scaler->scaled_width; x++, out += 4) {
+    uint32_t first = x * factor;
+    uint32_t columns = scaler->width - first < factor ? scaler->width - first : factor;
+    uint32_t count = columns * scaler->rows;
+    const uint16_t* sums = scaler->sums + (size_t)first * 4;
+    for (int c = 0; c < 4; c++) {
+      uint32_t sum = 0;
+      for (uint32_t i = 0; i < columns; i++) {
+        sum += sums[4 * i + c];
+      }
+      out[c] = (uint8_t)(count == factor * factor ? (sum + count / 2) >> shift : (sum + count / 2) / count);
+    }
+  }
+  memset(scaler->sums, 0, length * sizeof(uint16_t));
+  scaler->rows = 0;
+  return 1;
+}
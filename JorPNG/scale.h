@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+// Reduced-resolution decoding. Rows of 8 bit RGBA or BGRA pixels are reduced
+// by 2, 4 or 8 in both directions with a box filter as they arrive, so the
+// image is never held at full size. Boxes at the right and bottom edges
+// average the pixels they have.
+typedef struct png_scaler_struct {
+  int factor;
+  uint32_t width;         // Source size
+  uint32_t height;
+  uint32_t scaled_width;  // Output size, rounded up
+  uint32_t scaled_height;
+  uint16_t* sums;         // Channel sums of the source rows so far, 4 per source pixel
+  uint32_t rows;          // Source rows in sums
+} PngScaler;
+
+int init_png_scaler(PngScaler* scaler, uint32_t width, uint32_t height, int factor, Arena* arena);
+
+// Add source row y. Returns 1 when it completed scaled row y / factor, which
+// was written to out (scaled_width pixels), and 0 otherwise.
+int scale_png_row(PngScaler* scaler, uint32_t y, const uint8_t* pixels, uint8_t* out);
+
+// Size of an image dimension reduced by factor
+static inline uint32_t png_scaled_size(uint32_t size, int factor) {
+  return (uint32_t)(((uint64_t)size + factor - 1) / factor);
+}
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "speculate.h"
+#include "huffman.h"
+#include "unfilter.h"
+#include "thread.h"
+#include "adler.h"
+
+// One range of the compressed data and its speculative output
+typedef struct speculative_range_struct {
+  uint8_t* input;       // Whole stream, so decoding can run past the range
+  size_t input_length;
+  size_t input_padding;
+  size_t search_bit;    // Where the search for the first block starts
+  size_t stop_bit;      // Start of the next range
+  size_t start_bit;     // First block decoded
+  size_t end_bit;       // First dynamic block at or after stop_bit
+  int first;            // Starts at the first block, no search or placeholders
+  int last;             // Ends with the final block and the zlib trailer
+  uint32_t trailer;
+
+  uint16_t* output;
+  size_t output_length;
+  size_t output_capacity;
+  size_t max_output;    // Size of the whole filtered image
+  int result;
+  Thread thread;
+  int threaded;
+
+  HuffmanTable code_length_table;
+  HuffmanTable literal_length_table;
+  HuffmanTable distance_table;
+} SpeculativeRange;
+
+static size_t stream_bit_position(const BitStream* stream) {
+  return stream->byte_position * 8 - stream->bit_count;
+}
+
+static void seek_bit(BitStream* stream, size_t bit) {
+  stream->byte_position = bit / 8;
+  stream->bit_buffer = 0;
+  stream->bit_count = 0;
+  stream->overrun = 0;
+  if (bit % 8) {
+    consume_bits(bit % 8, stream);
+  }
+}
+
+// Whether code lengths form a code build_huffman_table accepts. Checked here
+// without messages, since most searched positions are not block starts.
+// Strict rejects the incomplete single code deflate allows.
+static int valid_code_lengths(const int* lengths, int count, int strict) {
+  int bl_count[MAX_BITS + 1] = { 0 };
+  for (int i = 0; i < count; i++) {
+    bl_count[lengths[i]]++;
+  }
+  int left = 1;
+  int max_length = 0;
+  for (int bits = 1; bits <= MAX_BITS; bits++) {
+    left = (left << 1) - bl_count[bits];
+    if (left < 0) {
+      return 0;
+    }
+    if (bl_count[bits] > 0) {
+      max_length = bits;
+    }
+  }
+  return left == 0 || (!strict && max_length <= 1);
+}
+
+static int read_speculative_tables(SpeculativeRange* range, BitStream* stream, int strict) {
+  static const int code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+  int HLIT = read_bits_lsb(5, stream) + 257;
+  int HDIST = read_bits_lsb(5, stream) + 1;
+  int HCLEN = read_bits_lsb(4, stream) + 4;
+  if (HLIT > 286 || HDIST > 30) {
+    return -1;
+  }
+
+  int code_length_lengths[19] = { 0 };
+  for (int i = 0; i < HCLEN; i++) {
+    code_length_lengths[code_length_order[i]] = read_bits_lsb(3, stream);
+  }
+  if (!valid_code_lengths(code_length_lengths, 19, 1) ||
+      build_huffman_table(&range->code_length_table, code_length_lengths, 19, CODE_LENGTH_TABLE_BITS) < 0) {
+    return -1;
+  }
+
+  int lengths[288 + 32] = { 0 };
+  int index = 0;
+  while (index < HLIT + HDIST) {
+    int symbol = decode_huffman_symbol(&range->code_length_table, stream);
+    int length = 0;
+    int repeat = 1;
+    if (symbol < 0) {
+      return -1;
+    }
+    if (symbol <= 15) {
+      length = symbol;
+    }
+    else if (symbol == 16) {
+      if (index == 0) {
+        return -1;
+      }
+      length = lengths[index - 1];
+      repeat = 3 + read_bits_lsb(2, stream);
+    }
+    else if (symbol == 17) {
+      repeat = 3 + read_bits_lsb(3, stream);
+    }
+    else {
+      repeat = 11 + read_bits_lsb(7, stream);
+    }
+    if (index + repeat > HLIT + HDIST) {
+      return -1;
+    }
+    while (repeat--) {
+      lengths[index++] = length;
+    }
+  }
+
+  if (lengths[256] == 0 ||
+      !valid_code_lengths(lengths, HLIT, strict) || !valid_code_lengths(lengths + HLIT, HDIST, strict) ||
+      build_huffman_table(&range->literal_length_table, lengths, HLIT, LITERAL_LENGTH_TABLE_BITS) < 0 ||
+      build_huffman_table(&range->distance_table, lengths + HLIT, HDIST, DISTANCE_TABLE_BITS) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static int reserve_output(SpeculativeRange* range, size_t count) {
+  if (range->output_length + count <= range->output_capacity) {
+    return 0;
+  }
+  if (range->output_length + count > range->max_output + 258) {
+    return -1; // More output than the whole image
+  }
+  size_t capacity = range->output_capacity ? range->output_capacity * 2 : 1 << 16;
+  while (capacity < range->output_length + count) {
+    capacity *= 2;
+  }
+  uint16_t* output = (uint16_t*)realloc(range->output, capacity * sizeof(uint16_t));
+  if (!output) {
+    return -1;
+  }
+  range->output = output;
+  range->output_capacity = capacity;
+  return 0;
+}
+
+// Decode one block into the speculative output. Returns 1 after the final
+// block, 0 after any other block and -1 when the data is not a valid block.
+// strict only accepts dynamic blocks with complete codes, for the search.
+static int decode_speculative_block(SpeculativeRange* range, BitStream* stream, int strict) {
+  size_t end = range->input_length * 8;
+  int final_block = read_bits_lsb(1, stream);
+  int type = read_bits_lsb(2, stream);
+  const HuffmanTable* literal_length;
+  const HuffmanTable* distance;
+
+  if (strict && type != 2) {
+    return -1;
+  }
+  switch (type) {
+  case 0: {
+    skip_to_next_byte(stream);
+    uint32_t LEN = read_bits_lsb(16, stream);
+    uint32_t NLEN = read_bits_lsb(16, stream);
+    if (LEN != (~NLEN & 0xFFFF) || stream_bit_position(stream) + LEN * 8 > end || reserve_output(range, LEN) < 0) {
+      return -1;
+    }
+    for (uint32_t i = 0; i < LEN; i++) {
+      range->output[range->output_length++] = (uint16_t)read_bits_lsb(8, stream);
+    }
+    return final_block;
+  }
+  case 1:
+    get_fixed_huffman_tables(&literal_length, &distance);
+    break;
+  case 2:
+    if (read_speculative_tables(range, stream, strict) < 0) {
+      return -1;
+    }
+    literal_length = &range->literal_length_table;
+    distance = &range->distance_table;
+    break;
+  default:
+    return -1;
+  }
+
+  while (1) {
+    if (stream_bit_position(stream) > end || reserve_output(range, 258) < 0) {
+      return -1;
+    }
+    int symbol = decode_huffman_symbol(literal_length, stream);
+    if (symbol < 0) {
+      return -1;
+    }
+    if (symbol < 256) {
+      range->output[range->output_length++] = (uint16_t)symbol;
+      continue;
+    }
+    if (symbol == 256) {
+      break;
+    }
+    if (symbol > 285) {
+      return -1;
+    }
+    int length = decode_length(symbol, stream);
+    int distance_symbol = decode_huffman_symbol(distance, stream);
+    if (distance_symbol < 0 || distance_symbol > 29) {
+      return -1;
+    }
+    size_t match_distance = (size_t)decode_distance(distance_symbol, stream);
+
+    uint16_t* output = range->output;
+    size_t position = range->output_length;
+    if (match_distance > position) {
+      // Reaches before the range: placeholders for the unknown bytes
+      if (range->first || match_distance - position > SPECULATIVE_CONTEXT) {
+        return -1;
+      }
+      for (; length > 0 && match_distance > position; length--, position++) {
+        output[position] = (uint16_t)(256 + SPECULATIVE_CONTEXT - (match_distance - position));
+      }
+    }
+    for (; length > 0; length--, position++) {
+      output[position] = output[position - match_distance];
+    }
+    range->output_length = position;
+  }
+  return stream_bit_position(stream) > end ? -1 : final_block;
+}
+
+static void decode_speculative_range(void* argument) {
+  SpeculativeRange* range = (SpeculativeRange*)argument;
+  BitStream stream;
+  init_bitstream_padded(&stream, range->input, range->input_length, range->input_padding);
+  range->result = -1;
+
+  int result = -1;
+  if (range->first) {
+    range->start_bit = range->search_bit;
+    seek_bit(&stream, range->start_bit);
+  }
+  else {
+    // The first position where a whole dynamic block decodes
+    for (size_t bit = range->search_bit; bit < range->stop_bit && result < 0; bit++) {
+      seek_bit(&stream, bit);
+      range->output_length = 0;
+      range->start_bit = bit;
+      result = decode_speculative_block(range, &stream, 1);
+    }
+    if (result < 0) {
+      return;
+    }
+  }
+
+  while (result != 1) {
+    size_t position = stream_bit_position(&stream);
+    if (!range->last && position >= range->stop_bit && (peek_bits_lsb(3, &stream) >> 1) == 2) {
+      range->end_bit = position;
+      range->result = 0;
+      return;
+    }
+    result = decode_speculative_block(range, &stream, 0);
+    if (result < 0) {
+      return;
+    }
+  }
+
+  if (range->last) {
+    skip_to_next_byte(&stream);
+    if (bits_left(&stream) >= 32) {
+      range->trailer = read_bytes(4, &stream);
+      range->result = 0;
+    }
+  }
+}
+
+// Decode the joined IDAT data of a non-interlaced image speculatively on up
+// to threads threads. Returns -1 without calling back when the speculation
+// fails, so the caller can decode serially. The image and the ranges come
+// from arena, or the heap when it is NULL. The output of each range grows on
+// its own thread and so stays on the heap.
+int png_decode_speculative(const png_IHDR* ihdr, uint8_t* idat, size_t length, size_t padding,
+  int threads, png_row_callback callback, void* context, Zlib_Stream* info, Arena* arena) {
+  if (ihdr->interlace_method != 0 || length < 2) {
+    return -1;
+  }
+  int count = threads;
+  if ((size_t)count > (length - 2) / SPECULATIVE_MIN_RANGE) {
+    count = (int)((length - 2) / SPECULATIVE_MIN_RANGE);
+  }
+  if (count < 2) {
+    return -1;
+  }
+
+  memset(info, 0, sizeof(*info));
+  info->CMF.byte = idat[0];
+  info->FLG.byte = idat[1];
+  if (((idat[0] << 8) | idat[1]) % 31 != 0 || info->CMF.CM != 8 || info->FLG.FDICT) {
+    return -1;
+  }
+
+  size_t row_bytes = png_row_bytes(ihdr, ihdr->width);
+  if (ihdr->height == 0 || row_bytes + 1 > SIZE_MAX / ihdr->height) {
+    return -1; // The filtered image does not fit in memory
+  }
+  size_t image_length = (row_bytes + 1) * ihdr->height;
+  SpeculativeRange* ranges = (SpeculativeRange*)arena_calloc(arena, count, sizeof(SpeculativeRange));
+  if (!ranges) {
+    return -1;
+  }
+
+  size_t range_length = (length - 2) / count;
+  for (int i = 0; i < count; i++) {
+    SpeculativeRange* range = &ranges[i];
+    range->input = idat;
+    range->input_length = length;
+    range->input_padding = padding;
+    range->search_bit = (2 + i * range_length) * 8;
+    range->stop_bit = (2 + (i + 1) * range_length) * 8;
+    range->first = i == 0;
+    range->last = i == count - 1;
+    range->max_output = image_length;
+  }
+
+  // The first range runs on this thread
+  for (int i = 1; i < count; i++) {
+    ranges[i].threaded = create_thread(&ranges[i].thread, decode_speculative_range, &ranges[i]) == 0;
+  }
+  decode_speculative_range(&ranges[0]);
+  int failed = 0;
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    if (ranges[i].threaded) {
+      join_thread(&ranges[i].thread);
+    }
+    else if (i > 0) {
+      decode_speculative_range(&ranges[i]);
+    }
+    // Each range has to end where the next one started decoding
+    if (ranges[i].result < 0 || (i > 0 && ranges[i - 1].end_bit != ranges[i].start_bit)) {
+      failed = 1;
+    }
+    total += ranges[i].output_length;
+  }
+
+  uint8_t* image = NULL;
+  if (!failed && total == image_length) {
+    image = (uint8_t*)arena_alloc(arena, image_length);
+  }
+  if (!image) {
+    failed = 1;
+  }
+
+  // Resolve the placeholders of each range against the bytes before it
+  size_t position = 0;
+  for (int i = 0; i < count && !failed; i++) {
+    const uint16_t* output = ranges[i].output;
+    for (size_t j = 0; j < ranges[i].output_length; j++) {
+      uint16_t value = output[j];
+      if (value < 256) {
+        image[position + j] = (uint8_t)value;
+      }
+      else if (position + value - 256 >= SPECULATIVE_CONTEXT) {
+        image[position + j] = image[position + value - 256 - SPECULATIVE_CONTEXT];
+      }
+      else {
+        failed = 1; // Reaches before the start of the stream
+        break;
+      }
+    }
+    position += ranges[i].output_length;
+  }
+
+  if (!failed) {
+    info->ADLER32 = ranges[count - 1].trailer;
+    uint32_t adler = adler32(image, image_length);
+    if (adler != info->ADLER32) {
+      fprintf(stderr, "Error: Adler-32 mismatch! %08X != %08X\n", info->ADLER32, adler);
+      failed = 1;
+    }
+  }
+  if (!failed && unfilter_image(image, ihdr) < 0) {
+    failed = 1;
+  }
+  if (!failed) {
+    for (uint32_t y = 0; y < ihdr->height; y++) {
+      callback(context, y, image + y * (row_bytes + 1) + 1, row_bytes);
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    free(ranges[i].output);
+  }
+  arena_free(arena, ranges);
+  arena_free(arena, image);
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chunk.h"
+#include "png.h"
+#include "zlib.h"
+
+// Speculative parallel inflate of a zlib stream without restart points.
+// The compressed data is cut into ranges. Each thread searches its range for
+// the first bit position where a whole dynamic block decodes, and inflates
+// from there. Back-references into the unknown data before the range are kept
+// as placeholders (see below) and resolved once the ranges before it are done.
+// Each range must end exactly where the next one started, or the speculation
+// failed and the caller decodes serially.
+
+// Compressed bytes per range below which threads are not worth starting
+#define SPECULATIVE_MIN_RANGE (1 << 16)
+
+// Speculative output is one uint16_t per byte. Values below 256 are bytes,
+// 256 + i is byte i of the SPECULATIVE_CONTEXT bytes preceding the range.
+#define SPECULATIVE_CONTEXT MAX_WINDOW_SIZE
+
+int png_decode_speculative(const png_IHDR* ihdr, uint8_t* idat, size_t length, size_t padding,
+  int threads, png_row_callback callback, void* context, Zlib_Stream* info, Arena* arena);
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "thread.h"
+
+// Function and argument of a new thread, freed by the thread once started
+typedef struct thread_start_struct {
+  void (*function)(void*);
+  void* argument;
+} ThreadStart;
+
+#ifdef _WIN32
+#include <windows.h>
+
+static BOOL CALLBACK run_once_callback(PINIT_ONCE once, PVOID parameter, PVOID* context) {
+  void (*function)(void) = (void (*)(void))parameter;
+  function();
+  return TRUE;
+}
+
+void run_once(OnceFlag* flag, void (*function)(void)) {
+  InitOnceExecuteOnce((PINIT_ONCE)flag, run_once_callback, (PVOID)function, NULL);
+}
+
+static DWORD WINAPI thread_main(LPVOID parameter) {
+  ThreadStart start = *(ThreadStart*)parameter;
+  free(parameter);
+  start.function(start.argument);
+  return 0;
+}
+
+int create_thread(Thread* thread, void (*function)(void*), void* argument) {
+  ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+  if (!start) {
+    return -1;
+  }
+  start->function = function;
+  start->argument = argument;
+  thread->handle = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+  if (!thread->handle) {
+    free(start);
+    fprintf(stderr, "Failed to create thread!\n");
+    return -1;
+  }
+  return 0;
+}
+
+void join_thread(Thread* thread) {
+  WaitForSingleObject((HANDLE)thread->handle, INFINITE);
+  CloseHandle((HANDLE)thread->handle);
+}
+
+void yield_thread(void) {
+  SwitchToThread();
+}
+
+void init_mutex(Mutex* mutex) {
+  InitializeSRWLock((PSRWLOCK)mutex);
+}
+
+void lock_mutex(Mutex* mutex) {
+  AcquireSRWLockExclusive((PSRWLOCK)mutex);
+}
+
+void unlock_mutex(Mutex* mutex) {
+  ReleaseSRWLockExclusive((PSRWLOCK)mutex);
+}
+
+// SRW locks hold no resources
+void free_mutex(Mutex* mutex) {
+  (void)mutex;
+}
+
+void init_condition(Condition* condition) {
+  InitializeConditionVariable((PCONDITION_VARIABLE)condition);
+}
+
+void wait_condition(Condition* condition, Mutex* mutex) {
+  SleepConditionVariableSRW((PCONDITION_VARIABLE)condition, (PSRWLOCK)mutex, INFINITE, 0);
+}
+
+void wake_all_condition(Condition* condition) {
+  WakeAllConditionVariable((PCONDITION_VARIABLE)condition);
+}
+
+// Condition variables hold no resources either
+void free_condition(Condition* condition) {
+  (void)condition;
+}
+
+int cpu_count(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+#else
+#include <unistd.h>
+#include <sched.h>
+
+void run_once(OnceFlag* flag, void (*function)(void)) {
+  pthread_once(flag, function);
+}
+
+static void* thread_main(void* parameter) {
+  ThreadStart start = *(ThreadStart*)parameter;
+  free(parameter);
+  start.function(start.argument);
+  return NULL;
+}
+
+int create_thread(Thread* thread, void (*function)(void*), void* argument) {
+  ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+  if (!start) {
+    return -1;
+  }
+  start->function = function;
+  start->argument = argument;
+  if (pthread_create(&thread->handle, NULL, thread_main, start) != 0) {
+    free(start);
+    fprintf(stderr, "Failed to create thread!\n");
+    return -1;
+  }
+  return 0;
+}
+
+void join_thread(Thread* thread) {
+  pthread_join(thread->handle, NULL);
+}
+
+void yield_thread(void) {
+  sched_yield();
+}
+
+void init_mutex(Mutex* mutex) {
+  pthread_mutex_init(mutex, NULL);
+}
+
+void lock_mutex(Mutex* mutex) {
+  pthread_mutex_lock(mutex);
+}
+
+void unlock_mutex(Mutex* mutex) {
+  pthread_mutex_unlock(mutex);
+}
+
+void free_mutex(Mutex* mutex) {
+  pthread_mutex_destroy(mutex);
+}
+
+void init_condition(Condition* condition) {
+  pthread_cond_init(condition, NULL);
+}
+
+void wait_condition(Condition* condition, Mutex* mutex) {
+  pthread_cond_wait(condition, mutex);
+}
+
+void wake_all_condition(Condition* condition) {
+  pthread_cond_broadcast(condition);
+}
+
+void free_condition(Condition* condition) {
+  pthread_cond_destroy(condition);
+}
+
+int cpu_count(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int)count : 1;
+}
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+// Minimal threading primitives over Win32 and POSIX threads
+
+#include <stdint.h>
+
+#ifdef _WIN32
+// Same layout as INIT_ONCE, so <windows.h> stays out of this header
+typedef struct once_flag_struct {
+  void* state;
+} OnceFlag;
+#define ONCE_INIT { 0 }
+
+typedef struct thread_struct {
+  void* handle;
+} Thread;
+
+// Same layout as SRWLOCK
+typedef struct mutex_struct {
+  void* state;
+} Mutex;
+
+// Same layout as CONDITION_VARIABLE
+typedef struct condition_struct {
+  void* state;
+} Condition;
+#else
+#include <pthread.h>
+typedef pthread_once_t OnceFlag;
+#define ONCE_INIT PTHREAD_ONCE_INIT
+
+typedef struct thread_struct {
+  pthread_t handle;
+} Thread;
+
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+#endif
+
+// Counter written by one thread and read by others. A load that sees a
+// stored value also sees everything the storing thread wrote before it.
+// full_fence orders all loads and stores before it before all after it.
+#ifdef _MSC_VER
+#include <intrin.h>
+typedef volatile long AtomicCounter;
+
+static inline uint32_t load_acquire(AtomicCounter* counter) {
+  return (uint32_t)_InterlockedOr(counter, 0);
+}
+
+static inline void store_release(AtomicCounter* counter, uint32_t value) {
+  _InterlockedExchange(counter, (long)value);
+}
+
+static inline void add_counter(AtomicCounter* counter, int32_t delta) {
+  _InterlockedExchangeAdd(counter, (long)delta);
+}
+
+static inline void full_fence(void) {
+  static volatile long fence;
+  _InterlockedOr(&fence, 0);
+}
+#else
+typedef uint32_t AtomicCounter;
+
+static inline uint32_t load_acquire(AtomicCounter* counter) {
+  return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(AtomicCounter* counter, uint32_t value) {
+  __atomic_store_n(counter, value, __ATOMIC_RELEASE);
+}
+
+static inline void add_counter(AtomicCounter* counter, int32_t delta) {
+  __atomic_add_fetch(counter, (uint32_t)delta, __ATOMIC_SEQ_CST);
+}
+
+static inline void full_fence(void) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#endif
+
+// Call function exactly once per flag. Concurrent callers wait until it has returned.
+void run_once(OnceFlag* flag, void (*function)(void));
+
+// Run function(argument) on a new thread. Every created thread must be joined.
+int create_thread(Thread* thread, void (*function)(void*), void* argument);
+void join_thread(Thread* thread);
+
+// Let other threads run, for threads waiting on an AtomicCounter
+void yield_thread(void);
+
+// Number of logical processors, at least 1
+int cpu_count(void);
+
+void init_mutex(Mutex* mutex);
+void lock_mutex(Mutex* mutex);
+void unlock_mutex(Mutex* mutex);
+void free_mutex(Mutex* mutex);
+
+// Threads waiting for a change made under a mutex. wait_condition unlocks the
+// mutex while it sleeps and locks it again before returning, and may return
+// spuriously, so the waiter checks again in a loop.
+void init_condition(Condition* condition);
+void wait_condition(Condition* condition, Mutex* mutex);
+void wake_all_condition(Condition* condition);
+void free_condition(Condition* condition);
@@ -0,0 +1,23 @@
+#include "trace.h"
+
+static void stdout_sink(void* context, int level, const char* format, va_list args) {
+  (void)context;
+  (void)level;
+  vprintf(format, args);
+}
+
+static trace_sink current_sink = stdout_sink;
+static void* current_context = NULL;
+
+// Route trace messages to sink, or back to stdout when sink is NULL
+void set_trace_sink(trace_sink sink, void* context) {
+  current_sink = sink ? sink : stdout_sink;
+  current_context = context;
+}
+
+void trace_printf(int level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  current_sink(current_context, level, format, args);
+  va_end(args);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdio.h>
+
+// Trace levels. Each level includes everything traced by the levels below it.
+#define TRACE_OFF 0
+#define TRACE_CHUNK 1  // PNG chunks and zlib streams
+#define TRACE_BLOCK 2  // Deflate block headers and Huffman codes
+#define TRACE_SYMBOL 3 // Decoded symbols, output bytes and matches
+#define TRACE_BIT 4    // Every bit and byte read or written
+
+// Compile-time trace level. Trace statements above it expand to nothing, so
+// builds without TRACE_LEVEL contain no instrumentation code at all.
+// The Debug configurations set TRACE_LEVEL=TRACE_BIT.
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_OFF
+#endif
+
+// Receives every trace message. The default sink prints to stdout.
+typedef void (*trace_sink)(void* context, int level, const char* format, va_list args);
+
+void set_trace_sink(trace_sink sink, void* context);
+void trace_printf(int level, const char* format, ...);
+
+#if TRACE_LEVEL >= TRACE_CHUNK
+#define trace_chunk(...) trace_printf(TRACE_CHUNK, __VA_ARGS__)
+#else
+#define trace_chunk(...) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_BLOCK
+#define trace_block(...) trace_printf(TRACE_BLOCK, __VA_ARGS__)
+#else
+#define trace_block(...) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_SYMBOL
+#define trace_symbol(...) trace_printf(TRACE_SYMBOL, __VA_ARGS__)
+#else
+#define trace_symbol(...) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_BIT
+#define trace_bit(...) trace_printf(TRACE_BIT, __VA_ARGS__)
+#else
+#define trace_bit(...) ((void)0)
+#endif
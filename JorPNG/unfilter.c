@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unfilter.h"
+#include "cpu.h"
+
+#if CPU_X86
+#include <immintrin.h>
+#endif
+
+// a = left (row[i - bpp]), b = above (prior[i]), c = upper left (prior[i - bpp]).
+// The kernels take bpp as a parameter but are always called with a constant
+// (see dispatch_bpp), so each pixel size gets its own specialized loop.
+
+#define dispatch_bpp(kernel, row, prior, length, bpp) \
+  switch (bpp) { \
+  case 1: kernel(row, prior, length, 1); break; \
+  case 2: kernel(row, prior, length, 2); break; \
+  case 3: kernel(row, prior, length, 3); break; \
+  case 4: kernel(row, prior, length, 4); break; \
+  case 6: kernel(row, prior, length, 6); break; \
+  case 8: kernel(row, prior, length, 8); break; \
+  default: kernel(row, prior, length, bpp); break; \
+  }
+
+static inline void unfilter_sub(uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  (void)prior;
+  for (size_t i = bpp; i < length; i++) {
+    row[i] += row[i - bpp];
+  }
+}
+
+static inline void unfilter_up(uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  (void)bpp;
+  for (size_t i = 0; i < length; i++) {
+    row[i] += prior[i];
+  }
+}
+
+static inline void unfilter_average(uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  for (size_t i = 0; i < bpp && i < length; i++) {
+    row[i] += prior[i] >> 1;
+  }
+  for (size_t i = bpp; i < length; i++) {
+    row[i] += (row[i - bpp] + prior[i]) >> 1;
+  }
+}
+
+// Average filter of a first row, where the row above is all zeros
+static inline void unfilter_average_first(uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  (void)prior;
+  for (size_t i = bpp; i < length; i++) {
+    row[i] += row[i - bpp] >> 1;
+  }
+}
+
+// Predictor closest to a + b - c, ties going to a, then b. Written without
+// branches so the compiler can use conditional moves.
+static inline uint8_t paeth_predictor(int a, int b, int c) {
+  int pa = abs(b - c);
+  int pb = abs(a - c);
+  int pc = abs(a + b - 2 * c);
+  int ab = pa <= pb ? a : b;
+  int pab = pa <= pb ? pa : pb;
+  return (uint8_t)(pab <= pc ? ab : c);
+}
+
+static inline void unfilter_paeth(uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  for (size_t i = 0; i < bpp && i < length; i++) {
+    row[i] += prior[i]; // a = c = 0, so the predictor is b
+  }
+  for (size_t i = bpp; i < length; i++) {
+    row[i] += paeth_predictor(row[i - bpp], prior[i], prior[i - bpp]);
+  }
+}
+
+#if CPU_X86
+TARGET("sse2")
+static inline __m128i load_pixel(const uint8_t* p, size_t bpp) {
+  uint8_t pixel[8] = { 0 };
+  memcpy(pixel, p, bpp);
+  return _mm_loadl_epi64((const __m128i*)pixel);
+}
+
+TARGET("sse2")
+static inline void store_pixel(uint8_t* p, __m128i value, size_t bpp) {
+  uint8_t pixel[8];
+  _mm_storel_epi64((__m128i*)pixel, value);
+  memcpy(p, pixel, bpp);
+}
+
+TARGET("sse2")
+static void unfilter_up_sse2(uint8_t* row, const uint8_t* prior, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(prior + i));
+    _mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(x, b));
+  }
+  for (; i < length; i++) {
+    row[i] += prior[i];
+  }
+}
+
+TARGET("avx2")
+static void unfilter_up_avx2(uint8_t* row, const uint8_t* prior, size_t length) {
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(row + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(prior + i));
+    _mm256_storeu_si256((__m256i*)(row + i), _mm256_add_epi8(x, b));
+  }
+  for (; i < length; i++) {
+    row[i] += prior[i];
+  }
+}
+
+// Sub for pixel sizes dividing 16: a prefix sum with stride bpp over each 16
+// bytes in log2(16 / bpp) shifted adds, plus the last pixel of the previous block
+TARGET("sse2")
+static inline void unfilter_sub_prefix_sse2(uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  (void)prior;
+  __m128i last = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(row + i));
+    switch (bpp) {
+    case 1: x = _mm_add_epi8(x, _mm_slli_si128(x, 1)); // fall through
+    case 2: x = _mm_add_epi8(x, _mm_slli_si128(x, 2)); // fall through
+    case 4: x = _mm_add_epi8(x, _mm_slli_si128(x, 4)); // fall through
+    default: x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    }
+    x = _mm_add_epi8(x, last);
+    _mm_storeu_si128((__m128i*)(row + i), x);
+
+    // Broadcast the last pixel
+    switch (bpp) {
+    case 1:
+      x = _mm_unpackhi_epi8(x, x);
+      // fall through
+    case 2:
+      x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+      // fall through
+    case 4:
+      last = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+      break;
+    default:
+      last = _mm_unpackhi_epi64(x, x);
+      break;
+    }
+  }
+  for (; i < length; i++) {
+    row[i] += i >= bpp ? row[i - bpp] : 0;
+  }
+}
+
+// Sub for 3 and 6 byte pixels, one pixel per step
+TARGET("sse2")
+static inline void unfilter_sub_pixel_sse2(uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  (void)prior;
+  __m128i a = _mm_setzero_si128();
+  for (size_t i = 0; i + bpp <= length; i += bpp) {
+    a = _mm_add_epi8(load_pixel(row + i, bpp), a);
+    store_pixel(row + i, a, bpp);
+  }
+}
+
+// (a + b) >> 1 per byte. pavgb rounds up, so subtract the carry of odd sums.
+TARGET("sse2")
+static inline void unfilter_average_sse2(uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for (size_t i = 0; i + bpp <= length; i += bpp) {
+    __m128i b = load_pixel(prior + i, bpp);
+    __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(load_pixel(row + i, bpp), average);
+    store_pixel(row + i, a, bpp);
+  }
+}
+
+TARGET("sse2")
+static inline __m128i select_epi16(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+TARGET("sse2")
+static inline __m128i abs_epi16(__m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// Paeth on 16 bit lanes, one pixel per step, with the predictor picked by masks
+TARGET("sse2")
+static inline void unfilter_paeth_sse2(uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero;
+  __m128i c = zero;
+  for (size_t i = 0; i + bpp <= length; i += bpp) {
+    __m128i b = _mm_unpacklo_epi8(load_pixel(prior + i, bpp), zero);
+
+    __m128i pa = _mm_sub_epi16(b, c); // p - a
+    __m128i pb = _mm_sub_epi16(a, c); // p - b
+    __m128i pc = abs_epi16(_mm_add_epi16(pa, pb)); // p - c
+    pa = abs_epi16(pa);
+    pb = abs_epi16(pb);
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i predictor = select_epi16(_mm_cmpeq_epi16(smallest, pa), a,
+                        select_epi16(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+    __m128i x = _mm_add_epi8(load_pixel(row + i, bpp), _mm_packus_epi16(predictor, zero));
+    store_pixel(row + i, x, bpp);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+#endif
+
+int unfilter_row(uint8_t filter, uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+#if CPU_X86
+  const CpuFeatures* cpu = get_cpu_features();
+#endif
+
+  switch (filter) {
+  case FILTER_NONE:
+    return 0;
+
+  case FILTER_SUB:
+#if CPU_X86
+    if (cpu->sse2) {
+      if (bpp == 3 || bpp == 6) {
+        dispatch_bpp(unfilter_sub_pixel_sse2, row, prior, length, bpp);
+      }
+      else {
+        dispatch_bpp(unfilter_sub_prefix_sse2, row, prior, length, bpp);
+      }
+      return 0;
+    }
+#endif
+    dispatch_bpp(unfilter_sub, row, prior, length, bpp);
+    return 0;
+
+  case FILTER_UP:
+    if (!prior) {
+      return 0;
+    }
+#if CPU_X86
+    if (cpu->avx2) {
+      unfilter_up_avx2(row, prior, length);
+      return 0;
+    }
+    if (cpu->sse2) {
+      unfilter_up_sse2(row, prior, length);
+      return 0;
+    }
+#endif
+    unfilter_up(row, prior, length, bpp);
+    return 0;
+
+  case FILTER_AVERAGE:
+    if (!prior) {
+      dispatch_bpp(unfilter_average_first, row, prior, length, bpp);
+      return 0;
+    }
+#if CPU_X86
+    if (cpu->sse2 && bpp >= 3) {
+      dispatch_bpp(unfilter_average_sse2, row, prior, length, bpp);
+      return 0;
+    }
+#endif
+    dispatch_bpp(unfilter_average, row, prior, length, bpp);
+    return 0;
+
+  case FILTER_PAETH:
+    if (!prior) {
+      // With the row above all zeros the predictor is always a
+      return unfilter_row(FILTER_SUB, row, prior, length, bpp);
+    }
+#if CPU_X86
+    if (cpu->sse2 && bpp >= 3) {
+      dispatch_bpp(unfilter_paeth_sse2, row, prior, length, bpp);
+      return 0;
+    }
+#endif
+    dispatch_bpp(unfilter_paeth, row, prior, length, bpp);
+    return 0;
+
+  default:
+    fprintf(stderr, "Error: Invalid filter type %u\n", filter);
+    return -1;
+  }
+}
+
+int unfilter_rows(uint8_t* data, size_t row_bytes, size_t rows, size_t bpp) {
+  const uint8_t* prior = NULL;
+  for (size_t y = 0; y < rows; y++) {
+    uint8_t* row = data + y * (row_bytes + 1);
+    if (unfilter_row(row[0], row + 1, prior, row_bytes, bpp) < 0) {
+      return -1;
+    }
+    row[0] = FILTER_NONE;
+    prior = row + 1;
+  }
+  return 0;
+}
+
+// Unfilter a non-interlaced image in place
+int unfilter_image(uint8_t* data, const png_IHDR* ihdr) {
+  return unfilter_rows(data, png_row_bytes(ihdr, ihdr->width), ihdr->height, png_bytes_per_pixel(ihdr));
+}
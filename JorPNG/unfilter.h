@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "chunk.h"
+
+// https://www.w3.org/TR/png/#9Filters
+
+// Filter type byte at the start of each scanline
+#define FILTER_NONE 0
+#define FILTER_SUB 1
+#define FILTER_UP 2
+#define FILTER_AVERAGE 3
+#define FILTER_PAETH 4
+
+// Reverse the filter of one scanline in place. prior is the previous scanline,
+// already unfiltered, or NULL for the first scanline of an image or pass.
+// length is the scanline length without the filter type byte.
+int unfilter_row(uint8_t filter, uint8_t* row, const uint8_t* prior, size_t length, size_t bpp);
+
+// Unfilter rows scanlines of 1 + row_bytes bytes each in place. The filter
+// type bytes are set to FILTER_NONE as each row is done.
+int unfilter_rows(uint8_t* data, size_t row_bytes, size_t rows, size_t bpp);
+int unfilter_image(uint8_t* data, const png_IHDR* ihdr);
+
+void test_unfilter();
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "unfilter.h"
+#include "cpu.h"
+
+#define UNFILTER_TEST_ROW 4099 // Not a multiple of any vector width or pixel size
+
+static uint8_t reference_paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return (uint8_t)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Byte at a time, as written in the specification
+static void reference_unfilter(uint8_t filter, uint8_t* row, const uint8_t* prior, size_t length, size_t bpp) {
+  for (size_t i = 0; i < length; i++) {
+    int a = i >= bpp ? row[i - bpp] : 0;
+    int b = prior ? prior[i] : 0;
+    int c = prior && i >= bpp ? prior[i - bpp] : 0;
+    switch (filter) {
+    case FILTER_SUB: row[i] += (uint8_t)a; break;
+    case FILTER_UP: row[i] += (uint8_t)b; break;
+    case FILTER_AVERAGE: row[i] += (uint8_t)((a + b) / 2); break;
+    case FILTER_PAETH: row[i] += reference_paeth(a, b, c); break;
+    }
+  }
+}
+
+// Every filter type and pixel size through the AVX2, SSE2 and scalar
+// kernels, with and without a prior row, must match the reference
+void test_unfilter() {
+  static const CpuFeatures sse2 = { 1, 1, 1, 1, 0 };
+  static const CpuFeatures scalar = { 0 };
+  static const CpuFeatures* kernels[3] = { NULL, &sse2, &scalar };
+  static const char* names[3] = { "widest", "SSE2", "scalar" };
+  static const size_t bpps[] = { 1, 2, 3, 4, 6, 8 };
+  static const size_t lengths[] = { 1, 2, 3, 5, 8, 15, 16, 17, 31, 33, 48, 63, 65, 100, UNFILTER_TEST_ROW };
+
+  uint8_t* prior = (uint8_t*)malloc(UNFILTER_TEST_ROW);
+  uint8_t* filtered = (uint8_t*)malloc(UNFILTER_TEST_ROW);
+  uint8_t* expected = (uint8_t*)malloc(UNFILTER_TEST_ROW);
+  uint8_t* row = (uint8_t*)malloc(UNFILTER_TEST_ROW);
+  if (!prior || !filtered || !expected || !row) {
+    printf("Unfilter test: out of memory\n");
+    free(prior);
+    free(filtered);
+    free(expected);
+    free(row);
+    return;
+  }
+  uint32_t random = 3;
+  for (size_t i = 0; i < UNFILTER_TEST_ROW; i++) {
+    random = random * 1103515245 + 12345;
+    prior[i] = (uint8_t)(random >> 24);
+    random = random * 1103515245 + 12345;
+    filtered[i] = (uint8_t)(random >> 24);
+  }
+
+  int matches = 1;
+  for (uint8_t filter = FILTER_NONE; filter <= FILTER_PAETH; filter++) {
+    for (size_t b = 0; b < sizeof(bpps) / sizeof(bpps[0]); b++) {
+      for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        size_t length = lengths[l] < bpps[b] ? bpps[b] : lengths[l] / bpps[b] * bpps[b];
+        for (int first = 0; first < 2; first++) {
+          const uint8_t* above = first ? NULL : prior;
+          memcpy(expected, filtered, length);
+          reference_unfilter(filter, expected, above, length, bpps[b]);
+          for (int k = 0; k < 3; k++) {
+            restrict_cpu_features(kernels[k]);
+            memcpy(row, filtered, length);
+            if (unfilter_row(filter, row, above, length, bpps[b]) < 0 || memcmp(row, expected, length) != 0) {
+              printf("Unfilter %s: filter %u, %llu bytes per pixel, %llu bytes%s differ\n", names[k], filter,
+                (unsigned long long)bpps[b], (unsigned long long)length, first ? " without prior" : "");
+              matches = 0;
+            }
+          }
+        }
+      }
+    }
+  }
+  restrict_cpu_features(NULL);
+  matches &= unfilter_row(5, row, prior, 16, 4) < 0;
+
+  // Speed of each kernel over rows of all filter types
+  double speeds[3] = { 0 };
+  size_t rows = 1024;
+  size_t bytes = 0;
+  for (int k = 0; k < 3; k++) {
+    restrict_cpu_features(kernels[k]);
+    bytes = 0;
+    clock_t start = clock();
+    for (size_t y = 0; y < rows; y++) {
+      unfilter_row((uint8_t)(y % 5), row, prior, 4096, 4);
+      bytes += 4096;
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    speeds[k] = bytes / 1e6 / (seconds > 0 ? seconds : 1e-9);
+  }
+  restrict_cpu_features(NULL);
+  printf("Unfilter RGBA8: %.0f MB/s, SSE2 %.0f MB/s, scalar %.0f MB/s, matches: %s\n",
+    speeds[0], speeds[1], speeds[2], matches ? "True" : "False");
+
+  free(prior);
+  free(filtered);
+  free(expected);
+  free(row);
+}
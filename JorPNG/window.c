@@ -1,44 +1,284 @@
 #include "window.h"
 
-// initialize passed window. rememeber to free
-void init_window(Window* window, size_t size, BitStream* output) {
+// Initialize a window that uses the output buffer as its history
+void init_output_window(Window* window, BitStream* output) {
+  window->window = NULL;
   window->window_pos = 0;
-  window->size = size;
+  window->size = 0;
+  window->filled = 0;
+  window->pending = 0;
+  window->sink = NULL;
+  window->sink_context = NULL;
   window->output = output;
-  window->window = (uint8_t*)malloc(size * sizeof(uint8_t));
+  window->arena = NULL;
+  window->stopped = 0;
+  window->checksum = 0;
+  window->adler = 1;
+  window->checksummed = 0;
+  window->checksum_limit = SIZE_MAX;
+}
+
+// Initialize a ring window of size bytes (a power of two). rememeber to free
+int init_ring_window(Window* window, size_t size, window_sink sink, void* context) {
+  return init_ring_window_arena(window, size, sink, context, NULL);
+}
+
+// Ring window allocated from an arena, which releases it with the arena
+int init_ring_window_arena(Window* window, size_t size, window_sink sink, void* context, Arena* arena) {
+  init_output_window(window, NULL);
+  window->size = size;
+  window->sink = sink;
+  window->sink_context = context;
+  window->arena = arena;
+  window->window = (uint8_t*)arena_calloc(arena, size + MATCH_SLACK, sizeof(uint8_t));
   if (!window->window) {
     fprintf(stderr, "Failed to create window!\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Start over with an empty ring, keeping the buffer of init_ring_window
+void reset_ring_window(Window* window, window_sink sink, void* context) {
+  uint8_t* ring = window->window;
+  size_t size = window->size;
+  Arena* arena = window->arena;
+  init_output_window(window, NULL);
+  window->window = ring;
+  window->arena = arena;
+  window->size = size;
+  window->sink = sink;
+  window->sink_context = context;
+}
+
+void free_window(Window* window) {
+  arena_free(window->arena, window->window);
+  window->window = NULL;
+}
+
+// Hand a span of the ring to the sink, adding it to the checksum on the way
+static void flush_span(Window* window, const uint8_t* data, size_t length) {
+  if (window->checksum) {
+    window->adler = update_adler32(window->adler, data, length);
+  }
+  window->sink(window->sink_context, data, length);
+}
+
+// Hand the pending ring bytes to the sink, in two spans when they wrap around
+void flush_window(Window* window) {
+  if (!window->window || window->pending == 0) {
+    return;
+  }
+  size_t start = (window->window_pos - window->pending) & (window->size - 1);
+  size_t first = window->size - start;
+  if (first >= window->pending) {
+    flush_span(window, window->window + start, window->pending);
+  }
+  else {
+    flush_span(window, window->window + start, first);
+    flush_span(window, window->window, window->pending - first);
+  }
+  window->pending = 0;
+}
+
+// Keep a running Adler-32 of all output from now on, summed span by span
+// while the bytes are still in cache instead of in a second pass at the end
+void enable_window_checksum(Window* window) {
+  window->checksum = 1;
+  if (window->output) {
+    window->checksummed = window->output->byte_position;
+    window->checksum_limit = window->checksummed + CHECKSUM_SPAN;
+  }
+}
+
+// Add the output produced since the last update to the checksum
+void update_window_checksum(Window* window) {
+  if (!window->checksum) {
     return;
   }
-  for (size_t i = 0; i < size; i++) {
-    window->window[i] = 0;
+  if (!window->output) {
+    flush_window(window);
+    return;
+  }
+  BitStream* output = window->output;
+  window->adler = update_adler32(window->adler, output->buffer + window->checksummed, output->byte_position - window->checksummed);
+  window->checksummed = output->byte_position;
+  window->checksum_limit = window->checksummed + CHECKSUM_SPAN;
+}
+
+// Adler-32 of all output so far
+uint32_t get_window_checksum(Window* window) {
+  update_window_checksum(window);
+  return window->adler;
+}
+
+// Window sink that appends the flushed bytes to a BitStream
+void bitstream_sink(void* context, const uint8_t* data, size_t length) {
+  BitStream* output = (BitStream*)context;
+  for (size_t i = 0; i < length; i++) {
+    put_byte(data[i], output);
+  }
+}
+
+// Account for bytes written to the ring and flush once half of it is pending.
+// A single write is at most a 258 byte match, so no pending byte is overwritten.
+static void ring_written(size_t length, Window* window) {
+  window->pending += length;
+  window->filled = window->filled + length < window->size ? window->filled + length : window->size;
+  if (window->pending >= window->size / 2) {
+    flush_window(window);
   }
 }
 
 // Output a literal byte to the decompressed data
-void output_byte(uint8_t byte, Window* window) {
-  window->window[window->window_pos] = byte;
-  // when the window_pos reaches the end, it wraps around to the beginning.
-  window->window_pos++;
-  window->window_pos %= window->size;
-  //putchar(byte);  // Write to stdout or save to buffer
-  put_byte(byte, window->output);
-  printf("Outputting 0x%02X %u 0b", byte, byte);
+int output_byte(uint8_t byte, Window* window) {
+#if TRACE_LEVEL >= TRACE_SYMBOL
+  trace_symbol("Outputting 0x%02X %u 0b", byte, byte);
   for (size_t j = 0; j < 8; j++) {
-    printf("%d", byte >> (7 - j) & 1);
+    trace_symbol("%d", byte >> (7 - j) & 1);
   }
-  printf("\n");
+  trace_symbol("\n");
+#endif
+  if (window->window) {
+    window->window[window->window_pos] = byte;
+    // when the window_pos reaches the end, it wraps around to the beginning.
+    window->window_pos = (window->window_pos + 1) & (window->size - 1);
+    ring_written(1, window);
+    return 0;
+  }
+
+  BitStream* output = window->output;
+  if (output->byte_position >= output->length) {
+    fprintf(stderr, "Error: Writing past bistream end!\n");
+    return -1;
+  }
+  output->buffer[output->byte_position++] = byte;
+  return 0;
 }
 
-// Copy from sliding window based on length and distance
-void copy_from_window(int length, int distance, Window* window) {
-  size_t src_pos = (window->window_pos - distance + window->size) % window->size;
-  for (int i = 0; i < length; i++) {
-    uint8_t byte = window->window[src_pos];
-    output_byte(byte, window);
-    // when the src_pos reaches the end, it wraps around to the beginning.
-    src_pos++;
-    src_pos %= window->size;
+// Output a run of literal bytes, such as a stored block
+int output_bytes(const uint8_t* data, size_t length, Window* window) {
+  if (window->window) {
+    while (length > 0) {
+      size_t span = window->size - window->window_pos;
+      span = span < window->size / 2 ? span : window->size / 2;
+      span = span < length ? span : length;
+      memcpy(window->window + window->window_pos, data, span);
+      window->window_pos = (window->window_pos + span) & (window->size - 1);
+      ring_written(span, window);
+      data += span;
+      length -= span;
+    }
+    return 0;
+  }
+
+  BitStream* output = window->output;
+  if (length > output->length - output->byte_position) {
+    fprintf(stderr, "Error: Writing past bistream end!\n");
+    return -1;
+  }
+  memcpy(output->buffer + output->byte_position, data, length);
+  output->byte_position += length;
+  return 0;
+}
+
+// Copy a match in chunks as wide as its distance allows. Stores may run up to
+// MATCH_SLACK - 1 bytes past dst + length.
+static void copy_match_fast(uint8_t* dst, size_t distance, size_t length) {
+  const uint8_t* src = dst - distance;
+  uint8_t* end = dst + length;
+
+  if (distance >= 32) {
+    // Each chunk reads only bytes written before it
+    do {
+      memcpy(dst, src, 32);
+      dst += 32;
+      src += 32;
+    } while (dst < end);
   }
-  printf("Copied %d bytes (%d..%d)\n", length, distance, distance + length);
-}
\ No newline at end of file
+  else if (distance >= 16) {
+    do {
+      memcpy(dst, src, 16);
+      dst += 16;
+      src += 16;
+    } while (dst < end);
+  }
+  else if (distance >= 8) {
+    do {
+      memcpy(dst, src, 8);
+      dst += 8;
+      src += 8;
+    } while (dst < end);
+  }
+  else if (distance == 1) {
+    // Run of a single byte
+    memset(dst, src[0], length);
+  }
+  else {
+    // Repeat the short pattern across a word, then store the word advancing by
+    // the largest multiple of the distance that fits in it
+    uint8_t pattern[8];
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+      pattern[i] = src[i % distance];
+    }
+    size_t step = sizeof(pattern) - sizeof(pattern) % distance;
+    do {
+      memcpy(dst, pattern, sizeof(pattern));
+      dst += step;
+    } while (dst < end);
+  }
+}
+
+// Copy length bytes starting distance bytes back in the history
+int copy_from_window(int length, int distance, Window* window) {
+  trace_symbol("Copied %d bytes (%d..%d)\n", length, distance, distance + length);
+
+  if (window->window) {
+    if ((size_t)distance > window->filled) {
+      fprintf(stderr, "Error: Distance %d too far back\n", distance);
+      return -1;
+    }
+    size_t mask = window->size - 1;
+    size_t src_pos = (window->window_pos - distance) & mask;
+    // Neither the source nor the copy wraps. Chunks stored past the end of the
+    // copy land in the slack after the ring, or on bytes more than the
+    // largest window back that were flushed long ago.
+    if (window->size >= RING_WINDOW_SIZE && src_pos < window->window_pos && window->window_pos + length <= window->size) {
+      copy_match_fast(window->window + window->window_pos, distance, length);
+      window->window_pos = (window->window_pos + length) & mask;
+      ring_written(length, window);
+      return 0;
+    }
+    for (int i = 0; i < length; i++) {
+      window->window[window->window_pos] = window->window[src_pos];
+      // when the positions reach the end, they wrap around to the beginning.
+      window->window_pos = (window->window_pos + 1) & mask;
+      src_pos = (src_pos + 1) & mask;
+    }
+    ring_written(length, window);
+    return 0;
+  }
+
+  BitStream* output = window->output;
+  if ((size_t)distance > output->byte_position) {
+    fprintf(stderr, "Error: Distance %d too far back\n", distance);
+    return -1;
+  }
+  if ((size_t)length > output->length - output->byte_position) {
+    fprintf(stderr, "Error: Writing past bistream end!\n");
+    return -1;
+  }
+  uint8_t* dst = output->buffer + output->byte_position;
+  if (output->length + output->padding - output->byte_position - length >= MATCH_SLACK) {
+    copy_match_fast(dst, distance, length);
+  }
+  else {
+    // Byte by byte near the end, as the source may overlap the bytes being written
+    const uint8_t* src = dst - distance;
+    for (int i = 0; i < length; i++) {
+      dst[i] = src[i];
+    }
+  }
+  output->byte_position += length;
+  return 0;
+}
@@ -5,14 +5,70 @@
 #include <stdlib.h>
 
 #include "bitstream.h"
+#include "adler.h"
+#include "arena.h"
 
+// Spare writable bytes past the end of an output buffer (the BitStream
+// padding) that let match copies store whole chunks past the match end
+#define MATCH_SLACK 32
+
+// Largest LZ77 window of a deflate stream, enough for a ring window of any stream
+#define MAX_WINDOW_SIZE (1 << 15)
+
+// Ring size of the decoders. Twice the largest window, so the bytes just past
+// a match are older than any distance and already flushed, and matches that
+// do not wrap can be copied in wide chunks like in output mode.
+#define RING_WINDOW_SIZE (2 * MAX_WINDOW_SIZE)
+
+// Output bytes collected before they are added to the running checksum.
+// Small enough that the span is still in L1 when it is summed.
+#define CHECKSUM_SPAN 8192
+
+// Receives decompressed bytes flushed from a ring window
+typedef void (*window_sink)(void* context, const uint8_t* data, size_t length);
+
+// LZ77 history. In output mode (window == NULL) back-references are resolved
+// directly against the output buffer, which holds the whole decompressed data.
+// In ring mode only the last size bytes are kept and handed to the sink in
+// spans, for bounded-memory streaming.
 typedef struct window_struct {
-  uint8_t* window;
-  int window_pos;
-  size_t size;
-  BitStream* output;
+  uint8_t* window;    // Ring buffer with MATCH_SLACK bytes past size, NULL in output mode
+  size_t window_pos;  // Ring write position
+  size_t size;        // Ring size, a power of two
+  size_t filled;      // Valid ring bytes, up to size
+  size_t pending;     // Ring bytes not yet flushed to the sink
+  window_sink sink;
+  void* sink_context;
+  BitStream* output;  // Output buffer in output mode
+  Arena* arena;       // Where the ring came from, NULL for the heap
+  int stopped;        // Set by the sink once it needs no more output, which ends the inflate
+
+  // Running Adler-32 of the output, see enable_window_checksum
+  int checksum;
+  uint32_t adler;
+  size_t checksummed;    // Output bytes included in adler (output mode)
+  size_t checksum_limit; // Output position that triggers the next update
 } Window;
 
-void init_window(Window* window, size_t size, BitStream* output);
-void copy_from_window(int length, int distance, Window* window);
-void output_byte(uint8_t byte, Window* window);
+void init_output_window(Window* window, BitStream* output);
+int init_ring_window(Window* window, size_t size, window_sink sink, void* context);
+int init_ring_window_arena(Window* window, size_t size, window_sink sink, void* context, Arena* arena);
+void reset_ring_window(Window* window, window_sink sink, void* context);
+void free_window(Window* window);
+void flush_window(Window* window);
+void enable_window_checksum(Window* window);
+uint32_t get_window_checksum(Window* window);
+void update_window_checksum(Window* window);
+
+// Called as output is produced. Adds the output to the checksum once a
+// CHECKSUM_SPAN has built up. Ring windows are summed as they are flushed.
+static inline void checksum_window_span(Window* window) {
+  if (window->output && window->output->byte_position >= window->checksum_limit) {
+    update_window_checksum(window);
+  }
+}
+void bitstream_sink(void* context, const uint8_t* data, size_t length);
+
+int copy_from_window(int length, int distance, Window* window);
+int output_byte(uint8_t byte, Window* window);
+int output_bytes(const uint8_t* data, size_t length, Window* window);
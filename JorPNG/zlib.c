@@ -9,37 +9,163 @@ uint64_t LZ77_window_size(CMF cmf) {
   return 1ULL << (cmf.CINFO + 8);
 }
 
-void process_zlib_stream(uint8_t* data, uint32_t length, BitStream* output) {
-  
-  BitStream bitstream;
-  init_bitstream(&bitstream, data, length);
-
-  Zlib_Stream zlib_stream = { 0 };
-  zlib_stream.CMF.byte = read_bytes(sizeof(zlib_stream.CMF), &bitstream);
-  zlib_stream.FLG.byte = read_bytes(sizeof(zlib_stream.FLG), &bitstream);
-  if (zlib_stream.FLG.FDICT) {
-    zlib_stream.DICTID = read_bytes(sizeof(zlib_stream.DICTID), &bitstream);
+// The output buffer holds the whole image, so it doubles as the LZ77 window
+void init_zlib_stream(Zlib_Stream* stream, BitStream* output, ZlibChecksum checksum) {
+  memset(stream, 0, sizeof(*stream));
+  stream->mode = ZLIB_HEADER;
+  stream->checksum = checksum;
+  init_output_window(&stream->window, output);
+  if (checksum == ZLIB_VERIFY) {
+    enable_window_checksum(&stream->window);
   }
-  
-  Window window;
-  size_t size = LZ77_window_size(zlib_stream.CMF);
-  init_window(&window, size, output);
+  init_inflate(&stream->inflate, &stream->window);
+}
+
+// Decode through a ring window that hands the output to sink in spans, so
+// the whole output never has to be in memory. Free with free_zlib_stream.
+int init_zlib_stream_sink(Zlib_Stream* stream, window_sink sink, void* context, ZlibChecksum checksum) {
+  return init_zlib_stream_arena(stream, sink, context, checksum, NULL);
+}
+
+// Same with the ring window taken from an arena (NULL for the heap)
+int init_zlib_stream_arena(Zlib_Stream* stream, window_sink sink, void* context, ZlibChecksum checksum, Arena* arena) {
+  memset(stream, 0, sizeof(*stream));
+  stream->mode = ZLIB_HEADER;
+  stream->checksum = checksum;
+  if (init_ring_window_arena(&stream->window, RING_WINDOW_SIZE, sink, context, arena) < 0) {
+    stream->mode = ZLIB_ERROR;
+    return -1;
+  }
+  if (checksum == ZLIB_VERIFY) {
+    enable_window_checksum(&stream->window);
+  }
+  init_inflate(&stream->inflate, &stream->window);
+  return 0;
+}
+
+// Start the next stream of a stream set up with init_zlib_stream_sink,
+// reusing its ring window
+void reset_zlib_stream_sink(Zlib_Stream* stream, window_sink sink, void* context, ZlibChecksum checksum) {
+  Window window = stream->window;
+  memset(stream, 0, sizeof(*stream));
+  stream->mode = ZLIB_HEADER;
+  stream->checksum = checksum;
+  stream->window = window;
+  reset_ring_window(&stream->window, sink, context);
+  if (checksum == ZLIB_VERIFY) {
+    enable_window_checksum(&stream->window);
+  }
+  init_inflate(&stream->inflate, &stream->window);
+}
+
+void free_zlib_stream(Zlib_Stream* stream) {
+  free_window(&stream->window);
+}
+
+// Continue from where the previous buffer ended. Returns the INFLATE_* codes.
+static int run_zlib_stream(Zlib_Stream* stream) {
+  InflateState* inflate = &stream->inflate;
+  BitStream* input = &inflate->input;
 
-  int block = 1;
-  do {
-    printf("Processing Zlib block %d\n", block++);
-  } while (inflate_block(&bitstream, &window));
+  switch (stream->mode) {
+  case ZLIB_HEADER:
+    if (!inflate_has_bits(inflate, 16)) {
+      return INFLATE_NEED_INPUT;
+    }
+    stream->CMF.byte = read_bytes(sizeof(stream->CMF), input);
+    stream->FLG.byte = read_bytes(sizeof(stream->FLG), input);
+    if (!FCHECK(stream->CMF, stream->FLG) || stream->CMF.CM != 8) {
+      fprintf(stderr, "Error: Invalid zlib header\n");
+      stream->mode = ZLIB_ERROR;
+      return INFLATE_FAILED;
+    }
+    if (stream->FLG.FDICT) {
+      // PNG streams never use a preset dictionary
+      fprintf(stderr, "Error: Zlib preset dictionary not supported\n");
+      stream->mode = ZLIB_ERROR;
+      return INFLATE_FAILED;
+    }
+    stream->mode = ZLIB_DATA;
+    // fall through
 
-  free(window.window);
+  case ZLIB_DATA: {
+    int result = inflate_blocks(inflate);
+    if (result == INFLATE_FAILED) {
+      stream->mode = ZLIB_ERROR;
+    }
+    if (result == INFLATE_STOPPED) {
+      stream->mode = ZLIB_STOPPED;
+    }
+    if (result != INFLATE_FINISHED) {
+      return result;
+    }
+    stream->mode = ZLIB_TRAILER;
+  }
+    // fall through
+
+  case ZLIB_TRAILER: {
+    // Up to 7 bits to the byte boundary and the 4 byte checksum
+    if (!inflate_has_bits(inflate, 39)) {
+      return INFLATE_NEED_INPUT;
+    }
+    stream->ADLER32 = read_bytes(sizeof(stream->ADLER32), input);
+    if (input->overrun) {
+      stream->mode = ZLIB_ERROR;
+      return INFLATE_FAILED;
+    }
+    if (stream->checksum == ZLIB_VERIFY) {
+      uint32_t adler = get_window_checksum(&stream->window);
+      if (adler != stream->ADLER32) {
+        fprintf(stderr, "Error: Adler-32 mismatch! %08X != %08X\n", stream->ADLER32, adler);
+        stream->mode = ZLIB_ERROR;
+        return INFLATE_FAILED;
+      }
+    }
+    stream->mode = ZLIB_DONE;
 
-  skip_to_next_byte(&bitstream); // is this needed? Yes!
+    trace_chunk("Zlib stream done, %llu bits of the buffer left\n", bits_left(input));
+    return INFLATE_FINISHED;
+  }
 
-  zlib_stream.ADLER32 = read_bytes(sizeof(zlib_stream.ADLER32), &bitstream);
+  case ZLIB_DONE:
+    return INFLATE_FINISHED;
 
-  size_t bitcount = (bitstream.length - bitstream.byte_position) * 8 - bitstream.bit_position;
-  printf("%llu/%llu bits processed (%llu left)\n", ((bitstream.length * 8) - bitcount), bitstream.length * 8, bitcount);
+  case ZLIB_STOPPED:
+    return INFLATE_STOPPED;
 
-  print_stream_info(&zlib_stream);
+  default:
+    return INFLATE_FAILED;
+  }
+}
+
+// Decode the next slice of the stream. The slice needs padding readable bytes
+// past length (see BITSTREAM_PADDING) and can be released once this returns.
+int feed_zlib_stream(Zlib_Stream* stream, uint8_t* data, size_t length, size_t padding) {
+  if (stream->mode == ZLIB_DONE) {
+    return INFLATE_FINISHED; // Data after the end of the stream is ignored
+  }
+  if (stream->mode == ZLIB_STOPPED) {
+    return INFLATE_STOPPED;
+  }
+  attach_bitstream(&stream->inflate.input, data, length, padding);
+  int result = run_zlib_stream(stream);
+  detach_bitstream(&stream->inflate.input);
+  // Hand everything decoded so far to the sink rather than waiting for the ring to fill
+  flush_window(&stream->window);
+  return result;
+}
+
+// Signal that no more slices follow. Fails if the stream is truncated.
+int finish_zlib_stream(Zlib_Stream* stream) {
+  stream->inflate.final_input = 1;
+  int result = run_zlib_stream(stream);
+  if (result == INFLATE_NEED_INPUT) {
+    fprintf(stderr, "Error: Zlib stream is truncated\n");
+    stream->mode = ZLIB_ERROR;
+    return INFLATE_FAILED;
+  }
+  flush_window(&stream->window);
+  return result;
 }
 
 uint8_t zlib_compression_levels[][39] = {
@@ -54,11 +180,15 @@ void print_stream_info(Zlib_Stream* stream) {
 Compression method: %s\n\
 Window size: %llu\n\
 Compression level: %s\n\
-Adler-32: %08X\n\
 ",
     stream->CMF.CM == 8 ? "Deflate" : "ERROR",
     LZ77_window_size(stream->CMF),
-    zlib_compression_levels[stream->FLG.FLEVEL],
-    stream->ADLER32
+    zlib_compression_levels[stream->FLG.FLEVEL]
   );
+  if (stream->mode == ZLIB_STOPPED) {
+    fprintf(stdout, "Adler-32: not checked, decoding stopped early\n");
+  }
+  else {
+    fprintf(stdout, "Adler-32: %08X\n", stream->ADLER32);
+  }
 }
@@ -28,12 +28,40 @@ typedef union {
   uint8_t byte;
 } FLG;
 
+// Part of the stream expected next
+typedef enum zlib_mode_enum {
+  ZLIB_HEADER,
+  ZLIB_DATA,
+  ZLIB_TRAILER,
+  ZLIB_DONE,
+  ZLIB_STOPPED, // The sink needed no more output, so the rest and the checksum were skipped
+  ZLIB_ERROR
+} ZlibMode;
+
+// Whether the decoded data is checked against the stream's Adler-32
+typedef enum zlib_checksum_enum {
+  ZLIB_VERIFY, // Sum the output as it is produced and compare with the trailer
+  ZLIB_TRUST   // Skip the checksum for trusted input
+} ZlibChecksum;
+
+// A zlib stream that may be split across several buffers, like the IDAT
+// chunks of a PNG. Must not be moved after init_zlib_stream.
 typedef struct zlib_stream_struct {
   CMF CMF; // Compression Method and Flags
   FLG FLG; // FLaGs
   uint32_t DICTID;
   uint32_t ADLER32;
+  ZlibMode mode;
+  ZlibChecksum checksum;
+  Window window;
+  InflateState inflate;
 } Zlib_Stream;
 
-void process_zlib_stream(uint8_t* data, uint32_t length, BitStream* output);
+void init_zlib_stream(Zlib_Stream* stream, BitStream* output, ZlibChecksum checksum);
+int init_zlib_stream_sink(Zlib_Stream* stream, window_sink sink, void* context, ZlibChecksum checksum);
+int init_zlib_stream_arena(Zlib_Stream* stream, window_sink sink, void* context, ZlibChecksum checksum, Arena* arena);
+void reset_zlib_stream_sink(Zlib_Stream* stream, window_sink sink, void* context, ZlibChecksum checksum);
+void free_zlib_stream(Zlib_Stream* stream);
+int feed_zlib_stream(Zlib_Stream* stream, uint8_t* data, size_t length, size_t padding);
+int finish_zlib_stream(Zlib_Stream* stream);
 void print_stream_info(Zlib_Stream* stream);